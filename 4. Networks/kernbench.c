@@ -0,0 +1,388 @@
+/*********************************************************************************
+ * Filename: kernbench.c
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Checks every encryption kernel this CPU supports against the original scalar
+ * encrypt() and decrypt(), and checks that each one finds the first invalid
+ * character, then reports how many GB/s of input each one transforms. Then does
+ * the same for the shard pool running the selected kernel, and reports how long
+ * one job of the largest size takes with 1, 2, 4... threads, up to one per CPU.
+ * Last it checks the packed wire encoding against a plain bit by bit packer and
+ * reports how fast messages are packed and unpacked. Exits with 1 if anything
+ * gives a different result.
+ *
+ * USAGE: kernbench [megabytes]
+ *********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "otp_kernels.h"
+#include "otp_shards.h"
+#include "otp_pack.h"
+
+// Shortest time spent timing each kernel, in seconds
+#define BENCH_SECONDS 0.5
+
+// The original encrypt() from otp_enc_d.c. It changes input and key in place
+static void referenceEncrypt(char plaintext[], char key[], char ciphertext[], int size) {
+    int i;
+    for (i = 0; i < size; i++) {
+        if (plaintext[i] == ' ') {
+            plaintext[i] = '@';
+        }
+        if (key[i] == ' ') {
+            key[i] = '@';
+        }
+        int result = ((int)plaintext[i] - 64 + (int)key[i] - 64) % 27 + 64;
+        ciphertext[i] = (char)result;
+        if (ciphertext[i] == '@') {
+            ciphertext[i] = ' ';
+        }
+    }
+}
+
+// The original decrypt() from otp_dec_d.c. It changes input and key in place
+static void referenceDecrypt(char ciphertext[], char key[], char plaintext[], int size) {
+    int i;
+    for (i = 0; i < size; i++) {
+        if (ciphertext[i] == ' ') {
+            ciphertext[i] = '@';
+        }
+        if (key[i] == ' ') {
+            key[i] = '@';
+        }
+        int result = ((int)ciphertext[i] - 64 - ((int)key[i] - 64) + 27) % 27 + 64;
+        plaintext[i] = (char)result;
+        if (plaintext[i] == '@') {
+            plaintext[i] = ' ';
+        }
+    }
+}
+
+// Fills buffer with random capital letters and spaces
+static void randomText(char buffer[], size_t size) {
+    size_t i;
+    for (i = 0; i < size; i++) {
+        int value = rand() % 27;
+        buffer[i] = value == 0 ? ' ' : (char)(value + 64);
+    }
+}
+
+// Compares one kernel against the reference on input and key starting at
+// every offset and for every length up to size. Returns 0 on a mismatch
+static int checkRange(const struct otpKernel *kernel, const char input[], const char key[], size_t size) {
+    char inputCopy[size], keyCopy[size], expected[size], output[size + 1];
+    size_t offset, length;
+
+    for (offset = 0; offset < 4 && offset < size; offset++) {
+        for (length = 0; offset + length <= size; length++) {
+            memcpy(inputCopy, input + offset, length);
+            memcpy(keyCopy, key + offset, length);
+            referenceEncrypt(inputCopy, keyCopy, expected, length);
+
+            // The byte after the output must be left alone
+            output[length] = '#';
+            if (kernel->encrypt(input + offset, key + offset, output, length) != length ||
+                    memcmp(output, expected, length) || output[length] != '#') {
+                printf("%-8s encrypt differs at offset %zu length %zu\n", kernel->name, offset, length);
+                return 0;
+            }
+
+            memcpy(inputCopy, input + offset, length);
+            memcpy(keyCopy, key + offset, length);
+            referenceDecrypt(inputCopy, keyCopy, expected, length);
+            if (kernel->decrypt(input + offset, key + offset, output, length) != length ||
+                    memcmp(output, expected, length) || output[length] != '#') {
+                printf("%-8s decrypt differs at offset %zu length %zu\n", kernel->name, offset, length);
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// Puts bad characters into valid text of every length up to 300, in the input
+// or in the key, and checks that the kernel reports the first one.
+// Returns 0 on a mismatch
+static int checkInvalid(const struct otpKernel *kernel) {
+    static const char bad[] = {'@', '[', 'a', 'z', '0', '\n', '\0', '\x80', '\xff'};
+    char input[300], key[300], output[300];
+    char *target;
+    size_t length, first, second;
+    int i;
+
+    for (length = 1; length <= sizeof(input); length++) {
+        randomText(input, length);
+        randomText(key, length);
+
+        // A second bad character after the first must not be reported
+        target = length % 2 ? input : key;
+        first = rand() % length;
+        second = first + rand() % (length - first);
+        target[second] = bad[rand() % sizeof(bad)];
+        i = rand() % sizeof(bad);
+        target[first] = bad[i];
+
+        if (kernel->encrypt(input, key, output, length) != first ||
+                kernel->decrypt(input, key, output, length) != first) {
+            printf("%-8s missed bad character %d at %zu of %zu\n", kernel->name, bad[i], first, length);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Checks a kernel on every pair of characters, on random text of many lengths
+// and on text with bad characters, so the vector loops and their tails are all
+// covered
+static int checkKernel(const struct otpKernel *kernel) {
+    char input[27 * 27], key[27 * 27];
+    int i, j;
+
+    for (i = 0; i < 27; i++) {
+        for (j = 0; j < 27; j++) {
+            input[i * 27 + j] = i == 0 ? ' ' : (char)(i + 64);
+            key[i * 27 + j] = j == 0 ? ' ' : (char)(j + 64);
+        }
+    }
+    if (!checkRange(kernel, input, key, sizeof(input))) {
+        return 0;
+    }
+
+    randomText(input, 300);
+    randomText(key, 300);
+    return checkRange(kernel, input, key, 300) && checkInvalid(kernel);
+}
+
+// Checks the shard pool against the kernel alone on jobs around the shard
+// boundaries, with and without a bad character in one of the shards.
+// Returns 0 on a mismatch
+static int checkShards(struct shardPool *pool, const struct otpKernel *kernel) {
+    static const size_t sizes[] = {SHARD_THRESHOLD - 1, SHARD_THRESHOLD, SHARD_THRESHOLD + 1,
+                                   5 * SHARD_SIZE - 1, SIZE};
+    char input[SIZE], key[SIZE], expected[SIZE], output[SIZE];
+    size_t i, size, bad, valid;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        size = sizes[i];
+        randomText(input, size);
+        randomText(key, size);
+        kernel->encrypt(input, key, expected, size);
+        if (shardTransform(pool, kernel->encrypt, input, key, output, size) != size ||
+                memcmp(output, expected, size)) {
+            printf("shards   encrypt differs at length %zu\n", size);
+            return 0;
+        }
+
+        // Bad characters in two shards, only the first may be reported
+        bad = rand() % size;
+        key[bad + (size - bad) / 2] = '[';
+        input[bad] = 'a';
+        valid = shardTransform(pool, kernel->decrypt, input, key, output, size);
+        if (valid != bad) {
+            printf("shards   reported bad character at %zu instead of %zu of %zu\n", valid, bad, size);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Packs text one bit at a time, the way otp_pack.h describes it
+static void referencePack(const char text[], unsigned char packed[], size_t size) {
+    size_t i, bit = 0;
+    int value, b;
+
+    memset(packed, 0, packedSize(size));
+    for (i = 0; i < size; i += 3) {
+        value = text[i] == ' ' ? 0 : text[i] - 64;
+        if (i + 1 < size) {
+            value = value * 27 + (text[i + 1] == ' ' ? 0 : text[i + 1] - 64);
+        }
+        if (i + 2 < size) {
+            value = value * 27 + (text[i + 2] == ' ' ? 0 : text[i + 2] - 64);
+        } else {
+            value += i + 1 < size ? 19683 : 20412;
+        }
+        for (b = 0; b < 15; b++, bit++) {
+            packed[bit / 8] |= (value >> b & 1) << bit % 8;
+        }
+    }
+}
+
+// Packs and unpacks text of every length up to 300 and compares the result
+// with the reference, then checks that bad characters and bad packed data
+// are caught. Returns 0 on a mismatch
+static int checkPacking() {
+    char text[300], unpacked[300], packed[300];
+    unsigned char expected[300];
+    size_t length, bad, size;
+    int i, value;
+
+    for (length = 0; length <= sizeof(text); length++) {
+        randomText(text, length);
+        referencePack(text, expected, length);
+        size = packedSize(length);
+        if (packText(text, packed, length) != length || memcmp(packed, expected, size)) {
+            printf("pack     differs at length %zu\n", length);
+            return 0;
+        }
+        if (unpackedSize(packed, size) != (long long)length || !unpackText(packed, size, unpacked) ||
+                memcmp(unpacked, text, length)) {
+            printf("unpack   differs at length %zu\n", length);
+            return 0;
+        }
+        if (length == 0) {
+            continue;
+        }
+
+        // A short group in front of the last one, or a value no group can
+        // have, must be refused
+        for (i = 0; i < 2 && length > 3; i++) {
+            value = i == 0 ? 20000 : 30000;
+            packText(text, packed, length);
+            packed[0] = (char)value;
+            packed[1] = (char)((packed[1] & 0x80) | value >> 8);
+            if (unpackText(packed, size, unpacked)) {
+                printf("unpack   took group value %d at length %zu\n", value, length);
+                return 0;
+            }
+        }
+
+        bad = rand() % length;
+        text[bad] = 'a';
+        if (packText(text, packed, length) != bad) {
+            printf("pack     missed bad character at %zu of %zu\n", bad, length);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// packText() and unpackText() in the shape measure() takes, the key unused
+static size_t packMessage(const char input[], const char key[], char output[], size_t size) {
+    (void)key;
+    return packText(input, output, size);
+}
+
+static size_t unpackMessage(const char input[], const char key[], char output[], size_t size) {
+    (void)key;
+    return unpackText(input, size, output);
+}
+
+// Returns the time in seconds
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Runs transform over size bytes until BENCH_SECONDS have passed.
+// Returns the input transformed per second, in GB
+static double measure(kernelFunction transform, const char input[], const char key[], char output[], size_t size) {
+    double start = now(), elapsed;
+    long rounds = 0;
+
+    do {
+        transform(input, key, output, size);
+        rounds++;
+        elapsed = now() - start;
+    } while (elapsed < BENCH_SECONDS);
+    return rounds * (double)size / elapsed / 1e9;
+}
+
+// Runs jobs of size bytes on the pool, or on the kernel alone if pool is
+// NULL, until BENCH_SECONDS have passed. Returns the time per job, in us
+static double measureShards(struct shardPool *pool, kernelFunction transform, const char input[],
+                            const char key[], char output[], size_t size) {
+    double start = now(), elapsed;
+    long rounds = 0;
+
+    do {
+        if (pool != NULL) {
+            shardTransform(pool, transform, input, key, output, size);
+        } else {
+            transform(input, key, output, size);
+        }
+        rounds++;
+        elapsed = now() - start;
+    } while (elapsed < BENCH_SECONDS);
+    return elapsed / rounds * 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    size_t size = 16;
+    char *input, *key, *output;
+    const struct otpKernel *selected = selectKernel();
+    struct shardPool *pool;
+    double packRate, unpackRate;
+    int i, nThreads, nCpus = sysconf(_SC_NPROCESSORS_ONLN), failed = 0;
+
+    if (argc > 2 || (argc == 2 && atoi(argv[1]) <= 0)) {
+        fprintf(stderr, "USAGE: %s [megabytes]\n", argv[0]);
+        exit(1);
+    }
+    if (argc == 2) {
+        size = atoi(argv[1]);
+    }
+    size *= 1024 * 1024;
+
+    input = malloc(size);
+    key = malloc(size);
+    output = malloc(size);
+    srand(time(NULL));
+    randomText(input, size);
+    randomText(key, size);
+
+    printf("selected: %s\n", selected->name);
+    for (i = 0; i < otpKernelCount; i++) {
+        const struct otpKernel *kernel = &otpKernels[i];
+
+        if (!kernelSupported(kernel)) {
+            printf("%-8s not supported by this CPU\n", kernel->name);
+            continue;
+        }
+        if (!checkKernel(kernel)) {
+            failed = 1;
+            continue;
+        }
+        printf("%-8s encrypt %6.2f GB/s   decrypt %6.2f GB/s\n", kernel->name,
+               measure(kernel->encrypt, input, key, output, size),
+               measure(kernel->decrypt, input, key, output, size));
+    }
+
+    // The pool must be right even with more threads than CPUs
+    pool = startShardPool(nCpus > 2 ? nCpus : 2);
+    if (pool == NULL) {
+        printf("shards   could not start the threads\n");
+        failed = 1;
+    } else if (!checkShards(pool, selected)) {
+        failed = 1;
+    }
+
+    if (!checkPacking()) {
+        failed = 1;
+    }
+
+    printf("one job of %d characters:\n", SIZE);
+    for (nThreads = 1; nThreads <= nCpus; nThreads = nThreads * 2 > nCpus && nThreads < nCpus ? nCpus : nThreads * 2) {
+        pool = startShardPool(nThreads);
+        printf("%3d threads encrypt %8.1f us   decrypt %8.1f us\n", nThreads,
+               measureShards(pool, selected->encrypt, input, key, output, SIZE),
+               measureShards(pool, selected->decrypt, input, key, output, SIZE));
+    }
+
+    // Unpacking needs what packing leaves in output
+    packRate = measure(packMessage, input, key, output, size);
+    unpackRate = measure(unpackMessage, output, key, input, packedSize(size)) * size / packedSize(size);
+    printf("packing  pack    %6.2f GB/s   unpack  %6.2f GB/s\n", packRate, unpackRate);
+
+    free(input);
+    free(key);
+    free(output);
+    return failed;
+}
@@ -4,25 +4,49 @@
  * Date:     3/17/2019
  *
  * This program creates a key file of specified length. The characters in the file
- * generated will be any of the 27 allowed characters, generated using the standard
- * UNIX randomization methods. It then outputs the key to stdout or to the output
- * file if specified.
- * 
+ * generated will be any of the 27 allowed characters, each equally likely, drawn
+ * from a ChaCha20 key stream seeded by the kernel (see otp_random.h). It then
+ * outputs the key and a newline to stdout or to the output file if specified.
+ * Keys of any length are made and written a buffer at a time.
+ *
+ * With --out FILE the key is written to FILE instead, and with --threads N it is
+ * split into N segments made at once. Each segment has a stream of its own,
+ * seeded separately, and its thread writes it straight to its place in the
+ * file with pwrite(). The file is allocated in full before any of them starts.
+ *
+ * With --pool SOCKET the key is not made here but taken from the keypoold
+ * listening on SOCKET, out of the reserve it made ahead of time.
+ *
  * USAGE: keygen [length] [> output file]
+ *        keygen [length] --out FILE [--threads N]
+ *        keygen [length] --pool SOCKET [--out FILE]
  *********************************************************************************/
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
-#define SIZE 128000
+#include "otp_random.h"
 
-// Generating the random number for key
-int randomNum(int min, int max) {
-    return rand() % (max - min + 1) + min;
-}
+#define BUFFER_SIZE (4 << 20)
+#define THREADS_MAX 256
+
+// Part of the key made by one thread
+struct segment {
+    int fd;
+    off_t offset;
+    long long length;
+    int failed;
+    pthread_t thread;
+};
 
 // Error function used for reporting issues
 void error(const char *msg, int exitStatus) {
@@ -30,44 +54,232 @@ void error(const char *msg, int exitStatus) {
     exit(exitStatus);
 }
 
-int main(int argc, char *argv[]) {
+// Writes all of buffer to fd, carrying on after partial writes
+void writeAll(int fd, const char buffer[], size_t size) {
+    ssize_t written;
 
-    char key[SIZE];
-    int fileLength, i;
-    time_t clock;
+    while (size > 0) {
+        written = write(fd, buffer, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        } else if (written < 0) {
+            error("keygen: ERROR writing output", 1);
+        }
+        buffer += written;
+        size -= written;
+    }
+}
 
-    // Check number of arguments 
-    if (argc < 2) {
-        error("keygen: ERROR missing argument", 1);
+// Writes all of buffer to fd at offset. Returns -1 on failure
+int writeAt(int fd, const char buffer[], size_t size, off_t offset) {
+    ssize_t written;
+
+    while (size > 0) {
+        written = pwrite(fd, buffer, size, offset);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        } else if (written < 0) {
+            return -1;
+        }
+        buffer += written;
+        size -= written;
+        offset += written;
     }
+    return 0;
+}
 
-    // Obtain file length from argument
-    sscanf(argv[1], "%d", &fileLength);
-    if (fileLength < 1) {
-        error("keygen: ERROR missing argument", 1);
+// Body of a segment's thread: makes its part of the key and writes it in place
+void *writeSegment(void *argument) {
+    struct segment *segment = argument;
+    struct keyStream stream;
+    long long left = segment->length;
+    off_t offset = segment->offset;
+    size_t size;
+    char *buffer = malloc(BUFFER_SIZE);
+
+    if (buffer == NULL || seedKeyStream(&stream) < 0) {
+        segment->failed = 1;
+        free(buffer);
+        return NULL;
+    }
+    while (left > 0) {
+        size = left < BUFFER_SIZE ? (size_t)left : BUFFER_SIZE;
+        fillKey(&stream, buffer, size);
+        if (writeAt(segment->fd, buffer, size, offset) < 0) {
+            segment->failed = 1;
+            break;
+        }
+        left -= size;
+        offset += size;
     }
+    free(buffer);
+    return NULL;
+}
 
-    // Seed random number generator
-    srand((unsigned)time(&clock));
+// Writes a key of fileLength characters and a newline to outFile, split
+// between threads segments of whole buffers
+void writeFile(const char *outFile, long long fileLength, int threads) {
+    struct segment segments[THREADS_MAX];
+    long long segmentLength;
+    off_t offset = 0;
+    int fd, i, failed = 0;
 
-    // Generate key
-    memset(key, '\0', SIZE);
-    for (i = 0; i < fileLength; i++) {
-        key[i] = (char)randomNum(64, 90);
+    fd = open(outFile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        error("keygen: ERROR cannot open file", 1);
+    }
 
-        // We use '@' to represent [space]
-        // Replace '@' with blank space, ' '
-        if (key[i] == '@') {
-            key[i] = ' ';
+    // Allocate the whole file up front, so the segments do not fragment it.
+    // Not every file system can, and pwrite() works regardless
+    if (fallocate(fd, 0, 0, fileLength + 1) < 0 && errno != EOPNOTSUPP) {
+        error("keygen: ERROR cannot allocate file", 1);
+    }
+
+    segmentLength = (fileLength + threads - 1) / threads;
+    segmentLength = (segmentLength + BUFFER_SIZE - 1) / BUFFER_SIZE * BUFFER_SIZE;
+    for (i = 0; i < threads && offset < fileLength; i++) {
+        segments[i].fd = fd;
+        segments[i].offset = offset;
+        segments[i].length = fileLength - offset < segmentLength ? fileLength - offset : segmentLength;
+        segments[i].failed = 0;
+        offset += segments[i].length;
+        if (pthread_create(&segments[i].thread, NULL, writeSegment, &segments[i]) != 0) {
+            error("keygen: ERROR cannot start thread", 1);
         }
     }
+    threads = i;
 
-    // Add newline to key
-    key[fileLength] = '\n';
-    fileLength++;
+    for (i = 0; i < threads; i++) {
+        pthread_join(segments[i].thread, NULL);
+        failed |= segments[i].failed;
+    }
+    if (failed || writeAt(fd, "\n", 1, fileLength) < 0 || close(fd) < 0) {
+        error("keygen: ERROR writing output", 1);
+    }
+}
 
-    // Output key
-    write(STDOUT_FILENO, key, fileLength);
+// Takes a key of fileLength characters and its newline from the keypoold at
+// socketPath, and writes it to outFile, or to stdout if there is none
+void fetchKey(const char *socketPath, const char *outFile, long long fileLength) {
+    struct sockaddr_un serverAddress;
+    char request[32], *buffer;
+    long long left = fileLength + 1;
+    ssize_t received;
+    int socketFD, outFD = STDOUT_FILENO;
+
+    memset(&serverAddress, 0, sizeof(serverAddress));
+    serverAddress.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(serverAddress.sun_path)) {
+        error("keygen: ERROR socket path too long", 1);
+    }
+    strcpy(serverAddress.sun_path, socketPath);
+    socketFD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socketFD < 0 || connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) {
+        error("keygen: ERROR cannot connect to key pool", 2);
+    }
+    snprintf(request, sizeof(request), "%lld\n", fileLength);
+    writeAll(socketFD, request, strlen(request));
+
+    if (outFile != NULL) {
+        outFD = open(outFile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (outFD < 0) {
+            error("keygen: ERROR cannot open file", 1);
+        }
+    }
+    buffer = malloc(BUFFER_SIZE);
+    if (buffer == NULL) {
+        error("keygen: ERROR out of memory", 1);
+    }
+
+    // The reply is the key and its newline, or "?" if the pool refused
+    while (left > 0) {
+        received = read(socketFD, buffer, left < BUFFER_SIZE ? (size_t)left : BUFFER_SIZE);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        } else if (received <= 0) {
+            error("keygen: ERROR key pool closed the connection", 2);
+        } else if (left == fileLength + 1 && buffer[0] == '?') {
+            error("keygen: ERROR key pool refused the length", 1);
+        }
+        writeAll(outFD, buffer, received);
+        left -= received;
+    }
+    if (outFD != STDOUT_FILENO && close(outFD) < 0) {
+        error("keygen: ERROR writing output", 1);
+    }
+    close(socketFD);
+    free(buffer);
+}
+
+int main(int argc, char *argv[]) {
+    struct keyStream stream;
+    long long fileLength = 0;
+    int threads = 1;
+    const char *outFile = NULL, *poolSocket = NULL;
+    size_t size;
+    char *buffer, *end;
+    int i;
+
+    // Check usage & args
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+            if (threads < 1 || threads > THREADS_MAX) {
+                error("keygen: ERROR bad number of threads", 1);
+            }
+        } else if (!strcmp(argv[i], "--out") && i + 1 < argc) {
+            outFile = argv[++i];
+        } else if (!strcmp(argv[i], "--pool") && i + 1 < argc) {
+            poolSocket = argv[++i];
+        } else {
+            // Obtain file length from argument
+            fileLength = strtoll(argv[i], &end, 10);
+            if (end == argv[i]) {
+                fileLength = 0;
+            }
+        }
+    }
+    if (fileLength < 1) {
+        error("keygen: ERROR missing argument", 1);
+    }
+
+    // The pool made the key already, threads have nothing to do
+    if (poolSocket != NULL) {
+        if (threads > 1) {
+            error("keygen: ERROR --threads cannot be used with --pool", 1);
+        }
+        fetchKey(poolSocket, outFile, fileLength);
+        return 0;
+    }
+
+    // Threads write their segments in place, which stdout may not allow
+    if (outFile != NULL) {
+        writeFile(outFile, fileLength, threads);
+        return 0;
+    } else if (threads > 1) {
+        error("keygen: ERROR --threads needs --out", 1);
+    }
+
+    // Seed the generator
+    if (seedKeyStream(&stream) < 0) {
+        error("keygen: ERROR no randomness available", 1);
+    }
+
+    // Generate the key a buffer at a time, with room for the newline after
+    // the last one
+    buffer = malloc(BUFFER_SIZE + 1);
+    if (buffer == NULL) {
+        error("keygen: ERROR out of memory", 1);
+    }
+    while (fileLength > 0) {
+        size = fileLength < BUFFER_SIZE ? (size_t)fileLength : BUFFER_SIZE;
+        fillKey(&stream, buffer, size);
+        fileLength -= size;
+        if (fileLength == 0) {
+            buffer[size++] = '\n';
+        }
+        writeAll(STDOUT_FILENO, buffer, size);
+    }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,417 @@
+/*********************************************************************************
+ * Filename: keypoold.c
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * This program runs in the background as a daemon. It keeps a reserve of key
+ * characters in a pool file (see otp_keypool.h), topped up by a thread of its
+ * own, and hands them out over a local socket, so a key is ready the moment
+ * it is asked for. No character is ever handed out twice.
+ *
+ * A client writes the length it wants followed by a newline, and gets back
+ * that many characters and a newline, just as keygen would have written them,
+ * or "?" and a newline if the length is no good. It may ask again on the same
+ * connection. Keys are sent straight from the mapped pool a piece at a time,
+ * and clients take turns piece by piece, so a huge key does not hold up a
+ * small one.
+ *
+ * USAGE: keypoold [socket path] --pool FILE [--reserve CHARS] &
+ *********************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include "otp_keypool.h"
+
+#define REQUEST_MAX 32                  // Longest request line
+#define PIECE_MAX (1 << 20)             // Most characters issued to a client at once
+#define RESERVE_DEFAULT (64 << 20)
+#define MAX_EVENTS 64
+
+// Where a client is in its request
+enum clientState {
+    CLIENT_READING,                     // Waiting for a request line
+    CLIENT_WAITING,                     // Queued for characters
+    CLIENT_SENDING,                     // Sending a piece
+    CLIENT_ENDING                       // Sending the newline, or "?"
+};
+
+struct client {
+    int fd;
+    enum clientState state;
+    char request[REQUEST_MAX];
+    int requestLength;
+    unsigned long long remaining;       // Characters asked for and not issued yet
+    uint64_t sendPosition;              // Next character of the piece to send
+    uint64_t pieceEnd;
+    const char *ending;                 // Rest of the newline or "?\n" to send
+    int refused;                        // Asked for a bad length
+    struct client *nextWaiting;
+    struct client *previousSending;     // Clients sending a piece, in the order
+    struct client *nextSending;         // their pieces were issued
+};
+
+// Clients in line for characters, served in turn
+static struct client *waitingHead = NULL, *waitingTail = NULL;
+
+// Clients sending a piece, oldest piece first
+static struct client *sendingHead = NULL, *sendingTail = NULL;
+
+static struct keyPool pool;
+static int epollFD;
+
+// Error function used for reporting issues
+void error(const char *msg, int exitStatus) {
+    fprintf(stderr, "%s\n", msg);
+    exit(exitStatus);
+}
+
+// Changes the events a client is woken for
+void watchClient(struct client *client, uint32_t events) {
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = client;
+    epoll_ctl(epollFD, EPOLL_CTL_MOD, client->fd, &event);
+}
+
+// Puts a client at the back of the line for characters
+void queueClient(struct client *client) {
+    client->state = CLIENT_WAITING;
+    client->nextWaiting = NULL;
+    if (waitingTail == NULL) {
+        waitingHead = client;
+    } else {
+        waitingTail->nextWaiting = client;
+    }
+    waitingTail = client;
+    watchClient(client, 0);
+}
+
+// Takes a client out of the sending list, and gives the places of whatever
+// has been sent back to the refill thread
+void stopSending(struct client *client) {
+    if (client->previousSending == NULL) {
+        sendingHead = client->nextSending;
+    } else {
+        client->previousSending->nextSending = client->nextSending;
+    }
+    if (client->nextSending == NULL) {
+        sendingTail = client->previousSending;
+    } else {
+        client->nextSending->previousSending = client->previousSending;
+    }
+    releaseKey(&pool, sendingHead == NULL ? pool.head : sendingHead->sendPosition);
+}
+
+// Closes a client. Characters issued to it and not sent are lost for good
+void closeClient(struct client *client) {
+    struct client **link;
+
+    if (client->state == CLIENT_SENDING) {
+        stopSending(client);
+    } else if (client->state == CLIENT_WAITING) {
+        for (link = &waitingHead; *link != client; link = &(*link)->nextWaiting);
+        *link = client->nextWaiting;
+        if (waitingTail == client) {
+            waitingTail = NULL;
+            for (client = waitingHead; client != NULL; client = client->nextWaiting) {
+                waitingTail = client;
+            }
+        }
+    }
+    close(client->fd);
+    free(client);
+}
+
+// Reads the next request line from a client. Returns 0 if the client has to
+// be closed
+int readRequest(struct client *client);
+
+// Sends the rest of the newline or "?\n". Returns 0 if the client has to be
+// closed
+int sendEnding(struct client *client) {
+    ssize_t sent;
+
+    client->state = CLIENT_ENDING;
+    while (*client->ending != '\0') {
+        sent = send(client->fd, client->ending, strlen(client->ending), MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        } else if (sent < 0 && errno == EAGAIN) {
+            watchClient(client, EPOLLOUT);
+            return 1;
+        } else if (sent < 0) {
+            return 0;
+        }
+        client->ending += sent;
+    }
+
+    // A client that asked for a bad length is not heard again
+    if (client->refused) {
+        return 0;
+    }
+    client->state = CLIENT_READING;
+    watchClient(client, EPOLLIN);
+    return readRequest(client);
+}
+
+// Sends as much of a client's piece as the socket takes, then lines the
+// client up for the next one. Returns 0 if the client has to be closed
+int sendPiece(struct client *client) {
+    struct iovec iov[2];
+    struct msghdr message;
+    ssize_t sent;
+
+    while (client->sendPosition < client->pieceEnd) {
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = iov;
+        message.msg_iovlen = keyVector(&pool, client->sendPosition, client->pieceEnd, iov);
+        sent = sendmsg(client->fd, &message, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        } else if (sent < 0 && errno == EAGAIN) {
+            watchClient(client, EPOLLOUT);
+            return 1;
+        } else if (sent < 0) {
+            return 0;
+        }
+        client->sendPosition += sent;
+        if (client == sendingHead) {
+            releaseKey(&pool, client->sendPosition);
+        }
+    }
+
+    stopSending(client);
+    if (client->remaining > 0) {
+        queueClient(client);
+        return 1;
+    }
+    client->ending = "\n";
+    return sendEnding(client);
+}
+
+// Issues a piece to each client in line in turn while there are characters
+// to give. A client closed on the way is closed here
+void serveWaiting() {
+    struct client *client;
+    uint64_t size, available;
+
+    while (waitingHead != NULL && (available = availableKey(&pool)) > 0) {
+        client = waitingHead;
+        size = client->remaining < available ? client->remaining : available;
+        size = size < PIECE_MAX ? size : PIECE_MAX;
+        if (issueKey(&pool, size, &client->sendPosition) < 0) {
+            error("keypoold: ERROR cannot save the pool", 2);
+        }
+        waitingHead = client->nextWaiting;
+        if (waitingHead == NULL) {
+            waitingTail = NULL;
+        }
+
+        client->state = CLIENT_SENDING;
+        client->pieceEnd = client->sendPosition + size;
+        client->remaining -= size;
+        client->nextSending = NULL;
+        client->previousSending = sendingTail;
+        if (sendingTail == NULL) {
+            sendingHead = client;
+        } else {
+            sendingTail->nextSending = client;
+        }
+        sendingTail = client;
+        if (!sendPiece(client)) {
+            closeClient(client);
+        }
+    }
+}
+
+// Reads the next request line from a client. Returns 0 if the client has to
+// be closed
+int readRequest(struct client *client) {
+    char *newline, *end;
+    ssize_t received;
+    long long length;
+    int used, refused;
+
+    while ((newline = memchr(client->request, '\n', client->requestLength)) == NULL) {
+        if (client->requestLength == REQUEST_MAX) {
+            return 0;
+        }
+        received = recv(client->fd, client->request + client->requestLength,
+                        REQUEST_MAX - client->requestLength, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        } else if (received < 0 && errno == EAGAIN) {
+            return 1;
+        } else if (received <= 0) {
+            return 0;
+        }
+        client->requestLength += received;
+    }
+
+    *newline = '\0';
+    length = strtoll(client->request, &end, 10);
+    refused = end == client->request || *end != '\0' || length < 1;
+    used = newline + 1 - client->request;
+    client->requestLength -= used;
+    memmove(client->request, newline + 1, client->requestLength);
+    if (refused) {
+        client->refused = 1;
+        client->ending = "?\n";
+        return sendEnding(client);
+    }
+
+    client->remaining = length;
+    queueClient(client);
+    return 1;
+}
+
+// Accepts every client waiting on the listening socket
+void acceptClients(int listenSocketFD) {
+    struct epoll_event event;
+    struct client *client;
+    int fd;
+
+    while ((fd = accept4(listenSocketFD, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        client = calloc(1, sizeof(*client));
+        if (client == NULL) {
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        client->state = CLIENT_READING;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = client;
+        epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &event);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_un address;
+    struct epoll_event event, events[MAX_EVENTS];
+    struct client *client;
+    const char *socketPath = NULL, *poolPath = NULL;
+    unsigned long long reserve = RESERVE_DEFAULT;
+    uint64_t count;
+    int listenSocketFD, nEvents, i, alive;
+    char *end;
+
+    // Check usage & args
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--pool") && i + 1 < argc) {
+            poolPath = argv[++i];
+        } else if (!strcmp(argv[i], "--reserve") && i + 1 < argc) {
+            reserve = strtoull(argv[++i], &end, 10);
+            if (*end != '\0' || reserve < 1) {
+                error("keypoold: ERROR bad reserve", 1);
+            }
+        } else {
+            socketPath = argv[i];
+        }
+    }
+    if (socketPath == NULL || poolPath == NULL) {
+        error("USAGE: keypoold socket_path --pool FILE [--reserve CHARS]", 1);
+    }
+
+    // Open the pool and start filling it
+    if (openKeyPool(&pool, poolPath, reserve) < 0) {
+        error("keypoold: ERROR cannot open pool", 1);
+    }
+    if (startRefill(&pool) < 0) {
+        error("keypoold: ERROR cannot start refill thread", 1);
+    }
+
+    // Set up the socket, replacing one left behind by an earlier run
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        error("keypoold: ERROR socket path too long", 1);
+    }
+    strcpy(address.sun_path, socketPath);
+    listenSocketFD = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenSocketFD < 0) {
+        error("keypoold: ERROR opening socket", 1);
+    }
+    unlink(socketPath);
+    if (bind(listenSocketFD, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        error("keypoold: ERROR on binding", 2);
+    }
+    if (listen(listenSocketFD, SOMAXCONN) < 0) {
+        error("keypoold: ERROR cannot listen call", 2);
+    }
+
+    // A client hanging up must not kill the whole daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    epollFD = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFD < 0) {
+        error("keypoold: ERROR cannot create epoll instance", 1);
+    }
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL; // The listening socket
+    epoll_ctl(epollFD, EPOLL_CTL_ADD, listenSocketFD, &event);
+    event.data.ptr = &pool; // The refill thread made a chunk
+    epoll_ctl(epollFD, EPOLL_CTL_ADD, pool.notifyFD, &event);
+
+    while (1) {
+        nEvents = epoll_wait(epollFD, events, MAX_EVENTS, -1);
+        if (nEvents < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error("keypoold: ERROR epoll_wait failed", 2);
+        }
+
+        for (i = 0; i < nEvents; i++) {
+            client = events[i].data.ptr;
+            if (client == NULL) {
+                acceptClients(listenSocketFD);
+                continue;
+            }
+            if (events[i].data.ptr == &pool) {
+                if (read(pool.notifyFD, &count, sizeof(count)) < 0) {
+                    // Nothing to clear, another event got there first
+                }
+                if (__atomic_load_n(&pool.failed, __ATOMIC_ACQUIRE)) {
+                    error("keypoold: ERROR refill thread stopped", 2);
+                }
+                continue;
+            }
+
+            // A client that hung up cannot be sent anything, and one waiting
+            // in line would be woken for it over and over
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                alive = 0;
+            } else if (client->state == CLIENT_READING) {
+                alive = readRequest(client);
+            } else if (client->state == CLIENT_SENDING) {
+                alive = sendPiece(client);
+            } else if (client->state == CLIENT_ENDING) {
+                alive = sendEnding(client);
+            } else {
+                alive = 1;
+            }
+            if (!alive) {
+                closeClient(client);
+            }
+        }
+
+        // Hand out whatever the refill thread has made to the clients in line
+        serveWaiting();
+    }
+
+    return 0;
+}
@@ -0,0 +1,1748 @@
+/*********************************************************************************
+ * Filename: libotp.c
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * The asynchronous client library (see libotp.h). Every session of the pool
+ * is a non-blocking socket registered with the client's own epoll instance,
+ * which is the descriptor handed out by otpFD(). A session asks for EPOLLOUT
+ * only while it has jobs not all sent.
+ *
+ * Jobs are sent with one sendmsg() for up to SEND_BATCH of them, the iovecs
+ * pointing at the caller's input and key. Results are read the other way
+ * round: the header of the next frame and the output of the oldest job go
+ * into one readv(), since that frame is almost always its result. When it
+ * turns out to be an error instead, whatever was read past the header is the
+ * error text and maybe the start of the next frame, which is set aside and
+ * handled before reading again. In a packed session the input and key are
+ * packed into a buffer of the job's own when it is submitted, and the result
+ * is read there too and unpacked into the output.
+ *
+ * Storing and streaming take the sessions over until they are done, waiting
+ * in poll() on their sockets rather than in epoll. Streamed chunks go from
+ * the page cache to the socket with sendfile() unless they have to be packed,
+ * and results are read as many frames at a time as have come in. A stream
+ * over a session sharing a region with a local daemon is read straight into
+ * the region in requests of SHARED_SLOT / 2 characters instead, and the region
+ * is split in two banks of slots: the next bank is read in while the daemon
+ * transforms the last one.
+ *********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "libotp.h"
+#include "otp_local.h"
+#include "otp_pack.h"
+
+#define SEND_BATCH 16           // Most jobs sent in one sendmsg()
+#define EVENT_BATCH 64          // Most sessions handled per epoll_wait()
+#define SHARED_SLOT (LOCAL_DATA_SIZE / LOCAL_RING_ENTRIES)  // Region bytes of each request of a stream
+#define SHARED_BANK (LOCAL_RING_ENTRIES / 2)                // Requests of a stream rung at once
+
+struct pooledSession {
+    struct otpClient *client;
+    char *address;              // Port or socket path
+    int fd;                     // -1 while closed
+    uint32_t events;            // Registered with epoll
+    uint32_t nextTag;
+    int packed;                 // Whether messages are packed on the wire
+    struct localRegion *region; // Region shared with a local daemon, if it agreed
+    struct otpJob *head;        // Jobs in flight, oldest first
+    struct otpJob *tail;
+    struct otpJob *unsent;      // First job not all sent, NULL if none
+    size_t sentBytes;           // Bytes of it already sent
+    int inFlight;
+    char header[OTP_HEADER_SIZE];   // Frame being received
+    int headerGot;
+    struct frameHeader frame;
+    char *payload;              // Where its payload goes
+    uint32_t payloadGot;
+    char *scratch;              // Payloads that are not results, OTP_JOB_MAX bytes
+    char *carry;                // Bytes read past an error, handled before reading again
+    int carryStart;
+    int carryEnd;
+    char *chunk;                // Text of a packed stream chunk, OTP_CHUNK_SIZE bytes
+    char *packedChunk;          // Its input and key packed
+};
+
+struct otpClient {
+    char *name;
+    int flags;
+    int epollFD;
+    struct pooledSession *sessions;
+    int count;
+    int pending;                // Jobs submitted and not finished
+    unsigned long finished;     // Jobs finished so far
+    struct otpJob *calling;     // Finished jobs whose callbacks are due, oldest first
+    struct otpJob *callingTail;
+    struct otpJob *ready;       // Finished jobs without a callback, for otpTake()
+    struct otpJob *readyTail;
+};
+
+// A frame whose payload is sent straight from files
+struct fileFrame {
+    struct iovec iov[3];        // Header and anything sent before the files
+    struct iovec *pending;      // Part of iov still to send
+    int nPending;
+    int fd[2];                  // Files the rest of the payload comes from
+    off_t offset[2];
+    size_t left[2];             // Bytes of each file still to send
+    int nFiles;
+    int current;                // File being sent
+};
+
+// Bytes received on a version 1 connection and not taken yet
+struct lineReader {
+    int fd;
+    char *buffer;
+    int start;
+    int end;
+    int capacity;
+};
+
+// Where a streamed job is up to on one session
+struct stream {
+    struct pooledSession *session;
+    int inputFD;
+    int keyFD;
+    int outputFD;
+    off_t start;                // Offset of the job in the input and key
+    long long size;
+    long long sent;             // Characters framed so far
+    long long received;         // Characters of result written so far
+    off_t outputOffset;         // Where the result goes, -1 to write it in order
+    uint32_t tag;
+    char encoded[OTP_HEADER_SIZE];
+    struct fileFrame frame;     // Chunk being sent
+    int pending;                // Whether the chunk is not all sent yet
+    int allSent;
+    int finished;
+};
+
+// Copies a reason into an error buffer
+static void setError(char error[OTP_ERROR_MAX], const char *reason, int length) {
+    if (length > OTP_ERROR_MAX - 1) {
+        length = OTP_ERROR_MAX - 1;
+    }
+    memcpy(error, reason, length);
+    error[length] = '\0';
+}
+
+// Appends a job to a list
+static void appendJob(struct otpJob **head, struct otpJob **tail, struct otpJob *job) {
+    job->next = NULL;
+    if (*tail != NULL) {
+        (*tail)->next = job;
+    } else {
+        *head = job;
+    }
+    *tail = job;
+}
+
+// Finishes a job, queueing it for its callback or for otpTake()
+static void finishJob(struct otpClient *client, struct otpJob *job, enum otpStatus status, const char *reason,
+                      int length) {
+    job->status = status;
+    if (status == OTP_FAILED) {
+        setError(job->error, reason, length);
+    }
+    free(job->packed);
+    job->packed = NULL;
+    client->pending--;
+    client->finished++;
+    if (job->done != NULL) {
+        appendJob(&client->calling, &client->callingTail, job);
+    } else {
+        appendJob(&client->ready, &client->readyTail, job);
+    }
+}
+
+// Closes a session and fails every job in flight on it. Returns -1
+static int failSession(struct pooledSession *session, const char *reason, int length) {
+    struct otpJob *job;
+
+    close(session->fd);
+    session->fd = -1;
+    if (session->region != NULL) {
+        unmapRegion(session->region);
+        session->region = NULL;
+    }
+    while (session->head != NULL) {
+        job = session->head;
+        session->head = job->next;
+        finishJob(session->client, job, OTP_FAILED, reason, length);
+    }
+    session->tail = NULL;
+    session->unsent = NULL;
+    session->inFlight = 0;
+    session->headerGot = 0;
+    session->carryStart = 0;
+    session->carryEnd = 0;
+    return -1;
+}
+
+// Whether an address is the path of a local socket rather than a port
+static int isLocalAddress(const char *address) {
+    return strchr(address, '/') != NULL;
+}
+
+// Connects to the local socket at address and maps the region the daemon
+// offers at *region, or sets it to NULL if it offers none. Returns the socket,
+// or -1 with error filled in
+static int connectLocal(const char *address, struct localRegion **region, char error[OTP_ERROR_MAX]) {
+    struct sockaddr_un serverAddress;
+    int socketFD;
+
+    memset(&serverAddress, 0, sizeof(serverAddress));
+    serverAddress.sun_family = AF_UNIX;
+    if (strlen(address) >= sizeof(serverAddress.sun_path)) {
+        setError(error, "socket path too long", strlen("socket path too long"));
+        return -1;
+    }
+    strcpy(serverAddress.sun_path, address);
+
+    socketFD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socketFD < 0 || connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) {
+        setError(error, "connecting", strlen("connecting"));
+        close(socketFD);
+        return -1;
+    }
+
+    // A daemon that refuses us answers "?" instead
+    if (!receiveRegion(socketFD, region)) {
+        setError(error, "unexpected reply from server", strlen("unexpected reply from server"));
+        close(socketFD);
+        return -1;
+    }
+    return socketFD;
+}
+
+// Connects to localhost on the port in address. Returns the socket, or -1 with
+// error filled in
+static int connectPort(const char *address, char error[OTP_ERROR_MAX]) {
+    struct sockaddr_in serverAddress;
+    int socketFD, on = 1;
+
+    memset(&serverAddress, 0, sizeof(serverAddress));
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(atoi(address));
+    serverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    socketFD = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socketFD < 0 || connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) {
+        setError(error, "connecting", strlen("connecting"));
+        close(socketFD);
+        return -1;
+    }
+
+    // Pipelined jobs must not wait for the acknowledgement of the last ones
+    setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return socketFD;
+}
+
+// Sends the HELLO frame asking for flags and waits for the daemon's answer, on
+// a blocking socket. Sets *agreed to the flags the daemon answered with.
+// Returns OTP_DONE, or OTP_FAILED or OTP_VERSION_1 with error filled in
+static enum otpStatus sayHello(int socketFD, const char *name, int flags, int *agreed,
+                               char error[OTP_ERROR_MAX]) {
+    struct frameHeader header;
+    uint32_t magic = htonl(OTP_MAGIC);
+    char hello[OTP_HEADER_SIZE + 16];
+    char text[OTP_ERROR_MAX];
+    int size = strlen(name), got, length;
+    ssize_t received;
+
+    if (size > 15) {
+        setError(error, "name too long", strlen("name too long"));
+        return OTP_FAILED;
+    }
+
+    // The trailing newline makes a version 1 daemon see a complete (wrong)
+    // authentication, which it answers with "?"
+    makeHeader(&header, OP_HELLO, 0, size + 1);
+    header.flags = flags;
+    encodeHeader(hello, &header);
+    memcpy(hello + OTP_HEADER_SIZE, name, size);
+    hello[OTP_HEADER_SIZE + size] = '\n';
+    if (send(socketFD, hello, OTP_HEADER_SIZE + size + 1, MSG_NOSIGNAL) != OTP_HEADER_SIZE + size + 1) {
+        setError(error, "writing to socket", strlen("writing to socket"));
+        return OTP_FAILED;
+    }
+
+    // A version 1 daemon answers "?" and may keep the connection open, so
+    // give up as soon as the answer stops looking like a frame
+    for (got = 0; got < OTP_HEADER_SIZE; got += received) {
+        received = recv(socketFD, hello + got, OTP_HEADER_SIZE - got, 0);
+        if (received < 0 && errno == EINTR) {
+            received = 0;
+            continue;
+        }
+        if (received <= 0) {
+            setError(error, "connection closed by server", strlen("connection closed by server"));
+            return OTP_FAILED;
+        }
+        if (memcmp(hello, &magic, got + received < 4 ? got + received : 4)) {
+            setError(error, "daemon does not speak version 2", strlen("daemon does not speak version 2"));
+            return OTP_VERSION_1;
+        }
+    }
+    decodeHeader(hello, &header);
+
+    // Keep as much of the payload as an error has room for
+    for (got = 0; got < (int)header.length; got += received) {
+        length = (int)header.length - got;
+        if (got < OTP_ERROR_MAX) {
+            received = recv(socketFD, text + got, length < OTP_ERROR_MAX - got ? length : OTP_ERROR_MAX - got, 0);
+        } else {
+            received = recv(socketFD, hello, length < OTP_HEADER_SIZE ? length : OTP_HEADER_SIZE, 0);
+        }
+        if (received < 0 && errno == EINTR) {
+            received = 0;
+            continue;
+        }
+        if (received <= 0) {
+            setError(error, "connection closed by server", strlen("connection closed by server"));
+            return OTP_FAILED;
+        }
+    }
+
+    if (header.op == OP_ERROR) {
+        setError(error, text, got);
+        return OTP_FAILED;
+    } else if (header.op != OP_HELLO || header.version < 2) {
+        setError(error, "unexpected reply from server", strlen("unexpected reply from server"));
+        return OTP_FAILED;
+    }
+    *agreed = header.flags;
+    return OTP_DONE;
+}
+
+// Connects a session of the pool and registers it with epoll. Packing is
+// asked for if the client wants it, and sharing whenever a local daemon
+// offers a region. Returns OTP_DONE, or OTP_FAILED or OTP_VERSION_1 with error
+// filled in
+static enum otpStatus openPooled(struct pooledSession *session, char error[OTP_ERROR_MAX]) {
+    struct epoll_event event;
+    struct localRegion *region = NULL;
+    enum otpStatus status;
+    int socketFD, flags, agreed = 0;
+
+    if (isLocalAddress(session->address)) {
+        socketFD = connectLocal(session->address, &region, error);
+    } else {
+        socketFD = connectPort(session->address, error);
+    }
+    if (socketFD < 0) {
+        return OTP_FAILED;
+    }
+    flags = (session->client->flags & OTP_PACKED ? FLAG_PACKED : 0) | (region != NULL ? FLAG_SHARED : 0);
+    status = sayHello(socketFD, session->client->name, flags, &agreed, error);
+    if (status != OTP_DONE) {
+        if (region != NULL) {
+            unmapRegion(region);
+        }
+        close(socketFD);
+        return status;
+    }
+    if (region != NULL && !(agreed & FLAG_SHARED)) {
+        unmapRegion(region);
+        region = NULL;
+    }
+
+    fcntl(socketFD, F_SETFL, fcntl(socketFD, F_GETFL) | O_NONBLOCK);
+    event.events = EPOLLIN;
+    event.data.ptr = session;
+    if (epoll_ctl(session->client->epollFD, EPOLL_CTL_ADD, socketFD, &event) < 0) {
+        setError(error, "watching socket", strlen("watching socket"));
+        if (region != NULL) {
+            unmapRegion(region);
+        }
+        close(socketFD);
+        return OTP_FAILED;
+    }
+    session->fd = socketFD;
+    session->events = EPOLLIN;
+    session->nextTag = 1;
+    session->packed = (flags & FLAG_PACKED) && (agreed & FLAG_PACKED);
+    session->region = region;
+    return OTP_DONE;
+}
+
+// Opens count sessions as name ("otp_enc" or "otp_dec"), handing out the
+// daemon addresses listed in addresses ("address[,address...]", each a port on
+// localhost or the path of a local socket) in turn. flags is 0 or OTP_PACKED.
+// Blocks until every session is open. Returns NULL and fills in error if any
+// of them fails, and status (unless NULL) with OTP_VERSION_1 if it was because
+// the daemon only speaks version 1, OTP_FAILED otherwise
+struct otpClient *otpConnect(const char *name, const char *addresses, int count, int flags,
+                             enum otpStatus *status, char error[OTP_ERROR_MAX]) {
+    enum otpStatus ignored;
+    struct otpClient *client;
+    const char *address = addresses;
+    size_t length;
+    int i;
+
+    if (status == NULL) {
+        status = &ignored;
+    }
+    *status = OTP_FAILED;
+    if (count < 1) {
+        setError(error, "bad number of connections", strlen("bad number of connections"));
+        return NULL;
+    }
+    client = calloc(1, sizeof(struct otpClient));
+    client->name = strdup(name);
+    client->flags = flags;
+    client->sessions = calloc(count, sizeof(struct pooledSession));
+    client->count = count;
+    client->epollFD = epoll_create1(EPOLL_CLOEXEC);
+    for (i = 0; i < count; i++) {
+        client->sessions[i].fd = -1;
+    }
+    if (client->epollFD < 0) {
+        setError(error, "watching socket", strlen("watching socket"));
+        otpClose(client);
+        return NULL;
+    }
+
+    for (i = 0; i < count; i++) {
+        length = strcspn(address, ",");
+        client->sessions[i].client = client;
+        client->sessions[i].address = strndup(address, length);
+        *status = openPooled(&client->sessions[i], error);
+        if (*status != OTP_DONE) {
+            otpClose(client);
+            return NULL;
+        }
+
+        // Back to the first address after the last
+        address = address[length] == ',' ? address + length + 1 : addresses;
+    }
+    return client;
+}
+
+// Splits vault:ID[:OFFSET] into the id and the offset, 0 if there is none.
+// Returns -1 if it is malformed
+static int parseKeyName(const char *keyName, const char **id, int *idLength, long long *offset) {
+    const char *colon;
+    char *end;
+
+    if (strncmp(keyName, "vault:", 6)) {
+        return -1;
+    }
+    *id = keyName + 6;
+    colon = strchr(*id, ':');
+    *idLength = colon != NULL ? colon - *id : (int)strlen(*id);
+    *offset = 0;
+    if (colon != NULL) {
+        *offset = strtoll(colon + 1, &end, 10);
+        if (colon[1] == '\0' || *end != '\0' || *offset < 0) {
+            return -1;
+        }
+    }
+    if (*idLength < 1 || *idLength > OTP_KEY_ID_MAX) {
+        return -1;
+    }
+    return 0;
+}
+
+// Encodes the payload of a KEYREF frame for the job's vault:ID[:OFFSET]: the
+// offset followed by the key id. Returns -1 if the name is malformed
+static int keyReference(struct otpJob *job) {
+    const char *id;
+    long long offset;
+    uint32_t offsetHigh, offsetLow;
+    int idLength;
+
+    if (parseKeyName(job->keyName, &id, &idLength, &offset) < 0) {
+        return -1;
+    }
+    offsetHigh = htonl((uint32_t)(offset >> 32));
+    offsetLow = htonl((uint32_t)offset);
+    memcpy(job->reference, &offsetHigh, 4);
+    memcpy(job->reference + 4, &offsetLow, 4);
+    memcpy(job->reference + 8, id, idLength);
+    job->referenceSize = 8 + idLength;
+    return 0;
+}
+
+// Packs the input and key of a job for a packed session into a buffer of its
+// own, which its result is read into later. Packing also finds bad
+// characters, before anything is sent. Returns -1 if there is one
+static int packJob(struct otpJob *job) {
+    job->packedInput = packedSize(job->size);
+    job->packedKey = job->keyName != NULL ? 0 : job->packedInput;
+    job->packed = malloc(job->packedInput + job->packedKey > 0 ? job->packedInput + job->packedKey : 1);
+    if (packText(job->input, job->packed, job->size) < (size_t)job->size ||
+            (job->keyName == NULL && packText(job->key, job->packed + job->packedInput, job->size) < (size_t)job->size)) {
+        free(job->packed);
+        job->packed = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Points four iovecs at the INPUT and KEY or KEYREF frames of a job
+static void jobVector(struct otpJob *job, struct iovec iov[4]) {
+    iov[0].iov_base = job->encoded[0];
+    iov[0].iov_len = OTP_HEADER_SIZE;
+    iov[1].iov_base = job->packed != NULL ? job->packed : (char*)job->input;
+    iov[1].iov_len = job->packed != NULL ? job->packedInput : job->size;
+    iov[2].iov_base = job->encoded[1];
+    iov[2].iov_len = OTP_HEADER_SIZE;
+    if (job->keyName != NULL) {
+        iov[3].iov_base = job->reference;
+        iov[3].iov_len = job->referenceSize;
+    } else if (job->packed != NULL) {
+        iov[3].iov_base = job->packed + job->packedInput;
+        iov[3].iov_len = job->packedKey;
+    } else {
+        iov[3].iov_base = (char*)job->key;
+        iov[3].iov_len = job->size;
+    }
+}
+
+// Bytes of the frames of a job
+static size_t jobBytes(struct otpJob *job) {
+    struct iovec iov[4];
+
+    jobVector(job, iov);
+    return iov[0].iov_len + iov[1].iov_len + iov[2].iov_len + iov[3].iov_len;
+}
+
+// Where the result of a job is read to and how long it is: its output, or
+// its packed buffer to be unpacked from in a packed session
+static char *resultBuffer(struct otpJob *job, uint32_t *length) {
+    if (job->packed != NULL) {
+        *length = packedSize(job->size);
+        return job->packed;
+    }
+    *length = job->size;
+    return job->output;
+}
+
+// Asks epoll for EPOLLOUT on a session only while it has something to send
+static void updateEvents(struct pooledSession *session) {
+    struct epoll_event event;
+
+    event.events = session->unsent != NULL ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    event.data.ptr = session;
+    if (session->fd >= 0 && event.events != session->events) {
+        epoll_ctl(session->client->epollFD, EPOLL_CTL_MOD, session->fd, &event);
+        session->events = event.events;
+    }
+}
+
+// Sends as much of the jobs not sent yet as the socket takes. Returns -1 if
+// the session failed
+static int sendJobs(struct pooledSession *session) {
+    struct iovec iov[4 * SEND_BATCH], *pending;
+    struct msghdr message;
+    struct otpJob *job;
+    size_t skip;
+    ssize_t sent;
+    int count;
+
+    while (session->unsent != NULL) {
+        count = 0;
+        for (job = session->unsent; job != NULL && count < 4 * SEND_BATCH; job = job->next) {
+            jobVector(job, iov + count);
+            count += 4;
+        }
+
+        // Skip what an earlier call already got out
+        pending = iov;
+        for (skip = session->sentBytes; skip >= pending->iov_len; pending++, count--) {
+            skip -= pending->iov_len;
+        }
+        pending->iov_base = (char*)pending->iov_base + skip;
+        pending->iov_len -= skip;
+
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = pending;
+        message.msg_iovlen = count;
+        sent = sendmsg(session->fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        } else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else if (sent < 0) {
+            return failSession(session, "writing to socket", strlen("writing to socket"));
+        }
+
+        // Move past the jobs that went out completely
+        skip = session->sentBytes + sent;
+        while (session->unsent != NULL && skip >= jobBytes(session->unsent)) {
+            skip -= jobBytes(session->unsent);
+            session->unsent = session->unsent->next;
+        }
+        session->sentBytes = skip;
+    }
+    return 0;
+}
+
+// Makes room for payloads that are not results, and for bytes read ahead
+static void allocateScratch(struct pooledSession *session) {
+    if (session->scratch == NULL) {
+        session->scratch = malloc(OTP_JOB_MAX);
+        session->carry = malloc(OTP_JOB_MAX);
+    }
+}
+
+// Completes the frame being received, finishing the oldest job with it.
+// Returns -1 if the session failed
+static int finishFrame(struct pooledSession *session) {
+    struct otpJob *job = session->head;
+
+    session->headerGot = 0;
+
+    // An error not about this job is about the whole session
+    if (session->frame.op == OP_ERROR && (job == NULL || job == session->unsent || session->frame.tag != job->tag)) {
+        return failSession(session, session->scratch, session->frame.length);
+    }
+
+    session->head = job->next;
+    if (session->head == NULL) {
+        session->tail = NULL;
+    }
+    session->inFlight--;
+    if (session->frame.op == OP_ERROR) {
+        finishJob(session->client, job, OTP_FAILED, session->scratch, session->frame.length);
+    } else if (job->packed != NULL && (unpackedSize(job->packed, session->frame.length) != job->size ||
+                                       !unpackText(job->packed, session->frame.length, job->output))) {
+        finishJob(session->client, job, OTP_FAILED, "bad packed result from server",
+                  strlen("bad packed result from server"));
+    } else {
+        finishJob(session->client, job, OTP_DONE, NULL, 0);
+    }
+    return 0;
+}
+
+// Starts on the payload of a frame whose header just came in. spill bytes past
+// the header were read into the result buffer of the oldest job already.
+// Returns -1 if the session failed
+static int startFrame(struct pooledSession *session, int spill) {
+    struct frameHeader *frame = &session->frame;
+    struct otpJob *job = session->head;
+    uint32_t used, length = 0;
+    char *result = job != NULL ? resultBuffer(job, &length) : NULL;
+
+    if (!decodeHeader(session->header, frame) || frame->length > OTP_JOB_MAX) {
+        return failSession(session, "bad frame from server", strlen("bad frame from server"));
+    }
+
+    // Only jobs all sent can be answered, but anything can be refused
+    if (frame->op == OP_RESULT && job != NULL && job != session->unsent && frame->tag == job->tag &&
+            frame->length == length) {
+        session->payload = result;
+        session->payloadGot = spill;
+    } else if (frame->op == OP_ERROR) {
+        allocateScratch(session);
+
+        // Bytes only spill into the result of a job in flight. With none, the
+        // error is read whole into scratch and finishFrame() fails the
+        // session with it
+        used = 0;
+        if (job != NULL && spill > 0) {
+            used = (uint32_t)spill < frame->length ? (uint32_t)spill : frame->length;
+            memcpy(session->scratch, result, used);
+            if ((uint32_t)spill > used) {
+                memcpy(session->carry, result + used, spill - used);
+                session->carryStart = 0;
+                session->carryEnd = spill - used;
+            }
+        }
+        session->payload = session->scratch;
+        session->payloadGot = used;
+    } else {
+        return failSession(session, "unexpected reply from server", strlen("unexpected reply from server"));
+    }
+
+    if (session->payloadGot == frame->length) {
+        return finishFrame(session);
+    }
+    return 0;
+}
+
+// Handles bytes set aside after an error, copying them where they would have
+// been read. Returns -1 if the session failed
+static int takeCarry(struct pooledSession *session) {
+    char *bytes = session->carry + session->carryStart;
+    int available = session->carryEnd - session->carryStart, taken;
+
+    if (session->headerGot < OTP_HEADER_SIZE) {
+        taken = OTP_HEADER_SIZE - session->headerGot;
+        taken = available < taken ? available : taken;
+        memcpy(session->header + session->headerGot, bytes, taken);
+        session->carryStart += taken;
+        session->headerGot += taken;
+        return session->headerGot == OTP_HEADER_SIZE ? startFrame(session, 0) : 0;
+    }
+
+    taken = session->frame.length - session->payloadGot;
+    taken = available < taken ? available : taken;
+    memcpy(session->payload + session->payloadGot, bytes, taken);
+    session->carryStart += taken;
+    session->payloadGot += taken;
+    return session->payloadGot == session->frame.length ? finishFrame(session) : 0;
+}
+
+// Reads everything the daemon has sent, straight into the outputs of the jobs
+// it answers. Returns -1 if the session failed
+static int receiveJobs(struct pooledSession *session) {
+    struct otpJob *job;
+    struct iovec iov[2];
+    ssize_t received;
+    uint32_t length;
+    int count, taken;
+
+    while (1) {
+        if (session->carryStart < session->carryEnd) {
+            if (takeCarry(session) < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        // The next frame is most likely the result of the oldest job sent
+        count = 1;
+        if (session->headerGot < OTP_HEADER_SIZE) {
+            iov[0].iov_base = session->header + session->headerGot;
+            iov[0].iov_len = OTP_HEADER_SIZE - session->headerGot;
+            job = session->head;
+            if (job != NULL && job != session->unsent) {
+                iov[1].iov_base = resultBuffer(job, &length);
+                iov[1].iov_len = length;
+                count = length > 0 ? 2 : 1;
+            }
+        } else {
+            iov[0].iov_base = session->payload + session->payloadGot;
+            iov[0].iov_len = session->frame.length - session->payloadGot;
+        }
+
+        received = readv(session->fd, iov, count);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        } else if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else if (received < 0) {
+            return failSession(session, "reading from socket", strlen("reading from socket"));
+        } else if (received == 0) {
+            return failSession(session, "connection closed by server", strlen("connection closed by server"));
+        }
+
+        if (session->headerGot < OTP_HEADER_SIZE) {
+            taken = OTP_HEADER_SIZE - session->headerGot;
+            taken = received < taken ? received : taken;
+            session->headerGot += taken;
+            if (session->headerGot == OTP_HEADER_SIZE && startFrame(session, received - taken) < 0) {
+                return -1;
+            }
+        } else {
+            session->payloadGot += received;
+            if (session->payloadGot == session->frame.length && finishFrame(session) < 0) {
+                return -1;
+            }
+        }
+    }
+}
+
+// Queues a job on the session with the fewest jobs in flight. Never blocks,
+// unless a session has to be connected again. Returns -1 and fails the job
+// without calling its callback if it is malformed or no daemon can be reached.
+// Its status is then OTP_VERSION_1 if the daemon tried last only speaks
+// version 1
+int otpSubmit(struct otpClient *client, struct otpJob *job) {
+    struct pooledSession *session = NULL;
+    struct frameHeader header;
+    int i;
+
+    job->status = OTP_FAILED;
+    job->error[0] = '\0';
+    job->packed = NULL;
+    if (job->size < 0 || job->size > OTP_JOB_MAX) {
+        setError(job->error, "job too large", strlen("job too large"));
+        return -1;
+    }
+    if (job->keyName != NULL && keyReference(job) < 0) {
+        setError(job->error, "bad key name", strlen("bad key name"));
+        return -1;
+    }
+
+    for (i = 0; i < client->count; i++) {
+        if (client->sessions[i].fd >= 0 &&
+                (session == NULL || client->sessions[i].inFlight < session->inFlight)) {
+            session = &client->sessions[i];
+        }
+    }
+
+    // Every daemon hung up on us, try them again
+    for (i = 0; session == NULL && i < client->count; i++) {
+        job->status = openPooled(&client->sessions[i], job->error);
+        if (job->status == OTP_DONE) {
+            session = &client->sessions[i];
+        }
+    }
+    if (session == NULL) {
+        return -1;
+    }
+    if (session->packed && packJob(job) < 0) {
+        job->status = OTP_FAILED;
+        setError(job->error, "bad input", strlen("bad input"));
+        return -1;
+    }
+
+    job->status = OTP_PENDING;
+    job->tag = session->nextTag++;
+    makeHeader(&header, OP_INPUT, job->tag, job->packed != NULL ? job->packedInput : job->size);
+    encodeHeader(job->encoded[0], &header);
+    if (job->keyName != NULL) {
+        makeHeader(&header, OP_KEYREF, job->tag, job->referenceSize);
+    } else {
+        makeHeader(&header, OP_KEY, job->tag, job->packed != NULL ? job->packedKey : job->size);
+    }
+    encodeHeader(job->encoded[1], &header);
+
+    appendJob(&session->head, &session->tail, job);
+    session->inFlight++;
+    client->pending++;
+    if (session->unsent == NULL) {
+        session->unsent = job;
+        session->sentBytes = 0;
+        updateEvents(session);
+    }
+    return 0;
+}
+
+// A descriptor that becomes readable whenever otpProcess() has something to do
+int otpFD(struct otpClient *client) {
+    return client->epollFD;
+}
+
+// Sends and receives whatever the sessions are ready for, waiting up to
+// timeout milliseconds (-1 for as long as it takes) if none is, and finishes
+// every job whose answer came in. Returns the number of jobs finished, 0 at
+// once if no job is in flight
+int otpProcess(struct otpClient *client, int timeout) {
+    struct epoll_event events[EVENT_BATCH];
+    struct pooledSession *session;
+    struct otpJob *job;
+    unsigned long finished = client->finished;
+    int ready, i;
+
+    if (client->pending > 0) {
+        ready = epoll_wait(client->epollFD, events, EVENT_BATCH, timeout);
+        for (i = 0; i < ready; i++) {
+            session = events[i].data.ptr;
+            if ((events[i].events & EPOLLOUT) && session->fd >= 0 && sendJobs(session) < 0) {
+                continue;
+            }
+            if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && session->fd >= 0 &&
+                    receiveJobs(session) < 0) {
+                continue;
+            }
+            updateEvents(session);
+        }
+    }
+
+    // Callbacks last, so they are free to submit more jobs
+    while (client->calling != NULL) {
+        job = client->calling;
+        client->calling = job->next;
+        if (client->calling == NULL) {
+            client->callingTail = NULL;
+        }
+        job->done(job);
+    }
+    return client->finished - finished;
+}
+
+// Takes the oldest job finished without a callback, or returns NULL if there
+// is none
+struct otpJob *otpTake(struct otpClient *client) {
+    struct otpJob *job = client->ready;
+
+    if (job != NULL) {
+        client->ready = job->next;
+        if (client->ready == NULL) {
+            client->readyTail = NULL;
+        }
+    }
+    return job;
+}
+
+// Keeps a job run by otpRun() out of otpTake()
+static void runDone(struct otpJob *job) {
+    (void)job;
+}
+
+// Submits a job and processes until it is done. Returns 0 if it is, -1 and
+// fills in its error if it failed
+int otpRun(struct otpClient *client, struct otpJob *job) {
+    void (*done)(struct otpJob *job) = job->done;
+
+    job->done = done != NULL ? done : runDone;
+    if (otpSubmit(client, job) == 0) {
+        while (job->status == OTP_PENDING) {
+            otpProcess(client, -1);
+        }
+    }
+    job->done = done;
+    return job->status == OTP_DONE ? 0 : -1;
+}
+
+// Number of jobs submitted and not finished yet
+int otpPending(struct otpClient *client) {
+    return client->pending;
+}
+
+// Fails a blocking call on a session, which is closed since its socket is
+// left in the middle of something. Returns -1
+static int failCall(struct pooledSession *session, char error[OTP_ERROR_MAX], const char *reason, int length) {
+    setError(error, reason, length);
+    return failSession(session, reason, length);
+}
+
+// Takes a session over for a blocking call, connecting it again if the
+// daemon hung up on it. Returns -1 with error filled in if jobs are in flight
+// or it cannot be connected
+static int takeSession(struct pooledSession *session, char error[OTP_ERROR_MAX]) {
+    if (session->client->pending > 0) {
+        setError(error, "jobs in flight", strlen("jobs in flight"));
+        return -1;
+    }
+    if (session->fd < 0 && openPooled(session, error) != OTP_DONE) {
+        return -1;
+    }
+    allocateScratch(session);
+    return 0;
+}
+
+// Waits until a session's socket is ready for events (POLLIN or POLLOUT).
+// Returns -1 with error filled in if it cannot
+static int waitSocket(struct pooledSession *session, short events, char error[OTP_ERROR_MAX]) {
+    struct pollfd pollFD;
+    int ready;
+
+    pollFD.fd = session->fd;
+    pollFD.events = events;
+    do {
+        ready = poll(&pollFD, 1, -1);
+    } while (ready < 0 && errno == EINTR);
+    if (ready < 0) {
+        return failCall(session, error, "waiting on socket", strlen("waiting on socket"));
+    }
+    return 0;
+}
+
+// Reads the next frame of a blocking call into the session's frame and
+// scratch, through carry, so that results which come in together take one
+// read. Returns 1 once it is in, 0 if more has to come first and wait is 0,
+// or -1 with error filled in if the session failed
+static int readFrame(struct pooledSession *session, int wait, char error[OTP_ERROR_MAX]) {
+    struct frameHeader *frame = &session->frame;
+    ssize_t received;
+    int available, taken;
+
+    while (1) {
+        available = session->carryEnd - session->carryStart;
+        if (available == 0) {
+            received = read(session->fd, session->carry, OTP_JOB_MAX);
+            if (received < 0 && errno == EINTR) {
+                continue;
+            } else if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (!wait) {
+                    return 0;
+                }
+                if (waitSocket(session, POLLIN, error) < 0) {
+                    return -1;
+                }
+                continue;
+            } else if (received < 0) {
+                return failCall(session, error, "reading from socket", strlen("reading from socket"));
+            } else if (received == 0) {
+                return failCall(session, error, "connection closed by server", strlen("connection closed by server"));
+            }
+            session->carryStart = 0;
+            session->carryEnd = received;
+            continue;
+        }
+
+        if (session->headerGot < OTP_HEADER_SIZE) {
+            taken = OTP_HEADER_SIZE - session->headerGot;
+            taken = available < taken ? available : taken;
+            memcpy(session->header + session->headerGot, session->carry + session->carryStart, taken);
+            session->carryStart += taken;
+            session->headerGot += taken;
+            if (session->headerGot < OTP_HEADER_SIZE) {
+                continue;
+            }
+            if (!decodeHeader(session->header, frame) || frame->length > OTP_JOB_MAX) {
+                return failCall(session, error, "bad frame from server", strlen("bad frame from server"));
+            }
+            session->payloadGot = 0;
+        } else {
+            taken = frame->length - session->payloadGot;
+            taken = available < taken ? available : taken;
+            memcpy(session->scratch + session->payloadGot, session->carry + session->carryStart, taken);
+            session->carryStart += taken;
+            session->payloadGot += taken;
+        }
+
+        if (session->payloadGot == frame->length) {
+            session->headerGot = 0;
+            return 1;
+        }
+    }
+}
+
+// Checks that the frame just read is op tagged tag. Returns -1 with error
+// filled in, the reason an ERROR frame gives or that the reply was unexpected,
+// if it is not
+static int checkFrame(struct pooledSession *session, int op, uint32_t tag, char error[OTP_ERROR_MAX]) {
+    if (session->frame.op == op && session->frame.tag == tag) {
+        return 0;
+    } else if (session->frame.op == OP_ERROR) {
+        return failCall(session, error, session->scratch, session->frame.length);
+    }
+    return failCall(session, error, "unexpected reply from server", strlen("unexpected reply from server"));
+}
+
+// Waits for the frame op tagged tag. Returns -1 with error filled in if the
+// daemon sent anything else or the session failed
+static int awaitFrame(struct pooledSession *session, int op, uint32_t tag, char error[OTP_ERROR_MAX]) {
+    if (readFrame(session, 1, error) < 0) {
+        return -1;
+    }
+    return checkFrame(session, op, tag, error);
+}
+
+// Starts a frame made of the buffers in iov, followed by the parts of files
+// added with frameFile
+static void startFileFrame(struct fileFrame *frame, struct iovec iov[], int count) {
+    memcpy(frame->iov, iov, count * sizeof(struct iovec));
+    frame->pending = frame->iov;
+    frame->nPending = count;
+    frame->nFiles = 0;
+    frame->current = 0;
+}
+
+// Adds size bytes of fd, starting at offset, to the payload of a frame
+static void frameFile(struct fileFrame *frame, int fd, off_t offset, size_t size) {
+    frame->fd[frame->nFiles] = fd;
+    frame->offset[frame->nFiles] = offset;
+    frame->left[frame->nFiles] = size;
+    frame->nFiles++;
+}
+
+// Sends as much of a frame as the socket takes right now. The file parts go
+// from the page cache to the socket with sendfile(), without passing through
+// our buffers. The socket is corked until the frame is out, so the header
+// does not leave in a packet of its own. Returns 1 once the frame is all sent,
+// or -1 with error filled in if the session failed
+static int sendFileFrame(struct pooledSession *session, struct fileFrame *frame, char error[OTP_ERROR_MAX]) {
+    struct msghdr message;
+    ssize_t charsSent;
+    int cork = 1;
+
+    if (frame->nPending > 0) {
+        setsockopt(session->fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    }
+    while (frame->nPending > 0) {
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = frame->pending;
+        message.msg_iovlen = frame->nPending;
+        charsSent = sendmsg(session->fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (charsSent < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else if (charsSent < 0) {
+            return failCall(session, error, "writing to socket", strlen("writing to socket"));
+        }
+
+        // Skip the buffers that went out completely, and the part of the
+        // next one that did
+        while (frame->nPending > 0 && (size_t)charsSent >= frame->pending->iov_len) {
+            charsSent -= frame->pending->iov_len;
+            frame->pending++;
+            frame->nPending--;
+        }
+        if (frame->nPending > 0) {
+            frame->pending->iov_base = (char*)frame->pending->iov_base + charsSent;
+            frame->pending->iov_len -= charsSent;
+        }
+    }
+
+    while (frame->current < frame->nFiles) {
+        if (frame->left[frame->current] == 0) {
+            frame->current++;
+            continue;
+        }
+        charsSent = sendfile(session->fd, frame->fd[frame->current], &frame->offset[frame->current],
+                             frame->left[frame->current]);
+        if (charsSent < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else if (charsSent < 0) {
+            return failCall(session, error, "writing to socket", strlen("writing to socket"));
+        } else if (charsSent == 0) {
+            return failCall(session, error, "fail to read file", strlen("fail to read file"));
+        }
+        frame->left[frame->current] -= charsSent;
+    }
+
+    cork = 0;
+    setsockopt(session->fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    return 1;
+}
+
+// Sends a whole frame, waiting whenever the socket is full. Returns -1 with
+// error filled in if the session failed
+static int sendWhole(struct pooledSession *session, struct fileFrame *frame, char error[OTP_ERROR_MAX]) {
+    int sent;
+
+    while ((sent = sendFileFrame(session, frame, error)) == 0) {
+        if (waitSocket(session, POLLOUT, error) < 0) {
+            return -1;
+        }
+    }
+    return sent < 0 ? -1 : 0;
+}
+
+// Writes all of buffer to fd at offset, or from where fd is if offset is -1.
+// Returns -1 on failure
+static int writeAll(int fd, const char buffer[], int size, off_t offset) {
+    ssize_t charsWritten;
+
+    while (size > 0) {
+        charsWritten = offset < 0 ? write(fd, buffer, size) : pwrite(fd, buffer, size, offset);
+        if (charsWritten < 0 && errno == EINTR) {
+            continue;
+        } else if (charsWritten < 0) {
+            return -1;
+        }
+        buffer += charsWritten;
+        size -= charsWritten;
+        offset = offset < 0 ? offset : offset + charsWritten;
+    }
+    return 0;
+}
+
+// Reads size bytes of fd at offset into buffer. Returns -1 on failure, or if
+// the file ends first
+static int readAll(int fd, char buffer[], int size, off_t offset) {
+    ssize_t charsRead;
+
+    while (size > 0) {
+        charsRead = pread(fd, buffer, size, offset);
+        if (charsRead < 0 && errno == EINTR) {
+            continue;
+        } else if (charsRead <= 0) {
+            return -1;
+        }
+        buffer += charsRead;
+        size -= charsRead;
+        offset += charsRead;
+    }
+    return 0;
+}
+
+// Uploads size characters of keyFD, from its start, into the vault of the
+// daemon of the client's first session under keyName, vault:ID. Blocks until
+// the daemon has stored it all. Returns 0, or -1 with error filled in if it
+// failed or jobs are in flight
+int otpStore(struct otpClient *client, const char *keyName, int keyFD, long long size,
+             char error[OTP_ERROR_MAX]) {
+    struct pooledSession *session = &client->sessions[0];
+    struct frameHeader header;
+    struct fileFrame frame;
+    struct iovec iov[3];
+    char encoded[OTP_HEADER_SIZE];
+    const char *id;
+    long long offset, sent = 0;
+    uint32_t tag;
+    int idLength, chunkSize;
+
+    if (parseKeyName(keyName, &id, &idLength, &offset) < 0) {
+        setError(error, "bad key name", strlen("bad key name"));
+        return -1;
+    }
+    if (takeSession(session, error) < 0) {
+        return -1;
+    }
+    tag = session->nextTag++;
+
+    // Every frame carries the key id and a newline before its part of the key.
+    // The daemon only answers once the last one is in
+    do {
+        chunkSize = size - sent < OTP_CHUNK_SIZE ? size - sent : OTP_CHUNK_SIZE;
+
+        makeHeader(&header, OP_STORE, tag, idLength + 1 + chunkSize);
+        header.flags = sent + chunkSize < size ? FLAG_MORE : 0;
+        encodeHeader(encoded, &header);
+        iov[0].iov_base = encoded;
+        iov[0].iov_len = OTP_HEADER_SIZE;
+        iov[1].iov_base = (char*)id;
+        iov[1].iov_len = idLength;
+        iov[2].iov_base = "\n";
+        iov[2].iov_len = 1;
+        startFileFrame(&frame, iov, 3);
+        frameFile(&frame, keyFD, sent, chunkSize);
+        if (sendWhole(session, &frame, error) < 0) {
+            return -1;
+        }
+        sent += chunkSize;
+    } while (sent < size);
+
+    return awaitFrame(session, OP_RESULT, tag, error);
+}
+
+// Sends a RING frame, telling the daemon to serve everything submitted to the
+// region so far. Returns -1 with error filled in if the session failed
+static int ringDaemon(struct pooledSession *session, uint32_t tag, char error[OTP_ERROR_MAX]) {
+    struct frameHeader header;
+    struct fileFrame frame;
+    struct iovec iov;
+    char encoded[OTP_HEADER_SIZE];
+
+    makeHeader(&header, OP_RING, tag, 0);
+    encodeHeader(encoded, &header);
+    iov.iov_base = encoded;
+    iov.iov_len = OTP_HEADER_SIZE;
+    startFileFrame(&frame, &iov, 1);
+    return sendWhole(session, &frame, error);
+}
+
+// Takes the completion of the oldest request served, whose input starts offset
+// characters into the job. Returns its size, or -1 with error filled in if it
+// failed
+static int takeServed(struct pooledSession *session, long long offset, char error[OTP_ERROR_MAX]) {
+    struct localCompletion completion;
+    char reason[OTP_ERROR_MAX];
+
+    if (!takeCompletion(session->region, &completion)) {
+        return failCall(session, error, "unexpected reply from server", strlen("unexpected reply from server"));
+    }
+    if (completion.status == LOCAL_BAD_INPUT) {
+        snprintf(reason, sizeof(reason), "bad input at offset %lld", offset + (long long)completion.valid);
+        return failCall(session, error, reason, strlen(reason));
+    } else if (completion.status != LOCAL_DONE) {
+        return failCall(session, error, "bad request", strlen("bad request"));
+    }
+    return completion.valid;
+}
+
+// Reads the next requests of a shared stream into bank (0 or 1) of the region
+// and submits them, up to SHARED_BANK of them. Moves *sent past them and
+// returns how many there are, or -1 with error filled in if a file cannot be
+// read
+static int fillBank(struct pooledSession *session, int inputFD, int keyFD, int bank, long long *sent,
+                    long long size, char error[OTP_ERROR_MAX]) {
+    struct localRequest request;
+    char *data = regionData(session->region);
+    int count, chunkSize;
+
+    for (count = 0; count < SHARED_BANK && *sent < size; count++) {
+        chunkSize = size - *sent < SHARED_SLOT / 2 ? size - *sent : SHARED_SLOT / 2;
+        request.tag = session->nextTag;
+        request.size = chunkSize;
+        request.input = (uint64_t)(bank * SHARED_BANK + count) * SHARED_SLOT;
+        request.key = request.input + chunkSize;
+        request.output = request.input;
+        if (readAll(inputFD, data + request.input, chunkSize, *sent) < 0 ||
+                readAll(keyFD, data + request.key, chunkSize, *sent) < 0) {
+            return failCall(session, error, "fail to read file", strlen("fail to read file"));
+        }
+        submitRequest(session->region, &request);
+        *sent += chunkSize;
+    }
+    return count;
+}
+
+// Writes the results of the count requests of bank to outputFD once the
+// daemon has answered the RING frame tagged tag. Moves *done past them.
+// Returns -1 with error filled in on failure
+static int drainBank(struct pooledSession *session, int outputFD, int bank, int count, uint32_t tag,
+                     long long *done, char error[OTP_ERROR_MAX]) {
+    char *data = regionData(session->region);
+    int i, size;
+
+    if (awaitFrame(session, OP_RING, tag, error) < 0) {
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        size = takeServed(session, *done, error);
+        if (size < 0) {
+            return -1;
+        }
+        if (writeAll(outputFD, data + (uint64_t)(bank * SHARED_BANK + i) * SHARED_SLOT, size, -1) < 0) {
+            return failCall(session, error, "writing output", strlen("writing output"));
+        }
+        *done += size;
+    }
+    return 0;
+}
+
+// Streams size bytes of input and key through the shared region. Each bank is
+// rung as soon as it is full, and its results taken once the other bank is
+// full too, so reading the files overlaps with the daemon's work. Returns -1
+// with error filled in on failure
+static int streamShared(struct pooledSession *session, int inputFD, int keyFD, int outputFD, long long size,
+                        char error[OTP_ERROR_MAX]) {
+    long long sent = 0, done = 0;
+    uint32_t tag[2];
+    int count[2] = {0, 0};
+    int bank = 0;
+
+    while (done < size) {
+        count[bank] = fillBank(session, inputFD, keyFD, bank, &sent, size, error);
+        if (count[bank] < 0) {
+            return -1;
+        }
+        if (count[bank] > 0) {
+            tag[bank] = session->nextTag++;
+            if (ringDaemon(session, tag[bank], error) < 0) {
+                return -1;
+            }
+        }
+        bank ^= 1;
+        if (count[bank] > 0) {
+            if (drainBank(session, outputFD, bank, count[bank], tag[bank], &done, error) < 0) {
+                return -1;
+            }
+            count[bank] = 0;
+        }
+    }
+    return 0;
+}
+
+// Starts streaming size bytes of input and key, from offset start of inputFD
+// and keyFD, over session. The result goes to outputFD at outputOffset, or in
+// order from where outputFD is if outputOffset is -1
+static void startStream(struct stream *stream, struct pooledSession *session, int inputFD, int keyFD,
+                        int outputFD, off_t start, long long size, off_t outputOffset) {
+    memset(stream, 0, sizeof(struct stream));
+    stream->session = session;
+    stream->inputFD = inputFD;
+    stream->keyFD = keyFD;
+    stream->outputFD = outputFD;
+    stream->start = start;
+    stream->size = size;
+    stream->outputOffset = outputOffset;
+    stream->tag = session->nextTag++;
+    if (session->packed && session->chunk == NULL) {
+        session->chunk = malloc(OTP_CHUNK_SIZE);
+        session->packedChunk = malloc(2 * packedSize(OTP_CHUNK_SIZE));
+    }
+}
+
+// Packs the next chunkSize characters of input and key into the session's
+// buffers and points iov at them. Returns -1 with error filled in if the files
+// cannot be read or hold a bad character
+static int packChunk(struct stream *stream, struct iovec iov[2], int chunkSize, char error[OTP_ERROR_MAX]) {
+    struct pooledSession *session = stream->session;
+    off_t offset = stream->start + stream->sent;
+    char *packed = session->packedChunk;
+    size_t length = packedSize(chunkSize);
+
+    if (readAll(stream->inputFD, session->chunk, chunkSize, offset) < 0 ||
+            packText(session->chunk, packed, chunkSize) < (size_t)chunkSize ||
+            readAll(stream->keyFD, session->chunk, chunkSize, offset) < 0 ||
+            packText(session->chunk, packed + length, chunkSize) < (size_t)chunkSize) {
+        return failCall(session, error, "bad input", strlen("bad input"));
+    }
+    iov[0].iov_base = packed;
+    iov[0].iov_len = length;
+    iov[1].iov_base = packed + length;
+    iov[1].iov_len = length;
+    return 0;
+}
+
+// Frames the next chunk of input and key once the last one is out. Returns
+// the events to wait for on the session, or -1 with error filled in on failure
+static int streamEvents(struct stream *stream, char error[OTP_ERROR_MAX]) {
+    struct pooledSession *session = stream->session;
+    struct frameHeader header;
+    struct iovec iov[3];
+    int chunkSize;
+
+    if (!stream->pending && !stream->allSent) {
+        chunkSize = stream->size - stream->sent < OTP_CHUNK_SIZE ? stream->size - stream->sent : OTP_CHUNK_SIZE;
+        stream->allSent = stream->sent + chunkSize == stream->size;
+
+        // A packed chunk has to pass through our buffers, a plain one is sent
+        // straight from the files
+        if (session->packed && packChunk(stream, iov + 1, chunkSize, error) < 0) {
+            return -1;
+        }
+        makeHeader(&header, OP_CHUNK, stream->tag,
+                   session->packed ? (uint32_t)(iov[1].iov_len + iov[2].iov_len) : (uint32_t)(2 * chunkSize));
+        header.flags = stream->allSent ? 0 : FLAG_MORE;
+        encodeHeader(stream->encoded, &header);
+        iov[0].iov_base = stream->encoded;
+        iov[0].iov_len = OTP_HEADER_SIZE;
+        if (session->packed) {
+            startFileFrame(&stream->frame, iov, 3);
+        } else {
+            startFileFrame(&stream->frame, iov, 1);
+            frameFile(&stream->frame, stream->inputFD, stream->start + stream->sent, chunkSize);
+            frameFile(&stream->frame, stream->keyFD, stream->start + stream->sent, chunkSize);
+        }
+        stream->sent += chunkSize;
+        stream->pending = 1;
+    }
+
+    // Keep taking results while we send, or the daemon stops reading
+    return POLLIN | (stream->pending ? POLLOUT : 0);
+}
+
+// Sends and receives what the session is ready for, given the events poll
+// returned for it. Returns -1 with error filled in on failure
+static int progressStream(struct stream *stream, short revents, char error[OTP_ERROR_MAX]) {
+    struct pooledSession *session = stream->session;
+    struct frameHeader *frame = &session->frame;
+    const char *result;
+    long long size;
+    int got = 0;
+
+    if (revents & POLLOUT) {
+        got = sendFileFrame(session, &stream->frame, error);
+        if (got < 0) {
+            return -1;
+        }
+        stream->pending = !got;
+    }
+    if (revents & (POLLIN | POLLHUP | POLLERR)) {
+        while (!stream->finished && (got = readFrame(session, 0, error)) > 0) {
+            if (checkFrame(session, OP_RESULT, stream->tag, error) < 0) {
+                return -1;
+            }
+            result = session->scratch;
+            size = frame->length;
+            if (session->packed) {
+                size = unpackedSize(session->scratch, frame->length);
+                if (size < 0 || size > OTP_CHUNK_SIZE || !unpackText(session->scratch, frame->length, session->chunk)) {
+                    return failCall(session, error, "bad packed result from server",
+                                    strlen("bad packed result from server"));
+                }
+                result = session->chunk;
+            }
+            if (writeAll(stream->outputFD, result, size,
+                         stream->outputOffset < 0 ? -1 : stream->outputOffset + stream->received) < 0) {
+                return failCall(session, error, "writing output", strlen("writing output"));
+            }
+            stream->received += size;
+            stream->finished = !(frame->flags & FLAG_MORE);
+        }
+        if (got < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Whether results can be written to fd at their own offsets, in any order.
+// That takes a regular file not opened for appending
+static int canPlaceOutput(int fd) {
+    struct stat fileInfo;
+
+    return fstat(fd, &fileInfo) == 0 && S_ISREG(fileInfo.st_mode) && !(fcntl(fd, F_GETFL) & O_APPEND) &&
+           lseek(fd, 0, SEEK_CUR) >= 0;
+}
+
+// Runs streams until every one of them is finished. Returns -1 with error
+// filled in if any fails
+static int runStreams(struct stream streams[], int count, char error[OTP_ERROR_MAX]) {
+    struct pollfd *pollFDs = calloc(count, sizeof(struct pollfd));
+    int i, ready, events, active = count, failed = 0;
+
+    while (active > 0 && !failed) {
+        for (i = 0; i < count && !failed; i++) {
+            events = streams[i].finished ? 0 : streamEvents(&streams[i], error);
+            failed = events < 0;
+            pollFDs[i].fd = streams[i].finished ? -1 : streams[i].session->fd;
+            pollFDs[i].events = events;
+        }
+        ready = failed ? 0 : poll(pollFDs, count, -1);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        } else if (ready < 0) {
+            failed = failCall(streams[0].session, error, "waiting on socket", strlen("waiting on socket"));
+        }
+        for (i = 0; i < count && ready > 0 && !failed; i++) {
+            if (pollFDs[i].revents != 0) {
+                failed = progressStream(&streams[i], pollFDs[i].revents, error) < 0;
+                active -= streams[i].finished;
+            }
+        }
+    }
+    free(pollFDs);
+    return failed ? -1 : 0;
+}
+
+// Streams size characters of inputFD and keyFD, from the start of both, through
+// the daemons and writes the result to outputFD from where it is, leaving it
+// just past the result. When outputFD is a regular file the job is split into
+// segments of whole chunks, one for each session, and every segment's result
+// is written into place as it comes back. Otherwise, as for a pipe, it all
+// goes over the first session, through the shared region if it has one.
+// Blocks until it is all written. Returns 0, or -1 with error filled in if it
+// failed or jobs are in flight
+int otpStream(struct otpClient *client, int inputFD, int keyFD, int outputFD, long long size,
+              char error[OTP_ERROR_MAX]) {
+    struct stream *streams;
+    long long chunks, segmentSize;
+    off_t base = -1;
+    int count = 1, i, result = 0;
+
+    if (client->count > 1 && canPlaceOutput(outputFD)) {
+        count = client->count;
+        base = lseek(outputFD, 0, SEEK_CUR);
+    }
+    for (i = 0; i < count; i++) {
+        if (takeSession(&client->sessions[i], error) < 0) {
+            return -1;
+        }
+    }
+    if (count == 1 && client->sessions[0].region != NULL) {
+        return streamShared(&client->sessions[0], inputFD, keyFD, outputFD, size, error);
+    }
+
+    // Every segment but the last is a whole number of chunks, and no session
+    // is left without one
+    chunks = (size + OTP_CHUNK_SIZE - 1) / OTP_CHUNK_SIZE;
+    if (count > chunks) {
+        count = chunks > 0 ? chunks : 1;
+    }
+    segmentSize = (chunks + count - 1) / count * OTP_CHUNK_SIZE;
+    count = size > 0 ? (size + segmentSize - 1) / segmentSize : 1;
+
+    streams = malloc(count * sizeof(struct stream));
+    for (i = 0; i < count; i++) {
+        startStream(&streams[i], &client->sessions[i], inputFD, keyFD, outputFD, i * segmentSize,
+                    i < count - 1 ? segmentSize : size - i * segmentSize, base < 0 ? -1 : base + i * segmentSize);
+    }
+    result = runStreams(streams, count, error);
+
+    // A failed stream leaves the others in the middle of theirs
+    for (i = 0; result < 0 && i < count; i++) {
+        if (streams[i].session->fd >= 0) {
+            failSession(streams[i].session, error, strlen(error));
+        }
+    }
+    free(streams);
+
+    // Leave the output where writing it in order would have
+    if (result == 0 && base >= 0) {
+        lseek(outputFD, base + size, SEEK_SET);
+    }
+    return result;
+}
+
+// Sends a version 1 message, the newline ending it going out in the same
+// sendmsg(). Returns -1 on failure
+static int sendLine(int socketFD, const char text[], int size) {
+    struct iovec iov[2], *pending = iov;
+    struct msghdr message;
+    ssize_t sent;
+    int count = 2;
+
+    iov[0].iov_base = (char*)text;
+    iov[0].iov_len = size;
+    iov[1].iov_base = "\n";
+    iov[1].iov_len = 1;
+    while (count > 0) {
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = pending;
+        message.msg_iovlen = count;
+        sent = sendmsg(socketFD, &message, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        } else if (sent < 0) {
+            return -1;
+        }
+        while (count > 0 && (size_t)sent >= pending->iov_len) {
+            sent -= pending->iov_len;
+            pending++;
+            count--;
+        }
+        if (count > 0) {
+            pending->iov_base = (char*)pending->iov_base + sent;
+            pending->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+// Receives a version 1 message from a reader and points line at it, without
+// its newline. The daemon may pad a confirmation with NULs, which are not part
+// of the next message. Returns its length, or -1 with error filled in
+static int receiveLine(struct lineReader *reader, char **line, char error[OTP_ERROR_MAX]) {
+    char *newline;
+    ssize_t received;
+    int scanned = 0;
+
+    while (1) {
+        while (reader->start < reader->end && reader->buffer[reader->start] == '\0') {
+            reader->start++;
+        }
+
+        // Only search the bytes we have not searched before
+        newline = memchr(reader->buffer + reader->start + scanned, '\n', reader->end - reader->start - scanned);
+        if (newline != NULL) {
+            break;
+        }
+        scanned = reader->end - reader->start;
+
+        // Move what is left to the front to make room
+        memmove(reader->buffer, reader->buffer + reader->start, scanned);
+        reader->start = 0;
+        reader->end = scanned;
+        if (reader->end == reader->capacity) {
+            setError(error, "unexpected reply from server", strlen("unexpected reply from server"));
+            return -1;
+        }
+        received = recv(reader->fd, reader->buffer + reader->end, reader->capacity - reader->end, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        } else if (received <= 0) {
+            setError(error, "connection closed by server", strlen("connection closed by server"));
+            return -1;
+        }
+        reader->end += received;
+    }
+
+    *line = reader->buffer + reader->start;
+    reader->start = newline - reader->buffer + 1;
+    return newline - *line;
+}
+
+// Sends a version 1 message and waits for the daemon to confirm it. Returns
+// -1 with error filled in if it does not
+static int confirmLine(struct lineReader *reader, const char text[], int size, char error[OTP_ERROR_MAX]) {
+    char *reply;
+    int length;
+
+    if (sendLine(reader->fd, text, size) < 0) {
+        setError(error, "writing to socket", strlen("writing to socket"));
+        return -1;
+    }
+
+    // Message is '!' for OK and '?' for ERROR
+    length = receiveLine(reader, &reply, error);
+    if (length < 0) {
+        return -1;
+    } else if (length != 1 || reply[0] != '!') {
+        setError(error, "rejected by server", strlen("rejected by server"));
+        return -1;
+    }
+    return 0;
+}
+
+// Runs a job over a connection of its own to the first daemon listed in
+// addresses, speaking version 1 (see otp_protocol.h), for a daemon that speaks
+// nothing else. Version 1 has no key vault and no packing, so the job needs
+// its key. Blocks until it is done. Returns 0 if it is, -1 and fills in its
+// error if it failed
+int otpRunVersion1(const char *name, const char *addresses, struct otpJob *job) {
+    struct localRegion *region = NULL;
+    struct lineReader reader;
+    char *address, *result;
+    int length = -1;
+
+    job->status = OTP_FAILED;
+    job->error[0] = '\0';
+    if (job->keyName != NULL) {
+        setError(job->error, "daemon does not support the key vault",
+                 strlen("daemon does not support the key vault"));
+        return -1;
+    }
+    if (job->size < 0 || job->size > OTP_JOB_MAX) {
+        setError(job->error, "job too large", strlen("job too large"));
+        return -1;
+    }
+
+    address = strndup(addresses, strcspn(addresses, ","));
+    if (isLocalAddress(address)) {
+        reader.fd = connectLocal(address, &region, job->error);
+    } else {
+        reader.fd = connectPort(address, job->error);
+    }
+    free(address);
+    if (reader.fd < 0) {
+        return -1;
+    }
+    if (region != NULL) {
+        unmapRegion(region);
+    }
+
+    // Authentication, input and key are each confirmed before the next, and
+    // the result follows the last confirmation. Room for it and the padded
+    // confirmation before it is all the reader needs
+    reader.capacity = job->size + OTP_HEADER_SIZE + 1;
+    reader.buffer = malloc(reader.capacity);
+    reader.start = 0;
+    reader.end = 0;
+    if (confirmLine(&reader, name, strlen(name), job->error) == 0 &&
+            confirmLine(&reader, job->input, job->size, job->error) == 0 &&
+            confirmLine(&reader, job->key, job->size, job->error) == 0) {
+        length = receiveLine(&reader, &result, job->error);
+    }
+    if (length >= 0 && length != job->size) {
+        setError(job->error, "unexpected reply from server", strlen("unexpected reply from server"));
+    } else if (length >= 0) {
+        memcpy(job->output, result, length);
+        job->status = OTP_DONE;
+    }
+    free(reader.buffer);
+    close(reader.fd);
+    return job->status == OTP_DONE ? 0 : -1;
+}
+
+// Closes every session, failing the jobs still in flight without calling
+// their callbacks, and frees the client
+void otpClose(struct otpClient *client) {
+    struct pooledSession *session;
+    struct otpJob *job;
+    int i;
+
+    for (i = 0; i < client->count; i++) {
+        session = &client->sessions[i];
+        for (job = session->head; job != NULL; job = job->next) {
+            job->status = OTP_FAILED;
+            setError(job->error, "client closed", strlen("client closed"));
+            free(job->packed);
+            job->packed = NULL;
+        }
+        if (session->fd >= 0) {
+            close(session->fd);
+        }
+        if (session->region != NULL) {
+            unmapRegion(session->region);
+        }
+        free(session->address);
+        free(session->scratch);
+        free(session->carry);
+        free(session->chunk);
+        free(session->packedChunk);
+    }
+    if (client->epollFD >= 0) {
+        close(client->epollFD);
+    }
+    free(client->sessions);
+    free(client->name);
+    free(client);
+}
@@ -0,0 +1,161 @@
+/*********************************************************************************
+ * Filename: libotp.h
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * libotp, the OTP client as a library for programs that would rather not fork
+ * otp_enc or otp_dec for every job. A client is a pool of version 2 sessions
+ * to otp_enc_d or otp_dec_d, spread over one or more daemons, and jobs are
+ * submitted to it without blocking. Each job goes to the session with the
+ * fewest jobs in flight, where it is pipelined behind the others (see
+ * otp_protocol.h).
+ *
+ * The caller owns every buffer: the input and key are framed straight from
+ * its memory and the result is read straight into its output, so the library
+ * only copies the characters of a job to pack them. They must stay valid, and
+ * the job itself must stay put, until the job is done.
+ *
+ * Submitting only queues a job. otpProcess() does the actual sending and
+ * receiving, and finishes every job whose answer is in: a job with a done
+ * callback has it called from there, any other is kept for otpTake(). A
+ * program with an event loop of its own watches otpFD(), which becomes
+ * readable whenever otpProcess() has something to do, and calls otpProcess()
+ * with a timeout of 0 when it does. Jobs on a session the daemon closes fail,
+ * and the session is connected again for the next job submitted.
+ *
+ * A client connected with OTP_PACKED sends messages packed wherever the daemon
+ * agrees (see otp_pack.h). The input and key of a job are then packed into a
+ * buffer of the job's own, and the result unpacked from there.
+ *
+ * Besides jobs, a client can upload a key into the daemon's vault with
+ * otpStore(), and stream files of any size through the daemons with
+ * otpStream(), split between its sessions. Both block and must not be called
+ * while jobs are in flight. A session to a local daemon maps the region of
+ * shared memory the daemon offers (see otp_local.h), and a file streamed over
+ * it alone runs through the region. A daemon that only speaks version 1 can
+ * still run single jobs with otpRunVersion1().
+ *
+ * The library never exits or prints, and a client must only be used by one
+ * thread at a time. Connecting, storing and streaming are the calls that
+ * block.
+ *
+ * Link with libotp.a, built by compileall and the Makefile.
+ *********************************************************************************/
+
+#ifndef LIBOTP_H
+#define LIBOTP_H
+
+#include <stdint.h>
+
+#include "otp_protocol.h"
+
+#define OTP_JOB_MAX 128000      // Most characters in a job, all a frame carries
+#define OTP_ERROR_MAX 128       // Room for the reason a job failed
+
+// Flag for otpConnect(): send messages packed when the daemon agrees
+#define OTP_PACKED 0x1
+
+// Where a job is up to
+enum otpStatus {
+    OTP_PENDING,    // Submitted and not done yet
+    OTP_DONE,       // output holds the result
+    OTP_FAILED,     // error says why
+    OTP_VERSION_1   // The daemon only speaks version 1, which a client does
+                    // not. The job can still be run with otpRunVersion1()
+};
+
+// A job. The caller fills in the first part and leaves the whole of it alone
+// until it is done
+struct otpJob {
+    const char *input;
+    const char *key;            // At least size characters, unless keyName is set
+    const char *keyName;        // vault:ID[:OFFSET] to use a key in the daemon's vault, or NULL
+    char *output;               // Room for size characters, may be input itself
+    int size;                   // Characters of input
+    void (*done)(struct otpJob *job);   // Called when the job is done, or NULL
+    void *context;              // Anything the caller wants
+
+    // Filled in by the library
+    enum otpStatus status;
+    char error[OTP_ERROR_MAX];
+
+    // Private to the library
+    struct otpJob *next;
+    uint32_t tag;
+    char encoded[2][OTP_HEADER_SIZE];
+    char reference[8 + OTP_KEY_ID_MAX];
+    int referenceSize;
+    char *packed;               // Input and key packed, then the result, in a packed session
+    int packedInput;
+    int packedKey;
+};
+
+// A pool of sessions, see libotp.c
+struct otpClient;
+
+// Opens count sessions as name ("otp_enc" or "otp_dec"), handing out the
+// daemon addresses listed in addresses ("address[,address...]", each a port on
+// localhost or the path of a local socket) in turn. flags is 0 or OTP_PACKED.
+// Blocks until every session is open. Returns NULL and fills in error if any
+// of them fails, and status (unless NULL) with OTP_VERSION_1 if it was because
+// the daemon only speaks version 1, OTP_FAILED otherwise
+struct otpClient *otpConnect(const char *name, const char *addresses, int count, int flags,
+                             enum otpStatus *status, char error[OTP_ERROR_MAX]);
+
+// Queues a job on the session with the fewest jobs in flight. Never blocks,
+// unless a session has to be connected again. Returns -1 and fails the job
+// without calling its callback if it is malformed or no daemon can be reached.
+// Its status is then OTP_VERSION_1 if the daemon tried last only speaks
+// version 1
+int otpSubmit(struct otpClient *client, struct otpJob *job);
+
+// A descriptor that becomes readable whenever otpProcess() has something to do
+int otpFD(struct otpClient *client);
+
+// Sends and receives whatever the sessions are ready for, waiting up to
+// timeout milliseconds (-1 for as long as it takes) if none is, and finishes
+// every job whose answer came in. Returns the number of jobs finished, 0 at
+// once if no job is in flight
+int otpProcess(struct otpClient *client, int timeout);
+
+// Takes the oldest job finished without a callback, or returns NULL if there
+// is none
+struct otpJob *otpTake(struct otpClient *client);
+
+// Submits a job and processes until it is done. Returns 0 if it is, -1 and
+// fills in its error if it failed
+int otpRun(struct otpClient *client, struct otpJob *job);
+
+// Number of jobs submitted and not finished yet
+int otpPending(struct otpClient *client);
+
+// Uploads size characters of keyFD, from its start, into the vault of the
+// daemon of the client's first session under keyName, vault:ID. Blocks until
+// the daemon has stored it all. Returns 0, or -1 with error filled in if it
+// failed or jobs are in flight
+int otpStore(struct otpClient *client, const char *keyName, int keyFD, long long size,
+             char error[OTP_ERROR_MAX]);
+
+// Streams size characters of inputFD and keyFD, from the start of both, through
+// the daemons and writes the result to outputFD from where it is, leaving it
+// just past the result. When outputFD is a regular file the job is split into
+// segments of whole chunks, one for each session, and every segment's result
+// is written into place as it comes back. Otherwise, as for a pipe, it all
+// goes over the first session, through the shared region if it has one.
+// Blocks until it is all written. Returns 0, or -1 with error filled in if it
+// failed or jobs are in flight
+int otpStream(struct otpClient *client, int inputFD, int keyFD, int outputFD, long long size,
+              char error[OTP_ERROR_MAX]);
+
+// Runs a job over a connection of its own to the first daemon listed in
+// addresses, speaking version 1 (see otp_protocol.h), for a daemon that speaks
+// nothing else. Version 1 has no key vault and no packing, so the job needs
+// its key. Blocks until it is done. Returns 0 if it is, -1 and fills in its
+// error if it failed
+int otpRunVersion1(const char *name, const char *addresses, struct otpJob *job);
+
+// Closes every session, failing the jobs still in flight without calling
+// their callbacks, and frees the client
+void otpClose(struct otpClient *client);
+
+#endif
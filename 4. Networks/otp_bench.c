@@ -0,0 +1,788 @@
+/*********************************************************************************
+ * Filename: otp_bench.c
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Load generator for otp_enc_d and otp_dec_d. Every client is a thread with its
+ * own version 2 session to the daemon on localhost, keeping up to --depth jobs
+ * of --size characters in flight for --duration seconds after a --warmup. Each
+ * client sends the same job over and over, a plaintext (or ciphertext) and a
+ * key made like keygen makes them, from rand() seeded with --seed and the
+ * client's number, so two runs with the same seed send exactly the same bytes.
+ * Every result is checked against the one worked out locally.
+ *
+ * With --oneshot every job gets a connection of its own instead, which is what
+ * the original clients do, and its latency counts the connection and hello.
+ *
+ * With --local PATH the sessions connect to the daemon's local socket instead
+ * of the port, which may be left out, and run their jobs through the region it shares with them (see
+ * otp_local.h): each job is copied into a slot of its own, and every batch of
+ * jobs queued together is rung with one RING frame.
+ *
+ * Reports the jobs finished per second and characters transformed per second
+ * during the measured window, the 50th, 99th and 99.9th percentile latency of
+ * those jobs, and the CPU time spent per job by this process and, given --pid,
+ * by the daemon along with its workers and children. With --label it prints
+ * all of that as one row headed by the label instead, for benchsuite.
+ *
+ * USAGE: otp_bench port [--dec] [--clients N] [--size N] [--depth N] [--duration S]
+ *        [--warmup S] [--seed N] [--packed] [--oneshot] [--local PATH] [--pid PID] [--label NAME]
+ *********************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "otp_protocol.h"
+#include "otp_pack.h"
+#include "otp_local.h"
+
+#define SIZE 128000     // Largest message the daemons take
+#define READ_CHUNK 65536
+#define SETTLE_TIME 200000000  // Nanoseconds left to the daemon to reap its children
+#define USAGE "USAGE: %s port [--dec] [--clients N] [--size N] [--depth N] [--duration S]\n" \
+              "       [--warmup S] [--seed N] [--packed] [--oneshot] [--local PATH] [--pid PID] [--label NAME]\n"
+
+// What to run against the daemon
+struct benchConfig {
+    int portNumber;
+    int decrypt;            // Run against otp_dec_d rather than otp_enc_d
+    int clients;            // Sessions running at once
+    int size;               // Characters in each job
+    int depth;              // Jobs each session keeps in flight
+    double duration;        // Seconds measured
+    double warmup;          // Seconds run before measuring
+    unsigned seed;          // Seed of the inputs and keys
+    int packed;             // Ask for packed messages
+    int oneshot;            // A connection for every job
+    const char *localPath;  // Local socket to run jobs through, NULL for the port
+    pid_t daemonPid;        // Daemon whose CPU time is measured, 0 for none
+    const char *label;      // Row label, NULL for a full report
+    uint64_t measureStart;  // benchClock() times of the measured window
+    uint64_t measureEnd;
+};
+
+// One session and the jobs it ran
+struct benchClient {
+    struct benchConfig *config;
+    int number;
+    pthread_t thread;
+    int fd;
+    int packed;             // Whether the daemon agreed to packed messages
+    struct localRegion *region; // Region shared with the daemon, with --local
+    int slotSize;           // Bytes of the region for each job in flight
+    char *request;          // INPUT and KEY frames of the job, tagged 0
+    int requestSize;
+    char *expected;         // Payload of the RESULT frame it must get back
+    int resultSize;
+    char *out;              // Frames not sent yet
+    int outLength;
+    int outSent;
+    int outCapacity;
+    char *in;               // Bytes received and not handled yet
+    int inLength;
+    uint64_t *sentAt;       // When each job in flight was queued, by tag
+    uint32_t nextTag;       // Tag of the next job sent
+    uint32_t firstTag;      // Tag of the oldest job in flight
+    uint64_t sessionStart;  // When the connection was opened
+    uint64_t *latencies;    // Nanoseconds taken by each job measured
+    long long nLatencies;
+    long long latencyCapacity;
+    long long characters;   // Characters of the jobs measured
+    const char *failure;    // What went wrong, NULL if nothing did
+};
+
+// Current time in nanoseconds, on a clock that never goes back
+static uint64_t benchClock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Sleeps until when, given in benchClock() time
+static void sleepUntil(uint64_t when) {
+    struct timespec wake;
+
+    wake.tv_sec = when / 1000000000;
+    wake.tv_nsec = when % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR);
+}
+
+// Error function used for reporting issues
+static void error(const char *msg, int exitStatus) {
+    fprintf(stderr, "otp_bench: ERROR %s\n", msg);
+    exit(exitStatus);
+}
+
+// Value of one of the 27 characters, a space being 0
+static int letterValue(char letter) {
+    return letter == ' ' ? 0 : letter - 64;
+}
+
+// Character of a value, 0 being a space
+static char valueLetter(int value) {
+    return value == 0 ? ' ' : (char)(value + 64);
+}
+
+// Fills text with size characters the way keygen does
+static void keygenText(char text[], int size) {
+    int i;
+
+    for (i = 0; i < size; i++) {
+        text[i] = valueLetter(rand() % 27);
+    }
+}
+
+// Parses the command line into config, exits on bad usage
+static void parseArguments(int argc, char *argv[], struct benchConfig *config) {
+    int i;
+
+    memset(config, 0, sizeof(struct benchConfig));
+    config->portNumber = -1;
+    config->clients = 8;
+    config->size = 1000;
+    config->depth = 1;
+    config->duration = 5;
+    config->warmup = 1;
+    config->seed = 1;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--dec")) {
+            config->decrypt = 1;
+        } else if (!strcmp(argv[i], "--clients") && i + 1 < argc) {
+            config->clients = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--size") && i + 1 < argc) {
+            config->size = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--depth") && i + 1 < argc) {
+            config->depth = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--duration") && i + 1 < argc) {
+            config->duration = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--warmup") && i + 1 < argc) {
+            config->warmup = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+            config->seed = strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--packed")) {
+            config->packed = 1;
+        } else if (!strcmp(argv[i], "--oneshot")) {
+            config->oneshot = 1;
+        } else if (!strcmp(argv[i], "--local") && i + 1 < argc) {
+            config->localPath = argv[++i];
+        } else if (!strcmp(argv[i], "--pid") && i + 1 < argc) {
+            config->daemonPid = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--label") && i + 1 < argc) {
+            config->label = argv[++i];
+        } else if (config->portNumber < 0) {
+            config->portNumber = atoi(argv[i]);
+        } else {
+            fprintf(stderr, USAGE, argv[0]);
+            exit(1);
+        }
+    }
+
+    if (config->portNumber < 0 && config->localPath == NULL) {
+        fprintf(stderr, USAGE, argv[0]);
+        exit(1);
+    }
+    if (config->clients < 1 || config->depth < 1 || config->duration <= 0 || config->warmup < 0) {
+        error("need at least one client, a depth of one and some time to measure", 1);
+    }
+    if (config->size < 1 || config->size > SIZE) {
+        error("jobs must hold 1 to 128000 characters", 1);
+    }
+
+    // A new connection only ever carries one job
+    if (config->oneshot) {
+        config->depth = 1;
+    }
+
+    // Every job in flight has a slot of the region, and a request in its ring
+    if (config->localPath != NULL) {
+        if (config->packed) {
+            error("jobs run through shared memory are never packed", 1);
+        }
+        if (config->depth > LOCAL_RING_ENTRIES || 2LL * config->size * config->depth > LOCAL_DATA_SIZE) {
+            error("jobs in flight do not fit in the shared region", 1);
+        }
+    }
+}
+
+// Makes the job of a client: its input and key, the frames carrying them and
+// the result they must come back as
+static void makeJob(struct benchClient *client) {
+    struct benchConfig *config = client->config;
+    struct frameHeader header;
+    char *input = malloc(config->size), *key = malloc(config->size), *result = malloc(config->size);
+    int i, inputSize, keySize;
+
+    // Every client gets its own job, the same from one run to the next
+    srand(config->seed * 1000003u + client->number);
+    keygenText(input, config->size);
+    keygenText(key, config->size);
+    for (i = 0; i < config->size; i++) {
+        result[i] = valueLetter(config->decrypt ?
+                                (letterValue(input[i]) - letterValue(key[i]) + 27) % 27 :
+                                (letterValue(input[i]) + letterValue(key[i])) % 27);
+    }
+
+    inputSize = client->packed ? (int)packedSize(config->size) : config->size;
+    keySize = inputSize;
+    client->requestSize = 2 * OTP_HEADER_SIZE + inputSize + keySize;
+    client->request = malloc(client->requestSize);
+    makeHeader(&header, OP_INPUT, 0, inputSize);
+    encodeHeader(client->request, &header);
+    makeHeader(&header, OP_KEY, 0, keySize);
+    encodeHeader(client->request + OTP_HEADER_SIZE + inputSize, &header);
+    client->resultSize = inputSize;
+    client->expected = malloc(client->resultSize);
+    if (client->packed) {
+        packText(input, client->request + OTP_HEADER_SIZE, config->size);
+        packText(key, client->request + 2 * OTP_HEADER_SIZE + inputSize, config->size);
+        packText(result, client->expected, config->size);
+    } else {
+        memcpy(client->request + OTP_HEADER_SIZE, input, config->size);
+        memcpy(client->request + 2 * OTP_HEADER_SIZE + inputSize, key, config->size);
+        memcpy(client->expected, result, config->size);
+    }
+    free(input);
+    free(key);
+    free(result);
+}
+
+// Sends all of buffer on a blocking socket. Returns 0 on failure
+static int sendAll(int fd, const char buffer[], int size) {
+    int sent, charsWritten;
+
+    for (sent = 0; sent < size; sent += charsWritten) {
+        charsWritten = send(fd, buffer + sent, size - sent, MSG_NOSIGNAL);
+        if (charsWritten < 0 && errno == EINTR) {
+            charsWritten = 0;
+        } else if (charsWritten < 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Receives exactly size bytes on a blocking socket. Returns 0 on failure
+static int receiveAll(int fd, char buffer[], int size) {
+    int received, charsRead;
+
+    for (received = 0; received < size; received += charsRead) {
+        charsRead = recv(fd, buffer + received, size - received, 0);
+        if (charsRead < 0 && errno == EINTR) {
+            charsRead = 0;
+        } else if (charsRead <= 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Connects to the daemon and says hello. Returns 0 on failure, with the
+// reason in client->failure
+static int openConnection(struct benchClient *client) {
+    struct benchConfig *config = client->config;
+    struct sockaddr_in serverAddress;
+    struct sockaddr_un localAddress;
+    struct frameHeader header;
+    const char *name = config->decrypt ? "otp_dec\n" : "otp_enc\n";
+    char frame[OTP_HEADER_SIZE + 8], reply[OTP_HEADER_SIZE];
+    int on = 1;
+
+    client->sessionStart = benchClock();
+    if (config->localPath != NULL) {
+        memset((char*)&localAddress, '\0', sizeof(localAddress));
+        localAddress.sun_family = AF_UNIX;
+        strncpy(localAddress.sun_path, config->localPath, sizeof(localAddress.sun_path) - 1);
+        client->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (client->fd < 0 || connect(client->fd, (struct sockaddr*)&localAddress, sizeof(localAddress)) < 0) {
+            client->failure = "cannot connect";
+            return 0;
+        }
+        if (!receiveRegion(client->fd, &client->region) || client->region == NULL) {
+            client->failure = "the daemon offered no region";
+            return 0;
+        }
+    } else {
+        memset((char*)&serverAddress, '\0', sizeof(serverAddress));
+        serverAddress.sin_family = AF_INET;
+        serverAddress.sin_port = htons(config->portNumber);
+        serverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        client->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (client->fd < 0 || connect(client->fd, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) {
+            client->failure = "cannot connect";
+            return 0;
+        }
+        setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+
+    makeHeader(&header, OP_HELLO, 0, strlen(name));
+    header.flags = (config->packed ? FLAG_PACKED : 0) | (client->region != NULL ? FLAG_SHARED : 0);
+    encodeHeader(frame, &header);
+    memcpy(frame + OTP_HEADER_SIZE, name, strlen(name));
+    if (!sendAll(client->fd, frame, OTP_HEADER_SIZE + strlen(name)) ||
+            !receiveAll(client->fd, reply, OTP_HEADER_SIZE) ||
+            !decodeHeader(reply, &header) || header.op != OP_HELLO || header.length != 0) {
+        client->failure = "the daemon refused the session";
+        return 0;
+    }
+    if (config->packed && !(header.flags & FLAG_PACKED)) {
+        client->failure = "the daemon does not pack messages";
+        return 0;
+    }
+    if (client->region != NULL && !(header.flags & FLAG_SHARED)) {
+        client->failure = "the daemon does not share the region";
+        return 0;
+    }
+    client->packed = config->packed;
+
+    // From here on the session waits in poll()
+    fcntl(client->fd, F_SETFL, fcntl(client->fd, F_GETFL) | O_NONBLOCK);
+    client->inLength = 0;
+    client->outLength = 0;
+    client->outSent = 0;
+    return 1;
+}
+
+// Copies the next job into its slot of the region and submits it, tagged with
+// its number
+static void submitJob(struct benchClient *client) {
+    struct localRequest request;
+    char *slot;
+
+    request.tag = client->nextTag;
+    request.size = client->config->size;
+    request.input = (uint64_t)(client->nextTag % client->config->depth) * client->slotSize;
+    request.key = request.input + request.size;
+    request.output = request.input;
+    slot = regionData(client->region) + request.input;
+    memcpy(slot, client->request + OTP_HEADER_SIZE, request.size);
+    memcpy(slot + request.size, client->request + 2 * OTP_HEADER_SIZE + request.size, request.size);
+    submitRequest(client->region, &request);
+}
+
+// Queues the next job, tagged with its number
+static void queueJob(struct benchClient *client) {
+    uint32_t tag = htonl(client->nextTag);
+    char *frames;
+
+    if (client->region != NULL) {
+        submitJob(client);
+        client->sentAt[client->nextTag % client->config->depth] = benchClock();
+        client->nextTag++;
+        return;
+    }
+
+    if (client->outLength + client->requestSize > client->outCapacity) {
+        client->outCapacity = client->outLength + client->requestSize;
+        client->out = realloc(client->out, client->outCapacity);
+    }
+    frames = client->out + client->outLength;
+    memcpy(frames, client->request, client->requestSize);
+    memcpy(frames + 8, &tag, 4);
+    memcpy(frames + OTP_HEADER_SIZE + client->resultSize + 8, &tag, 4);
+    client->outLength += client->requestSize;
+    client->sentAt[client->nextTag % client->config->depth] = benchClock();
+    client->nextTag++;
+}
+
+// Records the latency of a job finished now, if it belongs to the window
+static void recordJob(struct benchClient *client, uint64_t startedAt) {
+    struct benchConfig *config = client->config;
+    uint64_t now = benchClock();
+
+    if (now < config->measureStart || now >= config->measureEnd) {
+        return;
+    }
+    if (client->nLatencies == client->latencyCapacity) {
+        client->latencyCapacity = client->latencyCapacity * 2 + 1024;
+        client->latencies = realloc(client->latencies, client->latencyCapacity * sizeof(uint64_t));
+    }
+    client->latencies[client->nLatencies++] = now - startedAt;
+    client->characters += config->size;
+}
+
+// Checks the completions of every job the daemon has served through the
+// region. Returns 0 if one is not the result expected, with the reason in
+// client->failure
+static int takeServedJobs(struct benchClient *client) {
+    struct localCompletion completion;
+    char *slot;
+
+    while (takeCompletion(client->region, &completion)) {
+        slot = regionData(client->region) + (uint64_t)(completion.tag % client->config->depth) * client->slotSize;
+        if (completion.tag != client->firstTag || completion.status != LOCAL_DONE) {
+            client->failure = completion.status != LOCAL_DONE ? "the daemon rejected a job" : "unexpected completion";
+            return 0;
+        }
+        if (memcmp(slot, client->expected, client->resultSize)) {
+            client->failure = "wrong result";
+            return 0;
+        }
+        recordJob(client, client->config->oneshot ? client->sessionStart :
+                          client->sentAt[client->firstTag % client->config->depth]);
+        client->firstTag++;
+    }
+    return 1;
+}
+
+// Handles every complete frame received. Returns 0 if one is not the result
+// expected, with the reason in client->failure
+static int handleResults(struct benchClient *client) {
+    struct frameHeader header;
+    int consumed = 0, frameSize;
+
+    while (client->inLength - consumed >= OTP_HEADER_SIZE) {
+        if (!decodeHeader(client->in + consumed, &header)) {
+            client->failure = "bad frame from the daemon";
+            return 0;
+        }
+
+        // The answer to a RING frame stands for every job served before it
+        if (header.op == OP_RING && header.length == 0 && client->region != NULL) {
+            if (!takeServedJobs(client)) {
+                return 0;
+            }
+            consumed += OTP_HEADER_SIZE;
+            continue;
+        }
+        if (header.op != OP_RESULT || header.tag != client->firstTag || (int)header.length != client->resultSize) {
+            client->failure = header.op == OP_ERROR ? "the daemon rejected a job" : "unexpected frame";
+            return 0;
+        }
+        frameSize = OTP_HEADER_SIZE + header.length;
+        if (client->inLength - consumed < frameSize) {
+            break;
+        }
+        if (memcmp(client->in + consumed + OTP_HEADER_SIZE, client->expected, client->resultSize)) {
+            client->failure = "wrong result";
+            return 0;
+        }
+        recordJob(client, client->config->oneshot ? client->sessionStart :
+                          client->sentAt[client->firstTag % client->config->depth]);
+        client->firstTag++;
+        consumed += frameSize;
+    }
+    memmove(client->in, client->in + consumed, client->inLength - consumed);
+    client->inLength -= consumed;
+    return 1;
+}
+
+// Runs jobs over the open session until the window is over, or until jobLimit
+// jobs are done. Returns 0 on failure
+static int runSession(struct benchClient *client, long long jobLimit) {
+    struct benchConfig *config = client->config;
+    struct frameHeader header;
+    struct pollfd pollFD;
+    long long queued = 0;
+    int charsRead, charsWritten, timeout;
+    uint32_t rung;
+    uint64_t now;
+
+    client->firstTag = client->nextTag;
+    pollFD.fd = client->fd;
+    while (1) {
+        now = benchClock();
+        rung = client->nextTag;
+        while (now < config->measureEnd && queued < jobLimit &&
+               client->nextTag - client->firstTag < (uint32_t)config->depth) {
+            queueJob(client);
+            queued++;
+        }
+
+        // Jobs submitted to the region are rung together
+        if (client->region != NULL && client->nextTag != rung) {
+            makeHeader(&header, OP_RING, client->nextTag - 1, 0);
+            if (client->outLength + OTP_HEADER_SIZE > client->outCapacity) {
+                client->outCapacity = client->outLength + OTP_HEADER_SIZE;
+                client->out = realloc(client->out, client->outCapacity);
+            }
+            encodeHeader(client->out + client->outLength, &header);
+            client->outLength += OTP_HEADER_SIZE;
+        }
+
+        // Jobs still in flight once the window is over are not waited for
+        if (client->nextTag == client->firstTag || now >= config->measureEnd) {
+            return 1;
+        }
+
+        while (client->outSent < client->outLength) {
+            charsWritten = send(client->fd, client->out + client->outSent, client->outLength - client->outSent,
+                                MSG_NOSIGNAL);
+            if (charsWritten < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    client->failure = "connection lost";
+                    return 0;
+                }
+                break;
+            }
+            client->outSent += charsWritten;
+        }
+        if (client->outSent == client->outLength) {
+            client->outSent = 0;
+            client->outLength = 0;
+        }
+
+        pollFD.events = POLLIN | (client->outSent < client->outLength ? POLLOUT : 0);
+        timeout = (int)((config->measureEnd - now) / 1000000) + 1;
+        if (poll(&pollFD, 1, timeout) <= 0 || !(pollFD.revents & (POLLIN | POLLHUP | POLLERR))) {
+            continue;
+        }
+
+        // Less than a frame is ever left over, so a chunk always fits
+        charsRead = recv(client->fd, client->in + client->inLength, READ_CHUNK, 0);
+        if (charsRead == 0 || (charsRead < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            client->failure = "connection closed by the daemon";
+            return 0;
+        }
+        if (charsRead > 0) {
+            client->inLength += charsRead;
+            if (!handleResults(client)) {
+                return 0;
+            }
+        }
+    }
+}
+
+// Closes a connection opened for a single job with a reset, so thousands of
+// them a second do not use up the local ports in TIME_WAIT
+static int abortConnection(int fd) {
+    struct linger linger = {1, 0};
+
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    return close(fd);
+}
+
+// Closes the session of a client with closeSocket, and unmaps its region
+static void closeConnection(struct benchClient *client, int (*closeSocket)(int fd)) {
+    closeSocket(client->fd);
+    if (client->region != NULL) {
+        unmapRegion(client->region);
+        client->region = NULL;
+    }
+}
+
+// Body of a client thread
+static void *clientMain(void *argument) {
+    struct benchClient *client = argument;
+    struct benchConfig *config = client->config;
+
+    client->in = malloc(client->resultSize + OTP_HEADER_SIZE + READ_CHUNK);
+    client->sentAt = malloc(config->depth * sizeof(uint64_t));
+    client->slotSize = LOCAL_DATA_SIZE / config->depth;
+    client->nextTag = 1;
+
+    if (!config->oneshot) {
+        if (openConnection(client)) {
+            runSession(client, LLONG_MAX);
+        }
+        closeConnection(client, close);
+        return NULL;
+    }
+    while (benchClock() < config->measureEnd) {
+        if (!openConnection(client) || !runSession(client, 1)) {
+            closeConnection(client, abortConnection);
+            return NULL;
+        }
+        closeConnection(client, abortConnection);
+    }
+    return NULL;
+}
+
+// Reads the parent, CPU ticks and reaped children's CPU ticks of a process
+// from /proc/PID/stat. Returns 0 if it is gone
+static int readStat(const char *pid, int *ppid, unsigned long long *own, unsigned long long *reaped) {
+    unsigned long long utime, stime, cutime, cstime;
+    char path[300], buffer[1024], *fields;
+    FILE *stat;
+    int n;
+
+    snprintf(path, sizeof(path), "/proc/%s/stat", pid);
+    if ((stat = fopen(path, "r")) == NULL) {
+        return 0;
+    }
+    n = fread(buffer, 1, sizeof(buffer) - 1, stat);
+    fclose(stat);
+    buffer[n] = '\0';
+
+    // The command name may hold anything, fields start after its ')'
+    fields = strrchr(buffer, ')');
+    if (fields == NULL || sscanf(fields + 2, "%*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %llu %llu",
+                                 ppid, &utime, &stime, &cutime, &cstime) != 5) {
+        return 0;
+    }
+    *own = utime + stime;
+    *reaped = cutime + cstime;
+    return 1;
+}
+
+// Nanoseconds of CPU used by a process, the children it reaped and the ones
+// still running, which is where the workers and the forked children of a
+// daemon spend theirs. Returns 0 if it cannot be read
+static uint64_t processTreeCpu(pid_t pid) {
+    unsigned long long own, reaped, total;
+    char pidName[16];
+    struct dirent *entry;
+    DIR *proc;
+    int ppid;
+
+    // The process goes first: a child reaped while the rest are read is then
+    // missed rather than counted twice
+    snprintf(pidName, sizeof(pidName), "%d", pid);
+    if (!readStat(pidName, &ppid, &own, &reaped) || (proc = opendir("/proc")) == NULL) {
+        return 0;
+    }
+    total = own + reaped;
+    while ((entry = readdir(proc)) != NULL) {
+        if (entry->d_name[0] >= '0' && entry->d_name[0] <= '9' &&
+                readStat(entry->d_name, &ppid, &own, &reaped) && ppid == pid) {
+            total += own;
+        }
+    }
+    closedir(proc);
+    return total * (1000000000 / sysconf(_SC_CLK_TCK));
+}
+
+// Nanoseconds of CPU used by this process
+static uint64_t ownCpu(void) {
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ULL +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ULL;
+}
+
+static int compareLatencies(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Latency in microseconds under which a fraction of the sorted jobs finished
+static double percentile(const uint64_t latencies[], long long count, double fraction) {
+    long long index = (long long)(fraction * count + 0.999999) - 1;
+
+    if (count == 0) {
+        return 0;
+    }
+    return latencies[index < 0 ? 0 : index] / 1000.0;
+}
+
+int main(int argc, char *argv[]) {
+    struct benchConfig config;
+    struct benchClient *clients;
+    uint64_t *latencies, daemonCpu = 0, benchCpu, start, end;
+    long long jobs = 0, characters = 0;
+    double seconds;
+    char where[128];
+    int i, failed = 0;
+
+    parseArguments(argc, argv, &config);
+    clients = calloc(config.clients, sizeof(struct benchClient));
+
+    // Jobs are made up front, so making them is never measured
+    start = benchClock();
+    config.measureStart = start + (uint64_t)(config.warmup * 1e9);
+    config.measureEnd = config.measureStart + (uint64_t)(config.duration * 1e9);
+    for (i = 0; i < config.clients; i++) {
+        clients[i].config = &config;
+        clients[i].number = i;
+        clients[i].packed = config.packed;
+        makeJob(&clients[i]);
+    }
+    start = benchClock() - start;
+    config.measureStart += start;
+    config.measureEnd += start;
+
+    for (i = 0; i < config.clients; i++) {
+        if (pthread_create(&clients[i].thread, NULL, clientMain, &clients[i]) != 0) {
+            error("cannot start a client", 1);
+        }
+    }
+
+    // CPU times are taken at both ends of the window
+    sleepUntil(config.measureStart);
+    if (config.daemonPid > 0) {
+        daemonCpu = processTreeCpu(config.daemonPid);
+    }
+    benchCpu = ownCpu();
+    sleepUntil(config.measureEnd);
+    benchCpu = ownCpu() - benchCpu;
+
+    for (i = 0; i < config.clients; i++) {
+        pthread_join(clients[i].thread, NULL);
+        jobs += clients[i].nLatencies;
+        characters += clients[i].characters;
+        if (clients[i].failure != NULL) {
+            fprintf(stderr, "otp_bench: ERROR client %d: %s\n", i, clients[i].failure);
+            failed = 1;
+        }
+    }
+
+    // Forked children exiting as their clients hang up are nowhere to be seen
+    // until they are reaped, so the daemon is given time to reap them
+    if (config.daemonPid > 0) {
+        sleepUntil(benchClock() + SETTLE_TIME);
+        end = processTreeCpu(config.daemonPid);
+        daemonCpu = end > daemonCpu ? end - daemonCpu : 0;
+    }
+
+    latencies = malloc((jobs > 0 ? jobs : 1) * sizeof(uint64_t));
+    jobs = 0;
+    for (i = 0; i < config.clients; i++) {
+        memcpy(latencies + jobs, clients[i].latencies, clients[i].nLatencies * sizeof(uint64_t));
+        jobs += clients[i].nLatencies;
+    }
+    qsort(latencies, jobs, sizeof(uint64_t), compareLatencies);
+    seconds = config.duration;
+
+    if (config.label != NULL) {
+        printf("%-24s %10.0f %10.2f %9.1f %9.1f %9.1f %9.2f %9.2f\n", config.label, jobs / seconds,
+               characters / seconds / 1e6, percentile(latencies, jobs, 0.5), percentile(latencies, jobs, 0.99),
+               percentile(latencies, jobs, 0.999), jobs > 0 ? daemonCpu / 1000.0 / jobs : 0,
+               jobs > 0 ? benchCpu / 1000.0 / jobs : 0);
+    } else {
+        if (config.localPath != NULL) {
+            snprintf(where, sizeof(where), "%s", config.localPath);
+        } else {
+            snprintf(where, sizeof(where), "port %d", config.portNumber);
+        }
+        printf("%s on %s: %d clients, %d characters, depth %d%s%s, %.1f s after %.1f s (seed %u)\n",
+               config.decrypt ? "otp_dec_d" : "otp_enc_d", where, config.clients, config.size,
+               config.depth, config.packed ? ", packed" : "", config.oneshot ? ", a connection per job" : "",
+               config.duration, config.warmup, config.seed);
+        printf("throughput  %.0f jobs/s, %.2f M characters/s\n", jobs / seconds, characters / seconds / 1e6);
+        printf("latency     p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+               percentile(latencies, jobs, 0.5), percentile(latencies, jobs, 0.99),
+               percentile(latencies, jobs, 0.999), percentile(latencies, jobs, 1));
+        if (config.daemonPid > 0) {
+            printf("cpu/job     daemon %.2f us, otp_bench %.2f us\n",
+                   jobs > 0 ? daemonCpu / 1000.0 / jobs : 0, jobs > 0 ? benchCpu / 1000.0 / jobs : 0);
+        } else {
+            printf("cpu/job     otp_bench %.2f us\n", jobs > 0 ? benchCpu / 1000.0 / jobs : 0);
+        }
+    }
+
+    if (jobs == 0) {
+        fprintf(stderr, "otp_bench: ERROR no job finished in the window\n");
+        failed = 1;
+    }
+    return failed;
+}
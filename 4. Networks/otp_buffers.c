@@ -0,0 +1,140 @@
+/*********************************************************************************
+ * Filename: otp_buffers.c
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Size classed buffers with a free list per class (see otp_buffers.h). A free
+ * buffer holds the link to the next one in its first bytes, so the lists cost
+ * no memory of their own.
+ *********************************************************************************/
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "otp_buffers.h"
+#include "otp_metrics.h"
+
+#define BUFFER_LARGE BUFFER_CLASSES         // Gauge of the buffers too large for any class
+
+// A free buffer
+struct freeBuffer {
+    struct freeBuffer *next;
+};
+
+static struct freeBuffer *freeLists[BUFFER_CLASSES];
+
+// Returns the class of buffers of size bytes, or BUFFER_LARGE if none holds them
+static int bufferClass(int size) {
+    int class = 0;
+
+    while (class < BUFFER_CLASSES && (1 << (BUFFER_MIN_SHIFT + class)) < size) {
+        class++;
+    }
+    return class;
+}
+
+// Maps a slab and cuts it into free buffers of class. Returns 0 if the system
+// is out of memory
+static int refillClass(int class) {
+    int size = 1 << (BUFFER_MIN_SHIFT + class);
+    int count = BUFFER_SLAB / size, i;
+    struct freeBuffer *buffer;
+    char *slab;
+
+    slab = mmap(NULL, BUFFER_SLAB, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED) {
+        return 0;
+    }
+    for (i = count - 1; i >= 0; i--) {
+        buffer = (struct freeBuffer*)(slab + (size_t)i * size);
+        buffer->next = freeLists[class];
+        freeLists[class] = buffer;
+    }
+    moveGauge(&processMetrics->buffersFree[class], count);
+    return 1;
+}
+
+// Borrows a buffer of at least size bytes and sets *capacity to its actual
+// size. Returns NULL if the system is out of memory
+char *takeBuffer(int size, int *capacity) {
+    int class = bufferClass(size);
+    struct freeBuffer *buffer;
+    char *large;
+
+    if (class == BUFFER_LARGE) {
+        large = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (large == MAP_FAILED) {
+            return NULL;
+        }
+        moveGauge(&processMetrics->buffersInUse[BUFFER_LARGE], 1);
+        *capacity = size;
+        return large;
+    }
+
+    if (freeLists[class] == NULL && !refillClass(class)) {
+        return NULL;
+    }
+    buffer = freeLists[class];
+    freeLists[class] = buffer->next;
+    moveGauge(&processMetrics->buffersFree[class], -1);
+    moveGauge(&processMetrics->buffersInUse[class], 1);
+    *capacity = 1 << (BUFFER_MIN_SHIFT + class);
+    return (char*)buffer;
+}
+
+// Gives back a buffer of capacity bytes borrowed with takeBuffer(). NULL is
+// ignored
+void giveBuffer(char *buffer, int capacity) {
+    int class = bufferClass(capacity);
+    struct freeBuffer *link = (struct freeBuffer*)buffer;
+
+    if (buffer == NULL) {
+        return;
+    }
+    moveGauge(&processMetrics->buffersInUse[class], -1);
+    if (class == BUFFER_LARGE) {
+        munmap(buffer, capacity);
+        return;
+    }
+    link->next = freeLists[class];
+    freeLists[class] = link;
+    moveGauge(&processMetrics->buffersFree[class], 1);
+}
+
+// Makes buffer, of *capacity bytes, at least size bytes long, keeping its
+// first length bytes. Swaps it for a larger one if it has to, like realloc().
+// buffer may be NULL
+char *growBuffer(char *buffer, int length, int *capacity, int size) {
+    char *larger;
+    int largerCapacity;
+
+    if (buffer != NULL && *capacity >= size) {
+        return buffer;
+    }
+    larger = takeBuffer(size, &largerCapacity);
+    if (larger == NULL) {
+        return NULL;
+    }
+    if (length > 0) {
+        memcpy(larger, buffer, length);
+    }
+    giveBuffer(buffer, *capacity);
+    *capacity = largerCapacity;
+    return larger;
+}
+
+// Gives every free buffer of the process back to the system, for a process
+// about to exit. Buffers are whole pages, so each can leave its slab alone
+void drainBuffers(void) {
+    struct freeBuffer *buffer;
+    int class;
+
+    for (class = 0; class < BUFFER_CLASSES; class++) {
+        while ((buffer = freeLists[class]) != NULL) {
+            freeLists[class] = buffer->next;
+            munmap(buffer, 1 << (BUFFER_MIN_SHIFT + class));
+            moveGauge(&processMetrics->buffersFree[class], -1);
+        }
+    }
+}
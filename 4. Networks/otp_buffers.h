@@ -0,0 +1,48 @@
+/*********************************************************************************
+ * Filename: otp_buffers.h
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Buffers the daemons' connections read into and queue results in. Sizes come
+ * in classes, powers of two from 64 KB to 2 MB, and each class has a free list
+ * of its own in every process. A connection borrows its buffers from the free
+ * lists and gives them back when it closes, so a process serving connections
+ * all day only ever asks the system for memory while its busiest moment so far
+ * is still growing.
+ *
+ * When a free list runs dry a whole slab is mapped at once and cut into
+ * buffers of its class, so every buffer starts on a page. Buffers are never
+ * cleared, neither on the way out nor on the way back. Anything larger than
+ * the largest class is mapped on its own and unmapped when it is given back.
+ *
+ * Each event loop runs in a process of its own and so do the forked children,
+ * so the free lists are never shared and take no lock. How many buffers of
+ * each class are in use and how many are free is kept in the process's metrics
+ * slot (see otp_metrics.h).
+ *********************************************************************************/
+
+#ifndef OTP_BUFFERS_H
+#define OTP_BUFFERS_H
+
+#define BUFFER_MIN_SHIFT 16                 // Smallest class, 64 KB
+#define BUFFER_CLASSES 6                    // Up to 2 MB
+#define BUFFER_SLAB (2 << 20)               // Mapped at once when a free list is empty
+
+// Borrows a buffer of at least size bytes and sets *capacity to its actual
+// size. Returns NULL if the system is out of memory
+char *takeBuffer(int size, int *capacity);
+
+// Gives back a buffer of capacity bytes borrowed with takeBuffer(). NULL is
+// ignored
+void giveBuffer(char *buffer, int capacity);
+
+// Makes buffer, of *capacity bytes, at least size bytes long, keeping its
+// first length bytes. Swaps it for a larger one if it has to, like realloc().
+// buffer may be NULL
+char *growBuffer(char *buffer, int length, int *capacity, int size);
+
+// Gives every free buffer of the process back to the system, for a process
+// about to exit
+void drainBuffers(void);
+
+#endif
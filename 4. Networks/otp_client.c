@@ -0,0 +1,381 @@
+/*********************************************************************************
+ * Filename: otp_client.c
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * The command line side of otp_enc and otp_dec (see otp_client.h), over
+ * libotp. A batch keeps up to BATCH_WINDOW jobs queued on the client, each in
+ * a slot of the window with the contents of its files, and the slot is used
+ * for the next job once the result is written out.
+ *********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "otp_client.h"
+#include "libotp.h"
+
+#define BATCH_WINDOW 64         // Most batch jobs queued ahead of their results
+#define BATCH_MAX_INPUT 128000  // Inputs this large are too long for one frame
+
+// A batch job queued on the client and waiting for its result
+struct batchJob {
+    struct otpJob job;
+    char *inputFile;
+    char *outputFile;           // NULL to write the result to the batch output
+    char *keyName;              // vault:ID[:OFFSET] if its key is in the daemon's vault
+    char *input;                // Contents of its files, the result goes over the input
+    char *key;
+};
+
+// Where a batch is up to
+struct batch {
+    const char *name;
+    FILE *jobList;
+    char *line;                 // Current line of the job list
+    size_t lineCapacity;
+    int failed;                 // Number of jobs that failed
+};
+
+// Reports an error and exits
+static void clientError(const char *name, const char *msg, int exitStatus) {
+    fprintf(stderr, "%s: ERROR %s\n", name, msg);
+    exit(exitStatus);
+}
+
+// Connects count sessions to the daemons listed in addresses. Exits on
+// failure, saying unsupported if the daemon only speaks version 1 or
+// maxVersion is lower than 2
+static struct otpClient *connectClient(const char *name, const char *addresses, int count, int maxVersion,
+                                       int packed, const char *unsupported) {
+    struct otpClient *client;
+    enum otpStatus status;
+    char reason[OTP_ERROR_MAX];
+
+    if (maxVersion < 2) {
+        clientError(name, unsupported, 1);
+    }
+    client = otpConnect(name, addresses, count, packed ? OTP_PACKED : 0, &status, reason);
+    if (client == NULL && status == OTP_VERSION_1) {
+        clientError(name, unsupported, 1);
+    } else if (client == NULL) {
+        clientError(name, reason, 2);
+    }
+    return client;
+}
+
+// Writes all of buffer to a file, exits on failure
+static void writeOutput(const char *name, int fd, const char buffer[], int size) {
+    int charsWritten;
+
+    while (size > 0) {
+        charsWritten = write(fd, buffer, size);
+        if (charsWritten < 0 && errno == EINTR) {
+            continue;
+        } else if (charsWritten < 0) {
+            clientError(name, "writing output", 2);
+        }
+        buffer += charsWritten;
+        size -= charsWritten;
+    }
+}
+
+// Whether a key argument names a key in the daemon's vault rather than a file
+int isVaultKey(const char *name) {
+    return !strncmp(name, VAULT_PREFIX, strlen(VAULT_PREFIX));
+}
+
+// Runs input through the daemon at address with size characters of key, or
+// with the key in its vault named keyName, vault:ID[:OFFSET], if that is set.
+// Falls back to version 1 if the daemon speaks nothing else. Points *result at
+// the transformed input and returns its size. Exits if the daemon rejects the
+// job
+int runJob(const char *name, const char *address, int maxVersion, int packed, const char input[], int size,
+           const char key[], const char *keyName, const char **result) {
+    struct otpClient *client = NULL;
+    struct otpJob job;
+    enum otpStatus status = OTP_VERSION_1;
+    char reason[OTP_ERROR_MAX];
+
+    memset(&job, 0, sizeof(job));
+    job.input = input;
+    job.key = key;
+    job.keyName = keyName;
+    job.output = malloc(size > 0 ? size : 1);
+    job.size = size;
+
+    if (maxVersion >= 2) {
+        client = otpConnect(name, address, 1, packed ? OTP_PACKED : 0, &status, reason);
+        if (client == NULL && status != OTP_VERSION_1) {
+            clientError(name, reason, 2);
+        }
+    }
+    if (client != NULL) {
+        otpRun(client, &job);
+        status = job.status;
+        otpClose(client);
+    }
+
+    // A daemon only speaking version 1 gets the job again in version 1
+    if (status == OTP_VERSION_1) {
+        if (keyName != NULL) {
+            clientError(name, "daemon does not support the key vault", 1);
+        }
+        otpRunVersion1(name, address, &job);
+    }
+    if (job.status != OTP_DONE) {
+        clientError(name, job.error, 2);
+    }
+
+    *result = job.output;
+    return size;
+}
+
+// Opens a file to stream and returns its size without the trailing newline
+static long long openContent(const char *name, const char *filename, int *fd) {
+    struct stat fileInfo;
+    char last;
+
+    *fd = open(filename, O_RDONLY);
+    if (*fd < 0 || fstat(*fd, &fileInfo) < 0) {
+        clientError(name, "cannot open file", 1);
+    }
+    if (fileInfo.st_size > 0 && pread(*fd, &last, 1, fileInfo.st_size - 1) == 1 && last == '\n') {
+        return fileInfo.st_size - 1;
+    }
+    return fileInfo.st_size;
+}
+
+// Uploads the contents of keyFile, without its trailing newline, into the
+// vault of the daemon at address under the name vault:ID. Exits on failure
+void storeFile(const char *name, const char *address, int maxVersion, const char *keyFile, const char *keyName) {
+    struct otpClient *client;
+    char reason[OTP_ERROR_MAX];
+    long long keySize;
+    int keyFD;
+
+    client = connectClient(name, address, 1, maxVersion, 0, "daemon does not support the key vault");
+    keySize = openContent(name, keyFile, &keyFD);
+    if (otpStore(client, keyName, keyFD, keySize, reason) < 0) {
+        clientError(name, reason, 2);
+    }
+    otpClose(client);
+    close(keyFD);
+}
+
+// Streams the contents of inputFile through the daemons listed in addresses
+// with the key in keyFile, over count connections at once when outputFD is a
+// regular file, and writes the result and a newline to outputFD. Works for
+// files of any size. Exits on failure
+void streamFiles(const char *name, const char *addresses, int count, int maxVersion, int packed,
+                 const char *inputFile, const char *keyFile, int outputFD) {
+    struct otpClient *client;
+    char reason[OTP_ERROR_MAX];
+    long long inputSize, keySize;
+    int inputFD, keyFD;
+
+    client = connectClient(name, addresses, count, maxVersion, packed, "daemon does not support streaming");
+    if (isVaultKey(keyFile)) {
+        clientError(name, "vault keys cannot be streamed", 1);
+    }
+    inputSize = openContent(name, inputFile, &inputFD);
+    keySize = openContent(name, keyFile, &keyFD);
+    if (inputSize > keySize) {
+        clientError(name, "key is too short", 1);
+    }
+
+    if (otpStream(client, inputFD, keyFD, outputFD, inputSize, reason) < 0) {
+        clientError(name, reason, 2);
+    }
+    writeOutput(name, outputFD, "\n", 1);
+    otpClose(client);
+    close(inputFD);
+    close(keyFD);
+}
+
+// Reads up to limit bytes of a file, without its trailing newline, into a new
+// buffer and sets *length to the full length of that content.
+// Returns NULL on success or the reason the file cannot be read
+static const char *loadFile(const char *filename, int limit, char **buffer, long long *length) {
+    struct stat fileInfo;
+    ssize_t charsRead;
+    char last;
+    int fd, size, total = 0;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &fileInfo) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return "cannot open file";
+    }
+    *length = fileInfo.st_size;
+    if (*length > 0 && pread(fd, &last, 1, *length - 1) == 1 && last == '\n') {
+        (*length)--;
+    }
+
+    size = *length < limit ? *length : limit;
+    *buffer = realloc(*buffer, size + 1);
+    while (total < size) {
+        charsRead = pread(fd, *buffer + total, size - total, total);
+        if (charsRead < 0 && errno == EINTR) {
+            continue;
+        } else if (charsRead <= 0) {
+            close(fd);
+            return "fail to read file";
+        }
+        total += charsRead;
+    }
+    close(fd);
+    return NULL;
+}
+
+// Reports a batch job that failed
+static void batchError(struct batch *batch, const char *inputFile, const char *reason) {
+    fprintf(stderr, "%s: ERROR %s: %s\n", batch->name, inputFile, reason);
+    batch->failed++;
+}
+
+// Forgets the files of a batch job once it is done
+static void endBatchJob(struct batchJob *slot) {
+    free(slot->inputFile);
+    free(slot->outputFile);
+    free(slot->keyName);
+    slot->inputFile = NULL;
+    slot->outputFile = NULL;
+    slot->keyName = NULL;
+}
+
+// Reads the next job of the list into a slot of the window. Jobs whose files
+// cannot be used are reported and skipped. Returns 0 once the list is used up
+static int nextBatchJob(struct batch *batch, struct batchJob *slot) {
+    char *inputFile, *keyFile, *outputFile;
+    const char *reason;
+    long long inputSize, keySize;
+
+    while (getline(&batch->line, &batch->lineCapacity, batch->jobList) >= 0) {
+        inputFile = strtok(batch->line, " \t\n");
+        keyFile = strtok(NULL, " \t\n");
+        outputFile = strtok(NULL, " \t\n");
+        if (inputFile == NULL) {
+            continue;
+        }
+        if (keyFile == NULL) {
+            batchError(batch, inputFile, "no key");
+            continue;
+        }
+
+        reason = loadFile(inputFile, BATCH_MAX_INPUT, &slot->input, &inputSize);
+        if (reason == NULL && inputSize >= BATCH_MAX_INPUT) {
+            reason = "too large for a batch, use --stream";
+        }
+
+        // Only as much key as there is input is read
+        if (reason == NULL && !isVaultKey(keyFile)) {
+            reason = loadFile(keyFile, inputSize, &slot->key, &keySize);
+            if (reason == NULL && keySize < inputSize) {
+                reason = "key is too short";
+            }
+        }
+        if (reason != NULL) {
+            batchError(batch, inputFile, reason);
+            continue;
+        }
+
+        // The line is read over by the next job, so keep what it names
+        slot->inputFile = strdup(inputFile);
+        slot->outputFile = outputFile != NULL ? strdup(outputFile) : NULL;
+        slot->keyName = isVaultKey(keyFile) ? strdup(keyFile) : NULL;
+
+        memset(&slot->job, 0, sizeof(slot->job));
+        slot->job.input = slot->input;
+        slot->job.key = slot->key;
+        slot->job.keyName = slot->keyName;
+        slot->job.output = slot->input;
+        slot->job.size = inputSize;
+        slot->job.context = slot;
+        return 1;
+    }
+    return 0;
+}
+
+// Writes the result of a batch job and a newline to its output file, or to
+// outputFD if it has none
+static void writeBatchResult(struct batch *batch, struct batchJob *slot, int outputFD) {
+    int fd = outputFD;
+
+    if (slot->outputFile != NULL) {
+        fd = open(slot->outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            batchError(batch, slot->inputFile, "cannot open output file");
+            return;
+        }
+    }
+    writeOutput(batch->name, fd, slot->job.output, slot->job.size);
+    writeOutput(batch->name, fd, "\n", 1);
+    if (fd != outputFD) {
+        close(fd);
+    }
+}
+
+// Runs every job listed in jobList, one "input key [output]" per line, through
+// the daemon at address. Returns the number of jobs that failed
+int runBatch(const char *name, const char *address, int maxVersion, int packed, FILE *jobList, int outputFD) {
+    struct otpClient *client;
+    struct batch batch;
+    struct batchJob *window, *slot;
+    struct otpJob *job;
+    int first = 0, nWaiting = 0, listDone = 0, i;
+
+    client = connectClient(name, address, 1, maxVersion, packed, "daemon does not support batches");
+    memset(&batch, 0, sizeof(batch));
+    batch.name = name;
+    batch.jobList = jobList;
+    window = calloc(BATCH_WINDOW, sizeof(struct batchJob));
+
+    while (!listDone || nWaiting > 0) {
+
+        // Queue the next jobs without waiting for results, as long as the
+        // window has room
+        while (!listDone && nWaiting < BATCH_WINDOW) {
+            slot = &window[(first + nWaiting) % BATCH_WINDOW];
+            if (!nextBatchJob(&batch, slot)) {
+                listDone = 1;
+            } else if (otpSubmit(client, &slot->job) < 0) {
+                batchError(&batch, slot->inputFile, slot->job.error);
+                endBatchJob(slot);
+            } else {
+                nWaiting++;
+            }
+        }
+
+        // The daemon answers jobs in the order they were sent
+        otpProcess(client, -1);
+        while ((job = otpTake(client)) != NULL) {
+            slot = job->context;
+            if (job->status == OTP_DONE) {
+                writeBatchResult(&batch, slot, outputFD);
+            } else {
+                batchError(&batch, slot->inputFile, job->error);
+            }
+            endBatchJob(slot);
+            first = (first + 1) % BATCH_WINDOW;
+            nWaiting--;
+        }
+    }
+
+    otpClose(client);
+    for (i = 0; i < BATCH_WINDOW; i++) {
+        free(window[i].input);
+        free(window[i].key);
+    }
+    free(window);
+    free(batch.line);
+    return batch.failed;
+}
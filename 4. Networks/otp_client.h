@@ -0,0 +1,58 @@
+/*********************************************************************************
+ * Filename: otp_client.h
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * The command line side of otp_enc and otp_dec, which both run every kind of
+ * job the same way. Everything said to a daemon goes through libotp (see
+ * libotp.h): this only reads the files, writes the results and turns the
+ * reasons libotp gives into error messages.
+ *
+ * Every call is given the name of the program ("otp_enc" or "otp_dec"), which
+ * authenticates it with the daemon and starts its messages, and the highest
+ * protocol version to speak. Everything but a single job needs version 2.
+ * These calls block and exit on failure, which suits the command line
+ * programs. They are not part of libotp.a.
+ *********************************************************************************/
+
+#ifndef OTP_CLIENT_H
+#define OTP_CLIENT_H
+
+#include <stdio.h>
+
+// Key arguments starting with this name a key in the daemon's vault
+#define VAULT_PREFIX "vault:"
+
+// Most connections a file is split between
+#define FANOUT_MAX 64
+
+// Whether a key argument names a key in the daemon's vault rather than a file
+int isVaultKey(const char *name);
+
+// Runs input through the daemon at address with size characters of key, or
+// with the key in its vault named keyName, vault:ID[:OFFSET], if that is set.
+// Falls back to version 1 if the daemon speaks nothing else. Points *result at
+// the transformed input and returns its size. Exits if the daemon rejects the
+// job
+int runJob(const char *name, const char *address, int maxVersion, int packed, const char input[], int size,
+           const char key[], const char *keyName, const char **result);
+
+// Uploads the contents of keyFile, without its trailing newline, into the
+// vault of the daemon at address under the name vault:ID. Exits on failure
+void storeFile(const char *name, const char *address, int maxVersion, const char *keyFile, const char *keyName);
+
+// Streams the contents of inputFile through the daemons listed in addresses
+// with the key in keyFile, over count connections at once when outputFD is a
+// regular file, and writes the result and a newline to outputFD. Works for
+// files of any size. Exits on failure
+void streamFiles(const char *name, const char *addresses, int count, int maxVersion, int packed,
+                 const char *inputFile, const char *keyFile, int outputFD);
+
+// Runs every job listed in jobList, one "input key [output]" per line, through
+// the daemon at address. Jobs are sent back to back without waiting for their
+// results, which come back in order. Each result and a newline go to the
+// output file of its job, or to outputFD if the line names none. Failed jobs
+// are reported and the rest carry on. Returns the number of jobs that failed
+int runBatch(const char *name, const char *address, int maxVersion, int packed, FILE *jobList, int outputFD);
+
+#endif
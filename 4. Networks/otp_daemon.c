@@ -0,0 +1,2289 @@
+/*********************************************************************************
+ * Filename: otp_daemon.c
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Shared server engine for otp_enc_d, otp_dec_d and otpd. Every connection walks
+ * through the same steps (hello, input, key, result) whichever engine serves it,
+ * and its hello picks which of the daemon's roles it gets. Bytes are read in
+ * large chunks into a buffer, and a message is handled once it is complete: once
+ * its newline is in for version 1 clients, or once the length given in its
+ * header has arrived for version 2 clients (see otp_protocol.h).
+ *
+ * The fork engine serves each connection in its own child with blocking reads and
+ * writes. The epoll engine serves every connection from a single process and never
+ * blocks. The uring engine does the same through io_uring: a multishot accept and
+ * a multishot receive per connection into a shared ring of provided buffers, and
+ * every request queued while handling a batch of completions is submitted in the
+ * one io_uring_enter() call that waits for the next batch.
+ *
+ * Streamed jobs are transformed one chunk at a time as the chunks arrive, and a
+ * connection stops reading while OUT_HIGH_WATER bytes of results are waiting for
+ * the client, so its buffers stay the same size however long the job is.
+ *
+ * With --workers N a supervisor process starts N workers. Each worker has its own
+ * SO_REUSEPORT listening socket and event loop, so the kernel spreads connections
+ * between them and they never share anything.
+ *
+ * A version 2 client may ask for packed messages (see otp_pack.h). Their inputs
+ * and keys are unpacked as they come in, transformed as usual and the results
+ * packed again on the way out.
+ *
+ * Jobs of SHARD_THRESHOLD characters or more are split between a pool of threads
+ * (see otp_shards.h), one per CPU or per CPU left to each worker unless --threads
+ * says otherwise. The pool is started by the process serving the first such job,
+ * so forked children and workers each get their own.
+ *
+ * Every connection is always under one deadline: the header deadline until the
+ * client has said hello, the body deadline while a message is coming in or a
+ * result going out, and the idle deadline between jobs. A client that trickles a
+ * message in a byte at a time does not push the body deadline back, only whole
+ * messages and sends do. Connections that miss their deadline are closed and
+ * counted. The event loops keep the deadlines in a timer wheel (see
+ * otp_timers.h) and wake up for its ticks while any is running, and the forked
+ * children poll() with the time left before each blocking read and write.
+ *
+ * Each process serves at most --max-sessions connections at once. The event
+ * loops keep accepting past that, but hold the connections they cannot serve
+ * yet in a queue no longer than the backlog, and the fork engine stops forking
+ * until a child exits. A connection that waits longer than --queue-wait, or
+ * finds the queue full, is shed with the '?' error response, which every client
+ * takes as a refusal. Once the messages and results held by a process reach
+ * --max-inflight, its connections stop reading until it is back under, except
+ * those in the middle of a message or waiting for the key of their job, so the
+ * work already taken on can always finish.
+ *
+ * Connections, jobs, errors, timeouts, shed connections and the latency of each
+ * phase of a job are recorded as they happen (see otp_metrics.h) and served on
+ * the Unix socket given with --metrics.
+ *
+ * With --local PATH the daemon also listens on a Unix socket at PATH, shared by
+ * every worker, and offers each connection on it a region of shared memory
+ * right after accepting it (see otp_local.h). A client using the region only
+ * sends RING frames, and the jobs it submitted are transformed in place in the
+ * region, by whichever engine serves the connection.
+ *********************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "otp_daemon.h"
+#include "otp_protocol.h"
+#include "otp_vault.h"
+#include "otp_uring.h"
+#include "otp_shards.h"
+#include "otp_pack.h"
+#include "otp_timers.h"
+#include "otp_metrics.h"
+#include "otp_local.h"
+#include "otp_buffers.h"
+
+#define MAX_EVENTS 64
+#define CONNECTION_BATCH 64         // Connections allocated at once when none are free
+#define READ_CHUNK 65536
+#define OUT_HIGH_WATER (4 * READ_CHUNK)
+#define URING_ENTRIES 256
+#define URING_BUFFERS 64            // Receive buffers of READ_CHUNK bytes
+#define URING_BUFFER_GROUP 0
+#define URING_REQUEST_MASK 7
+#define HEADER_TIMEOUT 5          // Default deadlines in seconds
+#define BODY_TIMEOUT 30
+#define IDLE_TIMEOUT 60
+#define MAX_SESSIONS 256
+#define MAX_INFLIGHT 64             // Default budget in megabytes
+#define QUEUE_WAIT 2                // Default wait for a session in seconds
+#define USAGE "USAGE: %s port [--engine fork|epoll|uring] [--workers N] [--threads N] [--vault DIR]\n" \
+              "       [--header-timeout S] [--body-timeout S] [--idle-timeout S]\n" \
+              "       [--backlog N] [--max-sessions N] [--max-inflight MB] [--queue-wait S] [--metrics PATH]\n" \
+              "       [--local PATH]\n"
+
+// Steps of a connection, in the order the client drives them
+enum connectionState {
+    STATE_HELLO,    // Waiting for "otp_enc" / "otp_dec" or a HELLO frame, which picks the role
+    STATE_INPUT,    // Waiting for the plaintext or ciphertext
+    STATE_KEY,      // Waiting for the key
+    STATE_STREAM,   // Waiting for the next chunk of a streamed job
+    STATE_DISCARD,  // Dropping the frames left in a rejected job
+    STATE_CLOSE     // Close once everything queued has been sent
+};
+
+// Deadlines a connection can be under
+enum deadlineKind {
+    DEADLINE_NONE,
+    DEADLINE_HEADER,    // Until the hello is in
+    DEADLINE_BODY,      // While a message or a result is on its way
+    DEADLINE_IDLE,      // Between jobs
+    DEADLINE_QUEUE,     // Until a session is free to serve it
+    DEADLINE_KINDS
+};
+
+// Connections waiting for something, oldest first
+struct connectionQueue {
+    struct connection *head;
+    struct connection *tail;
+    int length;
+};
+
+// Everything we know about a single client connection
+struct connection {
+    int fd;
+    enum connectionState state;
+    int version;        // Protocol spoken by the client, 0 until we know
+    int packed;         // Whether the client's messages are packed
+    const struct daemonRole *role;  // What the client said it is in its hello
+    char *in;           // Bytes received and not handled yet
+    int inLength;
+    int inCapacity;
+    int inScanned;      // Bytes of in already searched for a newline
+    const char *input;  // The complete plaintext or ciphertext
+    int inputSize;
+    char *inputCopy;    // Holds input once it has to outlive in
+    int inputCopyCapacity;
+    uint32_t inputTag;  // Tag of the version 2 job the input belongs to
+    uint32_t streamTag; // Tag of the job being streamed or dropped
+    long long streamOffset; // Input of the streamed job handled so far
+    struct keyUpload *upload;   // Key being stored in the vault, if any
+    char *out;          // Bytes waiting to be sent
+    int outLength;
+    int outSent;
+    int outCapacity;
+    uint32_t events;    // Events currently registered with epoll
+    int peerClosed;     // The client will not send anything more
+    char *sending;      // Output the uring engine has handed to the kernel
+    int sendingLength;
+    int sendingSent;
+    int sendingCapacity;
+    int uringOps;       // Requests of the uring engine still in flight
+    int receiving;      // A multishot receive is armed
+    int stopReceiving;  // That receive is being cancelled
+    int broken;         // Sending failed, the deadline passed or memory ran out, the client is gone
+    int closing;        // Freed once its requests are done
+    enum deadlineKind deadline; // Deadline the connection is under
+    long long deadlineAt;       // When it runs out, 0 for never
+    unsigned progress;          // Messages handled and sends done so far
+    unsigned deadlineProgress;  // Progress when the deadline was set
+    struct timer timer;         // Fires at deadlineAt in the event loops
+    int admitted;               // Counted as one of the sessions being served
+    long long accounted;        // Bytes it holds, as counted in the budget
+    struct connectionQueue *queue;  // Queue it waits in, if any
+    struct connection *queuePrev;
+    struct connection *queueNext;
+    uint64_t acceptedAt;        // metricsClock() times the phases start at,
+    uint64_t receiveStart;      // 0 while the phase is not under way
+    uint64_t sendStart;
+    struct localRegion *region; // Shared region offered to a local client, if any
+    int shared;                 // The client runs jobs through it
+    uint32_t requestHead;       // Our own copies of the indices we move in it
+    uint32_t completionTail;
+};
+
+// State of the epoll engine
+struct eventLoop {
+    int epollFD;
+    struct timerWheel wheel;    // Deadlines of the connections
+    struct connectionQueue waiting;     // Accepted, waiting for a session
+    struct connectionQueue throttled;   // Not reading until we are under budget
+};
+
+// What a completion of the uring engine is for. It is kept in the low bits of
+// the request's user data, next to the connection it belongs to
+enum uringRequest {
+    URING_ACCEPT = 0,
+    URING_RECV = 1,
+    URING_SEND = 2,
+    URING_CANCEL = 3,
+    URING_TIMEOUT = 4,
+    URING_LOCAL_ACCEPT = 5
+};
+
+// State of the uring engine
+struct uringLoop {
+    struct uring ring;
+    struct uringBuffers buffers;    // Receive buffers shared by every connection
+    int listenSocketFD;
+    struct timerWheel wheel;    // Deadlines of the connections
+    struct __kernel_timespec timeout;   // Wait of the timeout request
+    int timeoutArmed;           // A timeout request is in flight
+    struct connectionQueue waiting;     // Accepted, waiting for a session
+    struct connectionQueue throttled;   // Not reading until we are under budget
+};
+
+// The old clients read replies 9 bytes at a time and drop whatever follows the
+// newline in a read. Padding the last confirmation to a whole read with NULs
+// (which strcat ignores) lets the result follow it right away instead of
+// waiting for the confirmation to be acknowledged first.
+static const char finalConfirmation[9] = "!\n";
+
+// Unpacked keys and chunks, and results waiting to be packed. Each process
+// handles one message at a time, so they can be shared by every connection
+static char unpackedInput[SIZE];
+static char unpackedKey[SIZE];
+static char unpackedResult[SIZE];
+
+// Connections closed and ready to serve another client, linked through
+// queueNext. Like the buffers they are never shared between processes
+static struct connection *freeConnections = NULL;
+
+// Workers started by the supervisor, indexed by worker number
+static pid_t *workerPid = NULL;
+static int nWorkers = 0;
+
+// Admission control: connections served by this process and bytes of messages
+// and results they hold. The fork engine counts its children instead, which
+// the SIGCHLD handler takes away from
+static int nSessions = 0;
+static long long bufferedBytes = 0;
+static int nChildren = 0;
+
+// Connections the fork engine has accepted while every child was busy, in a
+// ring of config->backlog, and when each was accepted
+static int *waitingFD = NULL;
+static long long *waitingSince;
+static int nWaiting = 0, firstWaiting = 0;
+
+// Unix socket local clients connect to, -1 without --local
+static int localSocketFD = -1;
+
+// Parses a timeout given in seconds, fractions allowed, into milliseconds.
+// Exits if it is not a number of seconds a day or less
+static int parseTimeout(struct daemonConfig *config, const char *argument) {
+    char *end;
+    double seconds = strtod(argument, &end);
+
+    if (end == argument || *end != '\0' || !(seconds >= 0 && seconds <= 86400)) {
+        fprintf(stderr, "%s: ERROR bad timeout %s\n", config->name, argument);
+        exit(1);
+    }
+    return (int)(seconds * 1000 + 0.5);
+}
+
+// Parses the command line into config, exits on bad usage
+void parseArguments(int argc, char *argv[], struct daemonConfig *config) {
+    int i;
+
+    config->engine = ENGINE_FORK;
+    config->portNumber = -1;
+    config->workers = 0;
+    config->threads = 0;
+    config->vaultDirectory = NULL;
+    config->metricsPath = NULL;
+    config->localPath = NULL;
+    config->headerTimeout = HEADER_TIMEOUT * 1000;
+    config->bodyTimeout = BODY_TIMEOUT * 1000;
+    config->idleTimeout = IDLE_TIMEOUT * 1000;
+    config->backlog = SOMAXCONN;
+    config->maxSessions = MAX_SESSIONS;
+    config->maxInflight = MAX_INFLIGHT * 1024LL * 1024;
+    config->queueWait = QUEUE_WAIT * 1000;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--engine") && i + 1 < argc) {
+            i++;
+            if (!strcmp(argv[i], "fork")) {
+                config->engine = ENGINE_FORK;
+            } else if (!strcmp(argv[i], "epoll")) {
+                config->engine = ENGINE_EPOLL;
+            } else if (!strcmp(argv[i], "uring")) {
+                config->engine = ENGINE_URING;
+            } else {
+                fprintf(stderr, "%s: ERROR unknown engine %s\n", config->name, argv[i]);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "--workers") && i + 1 < argc) {
+            config->workers = atoi(argv[++i]);
+            if (config->workers < 1) {
+                fprintf(stderr, "%s: ERROR need at least one worker\n", config->name);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            config->threads = atoi(argv[++i]);
+            if (config->threads < 1) {
+                fprintf(stderr, "%s: ERROR need at least one thread\n", config->name);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "--vault") && i + 1 < argc) {
+            config->vaultDirectory = argv[++i];
+        } else if (!strcmp(argv[i], "--header-timeout") && i + 1 < argc) {
+            config->headerTimeout = parseTimeout(config, argv[++i]);
+        } else if (!strcmp(argv[i], "--body-timeout") && i + 1 < argc) {
+            config->bodyTimeout = parseTimeout(config, argv[++i]);
+        } else if (!strcmp(argv[i], "--idle-timeout") && i + 1 < argc) {
+            config->idleTimeout = parseTimeout(config, argv[++i]);
+        } else if (!strcmp(argv[i], "--backlog") && i + 1 < argc) {
+            config->backlog = atoi(argv[++i]);
+            if (config->backlog < 1) {
+                fprintf(stderr, "%s: ERROR the backlog needs room for one connection\n", config->name);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "--max-sessions") && i + 1 < argc) {
+            config->maxSessions = atoi(argv[++i]);
+            if (config->maxSessions < 0) {
+                fprintf(stderr, "%s: ERROR bad session limit %s\n", config->name, argv[i]);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "--max-inflight") && i + 1 < argc) {
+            config->maxInflight = atoll(argv[++i]) * 1024 * 1024;
+            if (config->maxInflight < 0) {
+                fprintf(stderr, "%s: ERROR bad in-flight budget %s\n", config->name, argv[i]);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "--queue-wait") && i + 1 < argc) {
+            config->queueWait = parseTimeout(config, argv[++i]);
+        } else if (!strcmp(argv[i], "--metrics") && i + 1 < argc) {
+            config->metricsPath = argv[++i];
+        } else if (!strcmp(argv[i], "--local") && i + 1 < argc) {
+            config->localPath = argv[++i];
+        } else if (config->portNumber < 0) {
+            config->portNumber = atoi(argv[i]);
+        } else {
+            fprintf(stderr, USAGE, argv[0]);
+            exit(1);
+        }
+    }
+
+    if (config->portNumber < 0) {
+        fprintf(stderr, USAGE, argv[0]);
+        exit(1);
+    }
+}
+
+// Creates the socket listening on config->portNumber, exits on failure.
+// With reusePort set, several processes can listen on the same port
+int openListenSocket(struct daemonConfig *config, int reusePort) {
+    struct sockaddr_in serverAddress;
+    int listenSocketFD, on = 1;
+
+    // Set up the address struct
+    memset((char*)&serverAddress, '\0', sizeof(serverAddress));
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(config->portNumber);
+    serverAddress.sin_addr.s_addr = INADDR_ANY;
+
+    // Set up the socket
+    listenSocketFD = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenSocketFD < 0) {
+        fprintf(stderr, "%s: ERROR opening socket\n", config->name);
+        exit(1);
+    }
+    if (reusePort && setsockopt(listenSocketFD, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        fprintf(stderr, "%s: ERROR cannot set SO_REUSEPORT\n", config->name);
+        exit(1);
+    }
+
+    // Enable the socket to begin listening
+    if (bind(listenSocketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) {
+        fprintf(stderr, "%s: ERROR on binding\n", config->name);
+        exit(2);
+    }
+
+    // Call listen for connection
+    if (listen(listenSocketFD, config->backlog) < 0) {
+        fprintf(stderr, "%s: ERROR cannot listen call\n", config->name);
+        exit(2);
+    }
+
+    return listenSocketFD;
+}
+
+// Creates the Unix socket local clients connect to if --local was given, exits
+// on failure. Workers and forked children inherit it
+void openLocalSocket(struct daemonConfig *config) {
+    struct sockaddr_un address;
+
+    if (config->localPath == NULL) {
+        return;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(config->localPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "%s: ERROR socket path too long\n", config->name);
+        exit(1);
+    }
+    strcpy(address.sun_path, config->localPath);
+
+    // A socket left behind by an earlier run is replaced
+    localSocketFD = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (localSocketFD < 0) {
+        fprintf(stderr, "%s: ERROR opening socket\n", config->name);
+        exit(1);
+    }
+    unlink(config->localPath);
+    if (bind(localSocketFD, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        fprintf(stderr, "%s: ERROR on binding\n", config->name);
+        exit(2);
+    }
+    if (listen(localSocketFD, config->backlog) < 0) {
+        fprintf(stderr, "%s: ERROR cannot listen call\n", config->name);
+        exit(2);
+    }
+}
+
+// Sets O_NONBLOCK on a file descriptor
+static void setNonBlocking(int file_descriptor) {
+    int flags = fcntl(file_descriptor, F_GETFL, 0);
+    fcntl(file_descriptor, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Collects the exit status of every child that has terminated
+static void handleChildExit(int signo) {
+    int savedErrno = errno;
+    (void)signo;
+    while (waitpid(-1, NULL, WNOHANG) > 0) {
+        __atomic_sub_fetch(&nChildren, 1, __ATOMIC_RELAXED);
+    }
+    errno = savedErrno;
+}
+
+// Maps a metrics slot for every process that serves connections and starts
+// serving them if --metrics was given, exits if it cannot
+void setupMetrics(struct daemonConfig *config) {
+    mapMetrics(config->workers > 0 ? config->workers : 1);
+    if (config->metricsPath != NULL && serveMetrics(config->metricsPath, config->name) < 0) {
+        fprintf(stderr, "%s: ERROR cannot serve metrics on %s\n", config->name, config->metricsPath);
+        exit(1);
+    }
+}
+
+// Reaps every forked child as soon as it exits
+static void reapChildren() {
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handleChildExit;
+    action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, NULL);
+}
+
+// Closes the connections left waiting and the local socket, in a child
+// serving another connection
+static void closeWaiting(struct daemonConfig *config) {
+    while (nWaiting > 0) {
+        close(waitingFD[firstWaiting]);
+        firstWaiting = (firstWaiting + 1) % config->backlog;
+        nWaiting--;
+    }
+    if (localSocketFD >= 0) {
+        close(localSocketFD);
+    }
+}
+
+// Counts a child that was just forked
+static void childStarted() {
+    __atomic_add_fetch(&nChildren, 1, __ATOMIC_RELAXED);
+}
+
+// Counts a connection being shed. Only counted, as a daemon shedding load
+// sheds a lot of it
+static void countShed() {
+    countMetric(&processMetrics->shed, 1);
+}
+
+// Sends the '?' error response without blocking. Whatever the client has sent
+// is read first, as closing a socket with unread data resets the connection
+// and may lose the response
+static void sendRefusal(int file_descriptor) {
+    char discard[512];
+
+    while (recv(file_descriptor, discard, sizeof(discard), MSG_DONTWAIT) > 0);
+    send(file_descriptor, "?\n", 2, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+// Accepts connections and returns the oldest one once a child is free to serve
+// it, for the fork engine. Connections wait in a queue no longer than the
+// backlog, and are shed if they find it full or wait longer than queueWait
+static int acceptForChild(int listenSocketFD, struct daemonConfig *config) {
+    struct pollfd pollFDs[2];
+    struct timespec wait;
+    sigset_t childSignal, oldSignals;
+    long long left = -1;
+    int establishedConnectionFD, i;
+
+    if (waitingFD == NULL) {
+        waitingFD = malloc(config->backlog * sizeof(int));
+        waitingSince = malloc(config->backlog * sizeof(long long));
+        setNonBlocking(listenSocketFD);
+    }
+
+    // With SIGCHLD blocked until the wait, a child cannot exit unnoticed
+    // between the check and the wait
+    sigemptyset(&childSignal);
+    sigaddset(&childSignal, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &childSignal, &oldSignals);
+
+    pollFDs[0].fd = listenSocketFD;
+    pollFDs[1].fd = localSocketFD;
+    pollFDs[0].events = pollFDs[1].events = POLLIN;
+
+    while (1) {
+        // Local clients wait in the same queue
+        for (i = 0; i < 2 && pollFDs[i].fd >= 0; i++) {
+            while ((establishedConnectionFD = accept(pollFDs[i].fd, NULL, NULL)) >= 0) {
+                if (nWaiting == config->backlog) {
+                    countShed();
+                    sendRefusal(establishedConnectionFD);
+                    close(establishedConnectionFD);
+                    continue;
+                }
+                waitingFD[(firstWaiting + nWaiting) % config->backlog] = establishedConnectionFD;
+                waitingSince[(firstWaiting + nWaiting) % config->backlog] = monotonicMilliseconds();
+                nWaiting++;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                fprintf(stderr, "%s: ERROR on accept\n", config->name);
+            }
+        }
+
+        // Shed the connections that waited too long
+        while (nWaiting > 0 && config->queueWait > 0 &&
+               (left = waitingSince[firstWaiting] + config->queueWait - monotonicMilliseconds()) <= 0) {
+            countShed();
+            sendRefusal(waitingFD[firstWaiting]);
+            close(waitingFD[firstWaiting]);
+            firstWaiting = (firstWaiting + 1) % config->backlog;
+            nWaiting--;
+        }
+
+        // Hand the oldest one over if a child is free
+        if (nWaiting > 0 && (config->maxSessions == 0 ||
+                             __atomic_load_n(&nChildren, __ATOMIC_RELAXED) < config->maxSessions)) {
+            establishedConnectionFD = waitingFD[firstWaiting];
+            firstWaiting = (firstWaiting + 1) % config->backlog;
+            nWaiting--;
+            sigprocmask(SIG_SETMASK, &oldSignals, NULL);
+            return establishedConnectionFD;
+        }
+
+        // Sleep until a connection comes, a child exits or the oldest one
+        // waiting runs out of time
+        if (nWaiting > 0 && config->queueWait > 0) {
+            wait.tv_sec = left / 1000;
+            wait.tv_nsec = left % 1000 * 1000000;
+        }
+        ppoll(pollFDs, localSocketFD >= 0 ? 2 : 1, nWaiting > 0 && config->queueWait > 0 ? &wait : NULL,
+              &oldSignals);
+    }
+}
+
+// Creates the state for a newly accepted connection
+static struct connection *newConnection(int file_descriptor) {
+    struct connection *conn;
+    int i;
+
+    // Only the first connections of a process, and the busiest moments after,
+    // ask the system for memory
+    if (freeConnections == NULL) {
+        conn = calloc(CONNECTION_BATCH, sizeof(struct connection));
+        if (conn == NULL) {
+            return NULL;
+        }
+        for (i = 0; i < CONNECTION_BATCH; i++) {
+            conn[i].queueNext = freeConnections;
+            freeConnections = &conn[i];
+        }
+        moveGauge(&processMetrics->connectionsFree, CONNECTION_BATCH);
+    }
+    conn = freeConnections;
+    freeConnections = conn->queueNext;
+    moveGauge(&processMetrics->connectionsFree, -1);
+
+    memset(conn, 0, sizeof(struct connection));
+    conn->fd = file_descriptor;
+    conn->state = STATE_HELLO;
+    conn->acceptedAt = metricsClock();
+    countMetric(&processMetrics->connections, 1);
+    moveGauge(&processMetrics->active, 1);
+    return conn;
+}
+
+// Offers a shared region to a connection just accepted on the local socket,
+// or tells it there is none. A connection the offer cannot be sent to is
+// closed without a word, as it would take its first answer for the region
+static void offerRegion(struct connection *conn) {
+    int memfd = createRegion(&conn->region);
+
+    if (memfd < 0) {
+        conn->region = NULL;
+    }
+    if (!sendRegion(conn->fd, memfd)) {
+        conn->state = STATE_CLOSE;
+    }
+    if (memfd >= 0) {
+        close(memfd);
+    }
+}
+
+// Adds a connection at the end of queue
+static void enqueueConnection(struct connectionQueue *queue, struct connection *conn) {
+    conn->queue = queue;
+    conn->queuePrev = queue->tail;
+    conn->queueNext = NULL;
+    if (queue->tail != NULL) {
+        queue->tail->queueNext = conn;
+    } else {
+        queue->head = conn;
+    }
+    queue->tail = conn;
+    queue->length++;
+}
+
+// Takes a connection out of the queue it waits in
+static void dequeueConnection(struct connection *conn) {
+    struct connectionQueue *queue = conn->queue;
+
+    if (conn->queuePrev != NULL) {
+        conn->queuePrev->queueNext = conn->queueNext;
+    } else {
+        queue->head = conn->queueNext;
+    }
+    if (conn->queueNext != NULL) {
+        conn->queueNext->queuePrev = conn->queuePrev;
+    } else {
+        queue->tail = conn->queuePrev;
+    }
+    queue->length--;
+    conn->queue = NULL;
+}
+
+// Releases everything a connection owns and closes its socket
+static void freeConnection(struct connection *conn) {
+    if (conn->queue != NULL) {
+        dequeueConnection(conn);
+    }
+    if (conn->admitted) {
+        nSessions--;
+    }
+    bufferedBytes -= conn->accounted;
+    moveGauge(&processMetrics->active, -1);
+    if (conn->upload != NULL) {
+        abortUpload(conn->upload);
+    }
+    if (conn->region != NULL) {
+        unmapRegion(conn->region);
+    }
+    close(conn->fd);
+    giveBuffer(conn->in, conn->inCapacity);
+    giveBuffer(conn->inputCopy, conn->inputCopyCapacity);
+    giveBuffer(conn->out, conn->outCapacity);
+    giveBuffer(conn->sending, conn->sendingCapacity);
+    conn->queueNext = freeConnections;
+    freeConnections = conn;
+    moveGauge(&processMetrics->connectionsFree, 1);
+}
+
+// Stops counting the free connections of a process about to exit, in the
+// slot it shares with the others. Their memory goes with the process
+static void drainConnections() {
+    while (freeConnections != NULL) {
+        freeConnections = freeConnections->queueNext;
+        moveGauge(&processMetrics->connectionsFree, -1);
+    }
+}
+
+// Gives up on a connection the process has no memory left for. What it has
+// queued is dropped, and its engine closes it like one whose client is gone
+static void breakConnection(struct connection *conn) {
+    conn->broken = 1;
+    conn->state = STATE_CLOSE;
+    conn->outLength = 0;
+    conn->outSent = 0;
+}
+
+// Makes room for size more bytes at the end of the output queue and returns
+// where they go, or NULL if the connection broke for want of memory
+static char *reserveOutput(struct connection *conn, int size) {
+    int pending = conn->outLength - conn->outSent;
+    char *out;
+
+    if (conn->broken) {
+        return NULL;
+    }
+
+    // Drop what has already been sent before growing the queue
+    if (conn->outSent > 0) {
+        memmove(conn->out, conn->out + conn->outSent, pending);
+        conn->outLength = pending;
+        conn->outSent = 0;
+    }
+
+    // The next class up is at least twice as large
+    out = growBuffer(conn->out, conn->outLength, &conn->outCapacity, conn->outLength + size);
+    if (out == NULL) {
+        breakConnection(conn);
+        return NULL;
+    }
+    conn->out = out;
+    conn->outLength += size;
+    return conn->out + conn->outLength - size;
+}
+
+// Makes the connection's own copy of its input at least size bytes long.
+// Returns 0 if the connection broke for want of memory
+static int reserveInputCopy(struct connection *conn, int size) {
+    char *inputCopy = growBuffer(conn->inputCopy, 0, &conn->inputCopyCapacity, size);
+
+    if (inputCopy == NULL) {
+        breakConnection(conn);
+        return 0;
+    }
+    conn->inputCopy = inputCopy;
+    return 1;
+}
+
+// Appends bytes to the output queue
+static void queueBytes(struct connection *conn, const char *bytes, int size) {
+    char *space = reserveOutput(conn, size);
+
+    if (space != NULL) {
+        memcpy(space, bytes, size);
+    }
+}
+
+// Appends a newline terminated message to the output queue
+static void queueMessage(struct connection *conn, const char *message, int size) {
+    queueBytes(conn, message, size);
+    queueBytes(conn, "\n", 1);
+}
+
+// Appends the header of a version 2 frame to the output queue
+static void queueHeader(struct connection *conn, int op, uint32_t tag, int flags, int size) {
+    struct frameHeader header;
+    char *space = reserveOutput(conn, OTP_HEADER_SIZE);
+
+    if (space == NULL) {
+        return;
+    }
+    makeHeader(&header, op, tag, size);
+    header.flags = flags;
+    encodeHeader(space, &header);
+}
+
+// Appends a version 2 frame to the output queue
+static void queueFrame(struct connection *conn, int op, uint32_t tag, const char *payload, int size) {
+    queueHeader(conn, op, tag, 0, size);
+    queueBytes(conn, payload, size);
+}
+
+// Reports an error to the client. Errors about a single version 2 job leave
+// the session open, every other error closes the connection once it is sent
+static void rejectJob(struct connection *conn, struct daemonConfig *config, uint32_t tag,
+                      enum errorKind kind, const char *reason, int fatal) {
+    countMetric(&processMetrics->errors[kind], 1);
+    fprintf(stderr, "%s: ERROR %s\n", config->name, reason);
+    if (conn->version == 2) {
+        queueFrame(conn, OP_ERROR, tag, reason, strlen(reason));
+    } else {
+        queueMessage(conn, "?", 1);
+    }
+    if (fatal || conn->version != 2) {
+        conn->state = STATE_CLOSE;
+    }
+}
+
+// Records the receive phase of a job whose last message has just come in
+static void noteReceived(struct connection *conn) {
+    if (conn->receiveStart != 0) {
+        recordLatency(PHASE_RECEIVE, metricsClock() - conn->receiveStart);
+        conn->receiveStart = 0;
+    }
+}
+
+// Counts a job, or a chunk of one, whose result has just been queued, and
+// starts its send phase unless an earlier result is still going out
+static void noteResult(struct connection *conn, int size, int done) {
+    countMetric(&processMetrics->characters, size);
+    if (done) {
+        countMetric(&processMetrics->jobs, 1);
+    }
+    if (conn->sendStart == 0) {
+        conn->sendStart = metricsClock();
+    }
+}
+
+// Number of threads each process shares a large job between by default: its
+// part of the CPUs
+static int defaultThreads(struct daemonConfig *config) {
+    int nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return config->workers > 0 ? nCpus / config->workers : nCpus;
+}
+
+// Runs the transform of conn's role, on the shard pool for large jobs. The
+// pool is started on first use, by the process that runs the job, and shared
+// by every role
+static size_t runTransform(struct connection *conn, struct daemonConfig *config, const char input[],
+                           const char key[], char output[], size_t size) {
+    static struct shardPool *pool = NULL;
+    static int started = 0;
+    uint64_t start = metricsClock();
+    size_t valid;
+
+    if (size >= SHARD_THRESHOLD && !started) {
+        pool = startShardPool(config->threads > 0 ? config->threads : defaultThreads(config));
+        started = 1;
+    }
+    if (size < SHARD_THRESHOLD || pool == NULL) {
+        valid = conn->role->transform(input, key, output, size);
+    } else {
+        valid = shardTransform(pool, conn->role->transform, input, key, output, size);
+    }
+    recordLatency(PHASE_TRANSFORM, metricsClock() - start);
+    return valid;
+}
+
+// Unpacks length bytes of a packed message into text, which holds SIZE
+// characters. Returns the number of characters, or -1 if the message is
+// malformed or too long
+static int unpackMessage(const char packed[], int length, char text[]) {
+    long long size = unpackedSize(packed, length);
+
+    if (size < 0 || size > SIZE || !unpackText(packed, length, text)) {
+        return -1;
+    }
+    return size;
+}
+
+// Validates the input against its key and queues the transformed result right
+// after its header. Both happen in one pass, straight into the output queue.
+// Returns 0 if the job was rejected
+static int transformJob(struct connection *conn, struct daemonConfig *config, uint32_t tag,
+                        const char key[], int keySize) {
+    char reason[48];
+    char *result;
+    int headerSize, resultSize;
+    size_t valid;
+
+    if (conn->inputSize > keySize) {
+        rejectJob(conn, config, tag, ERROR_SHORT_KEY, "key is too short", 0);
+        return 0;
+    }
+
+    resultSize = conn->packed ? (int)packedSize(conn->inputSize) : conn->inputSize;
+    if (conn->version == 2) {
+        queueHeader(conn, OP_RESULT, tag, 0, resultSize);
+        headerSize = OTP_HEADER_SIZE;
+    } else {
+        queueBytes(conn, finalConfirmation, sizeof(finalConfirmation));
+        headerSize = sizeof(finalConfirmation);
+    }
+    result = reserveOutput(conn, resultSize);
+    if (result == NULL) {
+        return 0;
+    }
+    valid = runTransform(conn, config, conn->input, key, conn->packed ? unpackedResult : result, conn->inputSize);
+
+    // Take the half written result back out of the queue
+    if (valid < (size_t)conn->inputSize) {
+        conn->outLength -= headerSize + resultSize;
+        sprintf(reason, "bad input at offset %zu", valid);
+        rejectJob(conn, config, tag, ERROR_BAD_INPUT, reason, 0);
+        return 0;
+    }
+    if (conn->packed) {
+        packText(unpackedResult, result, conn->inputSize);
+    }
+    noteResult(conn, conn->inputSize, 1);
+    return 1;
+}
+
+// Drops the frames still to come of a job that has been rejected part way
+static void discardJob(struct connection *conn, struct frameHeader *header) {
+    if (header->flags & FLAG_MORE) {
+        conn->streamTag = header->tag;
+        conn->state = STATE_DISCARD;
+    } else {
+        conn->state = STATE_INPUT;
+        conn->receiveStart = 0;
+    }
+}
+
+// Transforms one chunk of a streamed job (its input followed by as much key)
+// and queues the result. After a bad chunk the rest of the job is dropped
+static void streamChunk(struct connection *conn, struct daemonConfig *config,
+                        struct frameHeader *header, char *payload) {
+    int more = header->flags & FLAG_MORE;
+    int size = header->length / 2, resultSize;
+    const char *input = payload, *key = payload + size;
+    char reason[48];
+    char *result;
+    size_t valid;
+
+    if (conn->state == STATE_INPUT) {
+        conn->streamTag = header->tag;
+        conn->streamOffset = 0;
+        conn->state = STATE_STREAM;
+    } else if (header->op != OP_CHUNK || header->tag != conn->streamTag) {
+        rejectJob(conn, config, header->tag, ERROR_PROTOCOL, "expected CHUNK", 1);
+        return;
+    }
+    if (header->length % 2 != 0) {
+        rejectJob(conn, config, header->tag, ERROR_PROTOCOL, "bad chunk", 1);
+        return;
+    }
+
+    // Both halves of a packed chunk hold the same number of characters
+    resultSize = size;
+    if (conn->packed) {
+        size = unpackMessage(payload, resultSize, unpackedInput);
+        if (size < 0 || unpackMessage(payload + resultSize, resultSize, unpackedKey) != size) {
+            rejectJob(conn, config, header->tag, ERROR_PROTOCOL, "bad chunk", 1);
+            return;
+        }
+        input = unpackedInput;
+        key = unpackedKey;
+    }
+
+    queueHeader(conn, OP_RESULT, header->tag, more, resultSize);
+    result = reserveOutput(conn, resultSize);
+    if (result == NULL) {
+        return;
+    }
+    valid = runTransform(conn, config, input, key, conn->packed ? unpackedResult : result, size);
+    if (valid < (size_t)size) {
+        conn->outLength -= OTP_HEADER_SIZE + resultSize;
+        sprintf(reason, "bad input at offset %lld", conn->streamOffset + (long long)valid);
+        rejectJob(conn, config, header->tag, ERROR_BAD_INPUT, reason, 0);
+        discardJob(conn, header);
+        return;
+    }
+
+    if (conn->packed) {
+        packText(unpackedResult, result, size);
+    }
+    conn->streamOffset += size;
+    if (!more) {
+        conn->state = STATE_INPUT;
+        noteReceived(conn);
+    }
+    noteResult(conn, size, !more);
+}
+
+// Serves every request the client has submitted to its region, transforming
+// each in place and posting its completion, then answers the RING frame.
+// Requests are copied out of the region before they are checked, and only
+// ever touch the data area
+static void serveRing(struct connection *conn, struct daemonConfig *config, struct frameHeader *header) {
+    struct localRequest request;
+    struct localCompletion completion;
+    char *data = regionData(conn->region);
+    int taken;
+
+    noteReceived(conn);
+    while ((taken = takeRequest(conn->region, &conn->requestHead, &request)) > 0) {
+        completion.tag = request.tag;
+        if (request.size > LOCAL_DATA_SIZE || request.input > LOCAL_DATA_SIZE - request.size ||
+                request.key > LOCAL_DATA_SIZE - request.size || request.output > LOCAL_DATA_SIZE - request.size) {
+            countMetric(&processMetrics->errors[ERROR_PROTOCOL], 1);
+            fprintf(stderr, "%s: ERROR request out of the region\n", config->name);
+            completion.status = LOCAL_BAD_REQUEST;
+            completion.valid = 0;
+        } else {
+            completion.valid = runTransform(conn, config, data + request.input, data + request.key,
+                                            data + request.output, request.size);
+            completion.status = completion.valid < request.size ? LOCAL_BAD_INPUT : LOCAL_DONE;
+            if (completion.status == LOCAL_DONE) {
+                noteResult(conn, request.size, 1);
+            } else {
+                countMetric(&processMetrics->errors[ERROR_BAD_INPUT], 1);
+                fprintf(stderr, "%s: ERROR bad input at offset %llu\n", config->name,
+                        (unsigned long long)completion.valid);
+            }
+        }
+        if (!postCompletion(conn->region, &conn->completionTail, &completion)) {
+            rejectJob(conn, config, header->tag, ERROR_PROTOCOL, "too many requests outstanding", 1);
+            return;
+        }
+    }
+    if (taken < 0) {
+        rejectJob(conn, config, header->tag, ERROR_PROTOCOL, "bad request ring", 1);
+        return;
+    }
+    queueHeader(conn, OP_RING, header->tag, 0, 0);
+    noteResult(conn, 0, 0);
+}
+
+// Runs the job waiting in conn with a key from the vault. The payload is the
+// offset into the key followed by its id
+static void vaultJob(struct connection *conn, struct daemonConfig *config,
+                     struct frameHeader *header, char *payload) {
+    const char *key, *reason;
+    uint32_t offsetHigh, offsetLow;
+    uint64_t offset;
+
+    if (header->length < 8) {
+        rejectJob(conn, config, header->tag, ERROR_PROTOCOL, "bad KEYREF", 1);
+        return;
+    }
+    memcpy(&offsetHigh, payload, 4);
+    memcpy(&offsetLow, payload + 4, 4);
+    offset = (uint64_t)ntohl(offsetHigh) << 32 | ntohl(offsetLow);
+    if (offset > LLONG_MAX) {
+        rejectJob(conn, config, header->tag, ERROR_VAULT, "key is too short", 0);
+        return;
+    }
+
+    // An encrypting daemon marks the range used before the job is checked, so
+    // a pad is never used twice even if this job fails
+    reason = lookupKey(config->vaultDirectory, conn->role->consumesKey, payload + 8, header->length - 8,
+                       (long long)offset, conn->inputSize, &key);
+    if (reason != NULL) {
+        rejectJob(conn, config, header->tag, ERROR_VAULT, reason, 0);
+        return;
+    }
+    transformJob(conn, config, header->tag, key, conn->inputSize);
+}
+
+// Adds a STORE frame to the key being uploaded. The payload is the key id,
+// a newline and the next part of the key
+static void storeFrame(struct connection *conn, struct daemonConfig *config,
+                       struct frameHeader *header, char *payload) {
+    int last = !(header->flags & FLAG_MORE);
+    const char *reason;
+    char *newline = memchr(payload, '\n', header->length);
+
+    if (newline == NULL) {
+        rejectJob(conn, config, header->tag, ERROR_PROTOCOL, "bad STORE", 1);
+        return;
+    }
+    reason = storeKey(config->vaultDirectory, &conn->upload, payload, newline - payload,
+                      newline + 1, header->length - (newline + 1 - payload), last);
+
+    if (reason != NULL) {
+        rejectJob(conn, config, header->tag, ERROR_VAULT, reason, 0);
+        discardJob(conn, header);
+    } else if (last) {
+        noteReceived(conn);
+        queueHeader(conn, OP_RESULT, header->tag, 0, 0);
+    }
+}
+
+// Returns the role of the client called name, which is size bytes long, or
+// NULL if the daemon serves no such client
+static const struct daemonRole *findRole(struct daemonConfig *config, const char *name, int size) {
+    int i;
+
+    for (i = 0; i < config->nRoles; i++) {
+        if (size == (int)strlen(config->roles[i].clientName) && !memcmp(name, config->roles[i].clientName, size)) {
+            return &config->roles[i];
+        }
+    }
+    return NULL;
+}
+
+// Explains why a hello matched none of the roles
+static void describeRoles(struct daemonConfig *config, char reason[]) {
+    if (config->nRoles == 1) {
+        sprintf(reason, "not %s", config->roles[0].clientName);
+    } else {
+        sprintf(reason, "unknown client");
+    }
+}
+
+// Handles one complete version 1 message (without its newline)
+static void handleMessage(struct connection *conn, struct daemonConfig *config, char *message, int size) {
+    char reason[32];
+
+    switch (conn->state) {
+        case STATE_HELLO:
+            conn->role = findRole(config, message, size);
+            if (conn->role == NULL) {
+                describeRoles(config, reason);
+                rejectJob(conn, config, 0, ERROR_AUTH, reason, 1);
+                return;
+            }
+            queueMessage(conn, "!", 1);
+            conn->state = STATE_INPUT;
+            recordLatency(PHASE_HANDSHAKE, metricsClock() - conn->acceptedAt);
+            break;
+
+        case STATE_INPUT:
+            conn->input = message;
+            conn->inputSize = size;
+            queueMessage(conn, "!", 1);
+            conn->state = STATE_KEY;
+            break;
+
+        case STATE_KEY:
+            noteReceived(conn);
+            if (transformJob(conn, config, 0, message, size)) {
+                queueBytes(conn, "\n", 1);
+            }
+            conn->state = STATE_CLOSE;
+            break;
+
+        default:
+            // Nothing more is expected from the client
+            break;
+    }
+}
+
+// Handles one complete version 2 frame
+static void handleFrame(struct connection *conn, struct daemonConfig *config,
+                        struct frameHeader *header, char *payload) {
+    char reason[32];
+    int keySize;
+
+    switch (conn->state) {
+        case STATE_HELLO:
+            if (header->op != OP_HELLO) {
+                rejectJob(conn, config, header->tag, ERROR_PROTOCOL, "expected HELLO", 1);
+                return;
+            }
+            if (header->version < 2) {
+                rejectJob(conn, config, header->tag, ERROR_PROTOCOL, "unsupported version", 1);
+                return;
+            }
+            // The name is followed by a newline (see otp_protocol.h)
+            conn->role = header->length > 0 ? findRole(config, payload, header->length - 1) : NULL;
+            if (conn->role == NULL) {
+                describeRoles(config, reason);
+                rejectJob(conn, config, header->tag, ERROR_AUTH, reason, 1);
+                return;
+            }
+
+            // Our HELLO carries OTP_VERSION, which is never above the
+            // client's, so both sides settle on it. Sharing is agreed to
+            // whenever the client was offered a region, and packing whenever
+            // the client asks and does not share
+            conn->shared = (header->flags & FLAG_SHARED) && conn->region != NULL;
+            conn->packed = (header->flags & FLAG_PACKED) && !conn->shared;
+            queueHeader(conn, OP_HELLO, header->tag,
+                        (conn->packed ? FLAG_PACKED : 0) | (conn->shared ? FLAG_SHARED : 0), 0);
+            conn->state = STATE_INPUT;
+            recordLatency(PHASE_HANDSHAKE, metricsClock() - conn->acceptedAt);
+            break;
+
+        case STATE_INPUT:
+            if (header->op == OP_CHUNK) {
+                streamChunk(conn, config, header, payload);
+                return;
+            }
+            if (header->op == OP_STORE) {
+                storeFrame(conn, config, header, payload);
+                return;
+            }
+            if (header->op == OP_RING && conn->shared) {
+                serveRing(conn, config, header);
+                return;
+            }
+            if (header->op != OP_INPUT) {
+                rejectJob(conn, config, header->tag, ERROR_PROTOCOL, "expected INPUT", 1);
+                return;
+            }
+            conn->input = payload;
+            conn->inputSize = header->length;
+            conn->inputTag = header->tag;
+
+            // A packed input is unpacked into the connection's own copy
+            if (conn->packed) {
+                if (!reserveInputCopy(conn, SIZE + 1)) {
+                    return;
+                }
+                conn->inputSize = unpackMessage(payload, header->length, conn->inputCopy);
+                conn->input = conn->inputCopy;
+                if (conn->inputSize < 0) {
+                    rejectJob(conn, config, header->tag, ERROR_PROTOCOL, "bad packed input", 1);
+                    return;
+                }
+            }
+            conn->state = STATE_KEY;
+            break;
+
+        case STATE_KEY:
+            if ((header->op != OP_KEY && header->op != OP_KEYREF) || header->tag != conn->inputTag) {
+                rejectJob(conn, config, header->tag, ERROR_PROTOCOL, "expected KEY", 1);
+                return;
+            }
+            noteReceived(conn);
+            if (header->op == OP_KEYREF) {
+                vaultJob(conn, config, header, payload);
+            } else if (!conn->packed) {
+                transformJob(conn, config, header->tag, payload, header->length);
+            } else if ((keySize = unpackMessage(payload, header->length, unpackedKey)) < 0) {
+                rejectJob(conn, config, header->tag, ERROR_PROTOCOL, "bad packed key", 1);
+                return;
+            } else {
+                transformJob(conn, config, header->tag, unpackedKey, keySize);
+            }
+            if (conn->state == STATE_KEY) {
+                conn->state = STATE_INPUT;
+            }
+            break;
+
+        case STATE_STREAM:
+            streamChunk(conn, config, header, payload);
+            break;
+
+        case STATE_DISCARD:
+            if (header->tag != conn->streamTag) {
+                rejectJob(conn, config, header->tag, ERROR_PROTOCOL, "expected rest of rejected job", 1);
+                return;
+            }
+            discardJob(conn, header);
+            break;
+
+        default:
+            break;
+    }
+}
+
+// Handles the version 1 message at the start of data.
+// Returns the number of bytes used, 0 if the message is not complete
+static int handleLine(struct connection *conn, struct daemonConfig *config, char *data, int available) {
+    char *newline;
+
+    // Only search the bytes we have not searched before
+    newline = memchr(data + conn->inScanned, '\n', available - conn->inScanned);
+    if (newline == NULL) {
+        conn->inScanned = available;
+
+        // Messages are capped at SIZE just like the forked children
+        if (available > SIZE) {
+            rejectJob(conn, config, 0, ERROR_PROTOCOL, "message too long", 1);
+        }
+        return 0;
+    }
+
+    handleMessage(conn, config, data, newline - data);
+    conn->inScanned = 0;
+    return newline - data + 1;
+}
+
+// Handles the version 2 frame at the start of data.
+// Returns the number of bytes used, 0 if the frame is not complete
+static int handleFrameBytes(struct connection *conn, struct daemonConfig *config, char *data, int available) {
+    struct frameHeader header;
+
+    if (available < OTP_HEADER_SIZE) {
+        return 0;
+    }
+    if (!decodeHeader(data, &header)) {
+        rejectJob(conn, config, 0, ERROR_PROTOCOL, "bad frame", 1);
+        return 0;
+    }
+    if (header.length > SIZE) {
+        rejectJob(conn, config, header.tag, ERROR_PROTOCOL, "message too long", 1);
+        return 0;
+    }
+    if (available < OTP_HEADER_SIZE + (int)header.length) {
+        return 0;
+    }
+
+    handleFrame(conn, config, &header, data + OTP_HEADER_SIZE);
+    return OTP_HEADER_SIZE + header.length;
+}
+
+// Handles every complete message or frame sitting in the input buffer
+static void handleInput(struct connection *conn, struct daemonConfig *config) {
+    uint32_t magic;
+    int used, consumed = 0;
+
+    // The first bytes tell which protocol the client speaks
+    if (conn->version == 0) {
+        if (conn->inLength < 4 && memchr(conn->in, '\n', conn->inLength) == NULL) {
+            return;
+        }
+        magic = htonl(OTP_MAGIC);
+        conn->version = conn->inLength >= 4 && !memcmp(conn->in, &magic, 4) ? 2 : 1;
+    }
+
+    while (conn->state != STATE_CLOSE && !conn->broken) {
+        // A job is being received from its first byte on
+        if (conn->state == STATE_INPUT && conn->receiveStart == 0 && consumed < conn->inLength) {
+            conn->receiveStart = metricsClock();
+        }
+        if (conn->version == 2) {
+            used = handleFrameBytes(conn, config, conn->in + consumed, conn->inLength - consumed);
+        } else {
+            used = handleLine(conn, config, conn->in + consumed, conn->inLength - consumed);
+        }
+        if (used == 0) {
+            break;
+        }
+        consumed += used;
+    }
+
+    // The input is used where it was read, which is free when its key is in the
+    // same buffer. Otherwise it is still waiting, and has to be copied out
+    // before the buffer moves
+    if (conn->state == STATE_KEY && conn->input != conn->inputCopy && reserveInputCopy(conn, conn->inputSize + 1)) {
+        memcpy(conn->inputCopy, conn->input, conn->inputSize);
+        conn->input = conn->inputCopy;
+    }
+
+    // Keep what is left of an incomplete message at the start of the buffer
+    if (consumed > 0) {
+        memmove(conn->in, conn->in + consumed, conn->inLength - consumed);
+        conn->inLength -= consumed;
+        conn->progress++;
+    }
+}
+
+// Makes room for at least READ_CHUNK more bytes in the input buffer. Returns 0
+// if the connection broke for want of memory
+static int reserveInput(struct connection *conn) {
+    char *in = growBuffer(conn->in, conn->inLength, &conn->inCapacity, conn->inLength + READ_CHUNK);
+
+    if (in == NULL) {
+        breakConnection(conn);
+        return 0;
+    }
+    conn->in = in;
+    return 1;
+}
+
+// Number of bytes queued for the client and not sent yet
+static int pendingOutput(struct connection *conn) {
+    return conn->outLength - conn->outSent + conn->sendingLength - conn->sendingSent;
+}
+
+// Records the send phase once the client has been sent every result
+static void noteSent(struct connection *conn) {
+    if (conn->sendStart != 0 && pendingOutput(conn) == 0) {
+        recordLatency(PHASE_SEND, metricsClock() - conn->sendStart);
+        conn->sendStart = 0;
+    }
+}
+
+// Whether a connection has nothing left to do
+static int isFinished(struct connection *conn) {
+    return conn->broken || ((conn->state == STATE_CLOSE || conn->peerClosed) && pendingOutput(conn) == 0);
+}
+
+// Brings the count of bytes held by the process up to date with a connection:
+// the messages it has not handled, the results it has not sent and the input
+// kept until its key comes
+static void accountConnection(struct connection *conn) {
+    long long held = conn->inLength + pendingOutput(conn);
+
+    if (conn->state == STATE_KEY) {
+        held += conn->inputSize;
+    }
+    bufferedBytes += held - conn->accounted;
+    conn->accounted = held;
+}
+
+// Whether a connection has to stop reading until the process is back under
+// its budget. Only connections between messages wait, so every message and
+// job already started can finish and give its bytes back
+static int waitsForBudget(struct connection *conn, struct daemonConfig *config) {
+    return config->maxInflight > 0 && bufferedBytes >= config->maxInflight &&
+           conn->inLength == 0 && conn->state != STATE_KEY;
+}
+
+// Works out which deadline a connection is under and starts it over when it
+// changes, or when a body deadline sees progress. Returns 1 if it started over
+static int updateDeadline(struct connection *conn, struct daemonConfig *config) {
+    enum deadlineKind kind;
+    int milliseconds;
+
+    // A connection we stopped reading for the budget is waiting on us, unless
+    // its client is not taking its results
+    if (waitsForBudget(conn, config) && pendingOutput(conn) == 0) {
+        kind = DEADLINE_NONE;
+    } else if (conn->state == STATE_HELLO) {
+        kind = DEADLINE_HEADER;
+    } else if (conn->state != STATE_INPUT || conn->inLength > 0 || pendingOutput(conn) > 0) {
+        kind = DEADLINE_BODY;
+    } else {
+        kind = DEADLINE_IDLE;
+    }
+    if (kind == conn->deadline && (kind != DEADLINE_BODY || conn->progress == conn->deadlineProgress)) {
+        return 0;
+    }
+
+    conn->deadline = kind;
+    conn->deadlineProgress = conn->progress;
+    milliseconds = kind == DEADLINE_HEADER ? config->headerTimeout :
+                   kind == DEADLINE_BODY ? config->bodyTimeout :
+                   kind == DEADLINE_IDLE ? config->idleTimeout : 0;
+    conn->deadlineAt = milliseconds > 0 ? monotonicMilliseconds() + milliseconds : 0;
+    return 1;
+}
+
+// Counts a connection that missed its deadline, in the metric of its kind
+static void timedOut(struct connection *conn) {
+    countMetric(&processMetrics->timeouts[conn->deadline - DEADLINE_HEADER], 1);
+}
+
+// Waits until the socket is ready for events or the deadline of the
+// connection runs out. Returns 0 if it ran out
+static int waitForDeadline(struct connection *conn, short events) {
+    struct pollfd pollFD;
+    long long left;
+    int ready;
+
+    if (conn->deadlineAt == 0) {
+        return 1;
+    }
+    pollFD.fd = conn->fd;
+    pollFD.events = events;
+    do {
+        left = conn->deadlineAt - monotonicMilliseconds();
+        if (left <= 0) {
+            return 0;
+        }
+        ready = poll(&pollFD, 1, left > INT_MAX ? INT_MAX : (int)left);
+    } while (ready == 0 || (ready < 0 && errno == EINTR));
+    return 1;
+}
+
+// Serves a single connection with blocking reads and writes
+static void serveBlocking(int file_descriptor, struct daemonConfig *config) {
+    struct connection *conn = newConnection(file_descriptor);
+    int charsRead, charsWritten, domain;
+    socklen_t length = sizeof(domain);
+
+    if (conn == NULL) {
+        close(file_descriptor);
+        return;
+    }
+    if (getsockopt(file_descriptor, SOL_SOCKET, SO_DOMAIN, &domain, &length) == 0 && domain == AF_UNIX) {
+        offerRegion(conn);
+    }
+    updateDeadline(conn, config);
+    while (!isFinished(conn)) {
+
+        // Read what the client sends until we have something to answer
+        if (conn->outSent == conn->outLength) {
+            if (!waitForDeadline(conn, POLLIN)) {
+                timedOut(conn);
+                break;
+            }
+            if (!reserveInput(conn)) {
+                continue;
+            }
+            charsRead = read(conn->fd, conn->in + conn->inLength, READ_CHUNK);
+            if (charsRead < 0 && errno == EINTR) {
+                continue;
+            } else if (charsRead <= 0) {
+                conn->peerClosed = 1;
+                continue;
+            }
+            if (conn->state != STATE_CLOSE) {
+                conn->inLength += charsRead;
+                handleInput(conn, config);
+                updateDeadline(conn, config);
+            }
+        }
+
+        // Send everything queued
+        while (conn->outSent < conn->outLength) {
+            if (!waitForDeadline(conn, POLLOUT)) {
+                timedOut(conn);
+                freeConnection(conn);
+                return;
+            }
+            charsWritten = write(conn->fd, conn->out + conn->outSent, conn->outLength - conn->outSent);
+            if (charsWritten < 0 && errno == EINTR) {
+                continue;
+            } else if (charsWritten < 0) {
+                fprintf(stderr, "%s: ERROR writing to socket\n", config->name);
+                freeConnection(conn);
+                return;
+            }
+            conn->outSent += charsWritten;
+            conn->progress++;
+            updateDeadline(conn, config);
+        }
+        noteSent(conn);
+    }
+    freeConnection(conn);
+}
+
+// Serves a single connection with blocking reads and writes, used by the
+// forked children. The buffers go back to the system once it is done, the
+// child has no other connection to lend them to
+static void serveConnection(int file_descriptor, struct daemonConfig *config) {
+    serveBlocking(file_descriptor, config);
+    drainBuffers();
+    drainConnections();
+}
+
+// Serves connections from listenSocketFD forever using the fork engine, each
+// in a child of its own
+void runForkLoop(int listenSocketFD, struct daemonConfig *config) {
+    int establishedConnectionFD;
+    pid_t spawnPid;
+
+    // Finished children are reaped as soon as they exit
+    reapChildren();
+
+    while(1) {
+        // Accept a connection, blocking until one connects and a child is free
+        // to serve it
+        establishedConnectionFD = acceptForChild(listenSocketFD, config);
+
+        // Spawn a new process
+        spawnPid = fork();
+        switch (spawnPid) {
+
+            // Fail to spawn a new process
+            case -1:
+                fprintf(stderr, "%s: ERROR fork failed\n", config->name);
+                close(establishedConnectionFD);
+                break;
+
+            // Child process
+            case 0:
+                close(listenSocketFD);
+                closeWaiting(config);
+                serveConnection(establishedConnectionFD, config);
+                exit(0);
+                break;
+
+            // Parent process
+            default:
+                childStarted();
+                close(establishedConnectionFD);
+                break;
+        }
+    }
+}
+
+// Whether the client has to take some of its results before we read more
+static int isBackedUp(struct connection *conn) {
+    return pendingOutput(conn) >= OUT_HIGH_WATER;
+}
+
+// Whether a new connection has to wait in queue before it is served
+static int mustWait(struct connectionQueue *waiting, struct daemonConfig *config) {
+    return waiting->length > 0 || (config->maxSessions > 0 && nSessions >= config->maxSessions);
+}
+
+// Puts a connection in the throttled queue while it waits for the budget, and
+// takes it out once it does not. Returns whether it is in
+static int throttleConnection(struct connectionQueue *throttled, struct connection *conn,
+                              struct daemonConfig *config) {
+    int waits = waitsForBudget(conn, config);
+
+    if (waits && conn->queue == NULL) {
+        enqueueConnection(throttled, conn);
+    } else if (!waits && conn->queue == throttled) {
+        dequeueConnection(conn);
+    }
+    return waits;
+}
+
+// Holds on to a connection until a session is free, or sheds it if the queue
+// is full already
+static void parkConnection(struct connectionQueue *waiting, struct timerWheel *wheel,
+                           struct connection *conn, struct daemonConfig *config) {
+    if (waiting->length >= config->backlog) {
+        countShed();
+        sendRefusal(conn->fd);
+        freeConnection(conn);
+        return;
+    }
+    enqueueConnection(waiting, conn);
+    conn->deadline = DEADLINE_QUEUE;
+    if (config->queueWait > 0) {
+        conn->deadlineAt = monotonicMilliseconds() + config->queueWait;
+        armTimer(wheel, &conn->timer, conn->deadlineAt);
+    }
+}
+
+// Takes the oldest connection out of the queue if a session is free for it
+static struct connection *nextAdmitted(struct connectionQueue *waiting, struct timerWheel *wheel,
+                                       struct daemonConfig *config) {
+    struct connection *conn = waiting->head;
+
+    if (conn == NULL || (config->maxSessions > 0 && nSessions >= config->maxSessions)) {
+        return NULL;
+    }
+    dequeueConnection(conn);
+    cancelTimer(wheel, &conn->timer);
+    conn->admitted = 1;
+    nSessions++;
+    return conn;
+}
+
+// Sheds a connection that waited too long in queue
+static void shedWaiting(struct connection *conn) {
+    countShed();
+    sendRefusal(conn->fd);
+    freeConnection(conn);
+}
+
+// Registers the events we are interested in for this connection
+static void updateEvents(struct eventLoop *loop, struct connection *conn, struct daemonConfig *config) {
+    struct epoll_event event;
+    int throttled = throttleConnection(&loop->throttled, conn, config);
+
+    memset(&event, 0, sizeof(event));
+    event.events = (conn->peerClosed || isBackedUp(conn) || throttled ? 0 : EPOLLIN) |
+                   (conn->outSent < conn->outLength ? EPOLLOUT : 0);
+    if (event.events == conn->events) {
+        return;
+    }
+    event.data.ptr = conn;
+    epoll_ctl(loop->epollFD, EPOLL_CTL_MOD, conn->fd, &event);
+    conn->events = event.events;
+}
+
+// Releases a connection and everything it owns
+static void closeConnection(struct eventLoop *loop, struct connection *conn) {
+    epoll_ctl(loop->epollFD, EPOLL_CTL_DEL, conn->fd, NULL);
+    cancelTimer(&loop->wheel, &conn->timer);
+    freeConnection(conn);
+}
+
+// Moves the timer of a connection in the wheel when its deadline changes
+static void scheduleDeadline(struct timerWheel *wheel, struct connection *conn, struct daemonConfig *config) {
+    if (!updateDeadline(conn, config)) {
+        return;
+    }
+    if (conn->deadlineAt == 0) {
+        cancelTimer(wheel, &conn->timer);
+    } else {
+        armTimer(wheel, &conn->timer, conn->deadlineAt);
+    }
+}
+
+// Returns the connection a timer belongs to
+static struct connection *timerConnection(struct timer *timer) {
+    return (struct connection*)((char*)timer - offsetof(struct connection, timer));
+}
+
+// Reads everything available on the socket. Returns 0 if the peer is gone
+// before we have anything left to send it
+static int readConnection(struct connection *conn, struct daemonConfig *config) {
+    int charsRead;
+
+    while (!conn->peerClosed) {
+
+        // Leave the rest in the socket until the client takes its results,
+        // or until the process is back under budget
+        if (isBackedUp(conn) || waitsForBudget(conn, config)) {
+            return 1;
+        }
+        if (!reserveInput(conn)) {
+            return 0;
+        }
+        charsRead = read(conn->fd, conn->in + conn->inLength, READ_CHUNK);
+        if (charsRead < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        } else if (charsRead == 0) {
+            conn->peerClosed = 1;
+            break;
+        }
+
+        // Anything sent after the session is over is ignored
+        if (conn->state == STATE_CLOSE) {
+            continue;
+        }
+        conn->inLength += charsRead;
+        handleInput(conn, config);
+    }
+
+    // A client may shut down its side and still wait for its results
+    return conn->outSent < conn->outLength;
+}
+
+// Sends as much of the output queue as the socket accepts.
+// Returns 0 if the peer is gone
+static int writeConnection(struct connection *conn) {
+    int charsWritten;
+
+    while (conn->outSent < conn->outLength) {
+        charsWritten = send(conn->fd, conn->out + conn->outSent, conn->outLength - conn->outSent, MSG_NOSIGNAL);
+        if (charsWritten < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        conn->outSent += charsWritten;
+        conn->progress++;
+    }
+    return 1;
+}
+
+// Starts watching a connection that has been given a session
+static void admitConnection(struct eventLoop *loop, struct connection *conn, struct daemonConfig *config) {
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    conn->events = EPOLLIN;
+    event.data.ptr = conn;
+    if (epoll_ctl(loop->epollFD, EPOLL_CTL_ADD, conn->fd, &event) < 0) {
+        fprintf(stderr, "%s: ERROR cannot watch connection\n", config->name);
+        freeConnection(conn);
+        return;
+    }
+    scheduleDeadline(&loop->wheel, conn, config);
+}
+
+// Accepts every pending connection on the listening socket, or a single one
+// on the local socket, which is shared by every worker. The next worker woken
+// takes the next one
+static void acceptConnections(struct eventLoop *loop, int listenSocketFD, struct daemonConfig *config) {
+    struct connection *conn;
+    int establishedConnectionFD, local = listenSocketFD == localSocketFD;
+
+    do {
+        establishedConnectionFD = accept(listenSocketFD, NULL, NULL);
+        if (establishedConnectionFD < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                fprintf(stderr, "%s: ERROR on accept\n", config->name);
+            }
+            return;
+        }
+        setNonBlocking(establishedConnectionFD);
+        conn = newConnection(establishedConnectionFD);
+        if (conn == NULL) {
+            close(establishedConnectionFD);
+            continue;
+        }
+        if (local) {
+            offerRegion(conn);
+        }
+
+        if (mustWait(&loop->waiting, config)) {
+            parkConnection(&loop->waiting, &loop->wheel, conn, config);
+        } else {
+            conn->admitted = 1;
+            nSessions++;
+            admitConnection(loop, conn, config);
+        }
+    } while (!local);
+}
+
+// Sends what can be sent and decides what happens next to a connection
+static void progressConnection(struct eventLoop *loop, struct connection *conn, struct daemonConfig *config,
+                               int alive) {
+    if (alive) {
+        alive = writeConnection(conn);
+        noteSent(conn);
+    }
+
+    // A connection is done once it has nothing left to say
+    if (!alive || isFinished(conn)) {
+        closeConnection(loop, conn);
+        return;
+    }
+    accountConnection(conn);
+    updateEvents(loop, conn, config);
+    scheduleDeadline(&loop->wheel, conn, config);
+}
+
+// Serves connections from listenSocketFD forever using the epoll engine
+void runEventLoop(int listenSocketFD, struct daemonConfig *config) {
+    struct epoll_event event, events[MAX_EVENTS];
+    struct eventLoop loop;
+    struct connection *conn;
+    struct timer *timer;
+    int nEvents, i, alive;
+
+    // A client hanging up must not kill the whole daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    loop.epollFD = epoll_create1(0);
+    if (loop.epollFD < 0) {
+        fprintf(stderr, "%s: ERROR cannot create epoll instance\n", config->name);
+        exit(1);
+    }
+
+    setNonBlocking(listenSocketFD);
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL; // The listening socket is the only one without a connection
+    epoll_ctl(loop.epollFD, EPOLL_CTL_ADD, listenSocketFD, &event);
+
+    // The local socket is shared by every worker, only one of them is woken
+    // for each client
+    if (localSocketFD >= 0) {
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        event.data.ptr = &localSocketFD;
+        epoll_ctl(loop.epollFD, EPOLL_CTL_ADD, localSocketFD, &event);
+    }
+    initWheel(&loop.wheel);
+    memset(&loop.waiting, 0, sizeof(loop.waiting));
+    memset(&loop.throttled, 0, sizeof(loop.throttled));
+
+    while (1) {
+        // Sleep no further than the next tick of the wheel while any deadline
+        // is running
+        nEvents = epoll_wait(loop.epollFD, events, MAX_EVENTS, wheelTimeout(&loop.wheel));
+        if (nEvents < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "%s: ERROR epoll_wait failed\n", config->name);
+            exit(2);
+        }
+
+        for (i = 0; i < nEvents; i++) {
+            conn = events[i].data.ptr;
+            if (conn == NULL) {
+                acceptConnections(&loop, listenSocketFD, config);
+                continue;
+            }
+            if (events[i].data.ptr == &localSocketFD) {
+                acceptConnections(&loop, localSocketFD, config);
+                continue;
+            }
+
+            alive = 1;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                alive = readConnection(conn, config);
+            }
+
+            // A connection that is not reading would not see the error
+            if (events[i].events & EPOLLERR) {
+                alive = 0;
+            }
+            progressConnection(&loop, conn, config, alive);
+        }
+
+        // Close the connections whose deadline has passed, and shed the ones
+        // that waited too long for a session
+        while ((timer = nextExpiredTimer(&loop.wheel)) != NULL) {
+            conn = timerConnection(timer);
+            if (conn->deadline == DEADLINE_QUEUE) {
+                shedWaiting(conn);
+                continue;
+            }
+            timedOut(conn);
+            closeConnection(&loop, conn);
+        }
+
+        // Serve the waiting connections as sessions free up, and let the
+        // throttled ones read again once we are back under budget
+        while ((conn = nextAdmitted(&loop.waiting, &loop.wheel, config)) != NULL) {
+            admitConnection(&loop, conn, config);
+        }
+        while (loop.throttled.head != NULL && !waitsForBudget(loop.throttled.head, config)) {
+            updateEvents(&loop, loop.throttled.head, config);
+        }
+    }
+}
+
+// Submits an accept on a listening socket. The one on our own TCP socket is
+// multishot, and keeps producing a completion per new connection until the
+// kernel ends it. The local socket is shared by every worker, so each takes a
+// single connection at a time from it and the others get their turn
+static void armAccept(struct uringLoop *loop, enum uringRequest request) {
+    struct io_uring_sqe *sqe = uringGetSqe(&loop->ring);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    if (request == URING_ACCEPT) {
+        sqe->fd = loop->listenSocketFD;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    } else {
+        sqe->fd = localSocketFD;
+    }
+    sqe->user_data = request;
+}
+
+// Submits a multishot receive on a connection. The kernel picks a provided
+// buffer for each piece of data as it arrives
+static void armReceive(struct uringLoop *loop, struct connection *conn) {
+    struct io_uring_sqe *sqe = uringGetSqe(&loop->ring);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = (uintptr_t)conn | URING_RECV;
+    conn->receiving = 1;
+    conn->uringOps++;
+}
+
+// Asks the kernel to end the receive of a connection
+static void cancelReceive(struct uringLoop *loop, struct connection *conn) {
+    struct io_uring_sqe *sqe = uringGetSqe(&loop->ring);
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t)conn | URING_RECV;
+    sqe->user_data = URING_CANCEL;
+    conn->stopReceiving = 1;
+}
+
+// Submits a send of the output not sent yet. The kernel may read the data
+// until the send completes, so the queue is handed over as a whole and new
+// results go into the other buffer meanwhile
+static void startSend(struct uringLoop *loop, struct connection *conn) {
+    struct io_uring_sqe *sqe;
+    char *buffer;
+    int capacity;
+
+    if (conn->sendingSent == conn->sendingLength) {
+        buffer = conn->sending;
+        capacity = conn->sendingCapacity;
+        conn->sending = conn->out;
+        conn->sendingCapacity = conn->outCapacity;
+        conn->sendingLength = conn->outLength;
+        conn->sendingSent = conn->outSent;
+        conn->out = buffer;
+        conn->outCapacity = capacity;
+        conn->outLength = 0;
+        conn->outSent = 0;
+    }
+
+    sqe = uringGetSqe(&loop->ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)(conn->sending + conn->sendingSent);
+    sqe->len = conn->sendingLength - conn->sendingSent;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)conn | URING_SEND;
+    conn->uringOps++;
+}
+
+// Submits a timeout request that completes at the next tick of the wheel, so
+// the loop wakes up for it while any deadline is running
+static void armTimeout(struct uringLoop *loop) {
+    int milliseconds = wheelTimeout(&loop->wheel);
+    struct io_uring_sqe *sqe;
+
+    if (loop->timeoutArmed || milliseconds < 0) {
+        return;
+    }
+    loop->timeout.tv_sec = milliseconds / 1000;
+    loop->timeout.tv_nsec = (milliseconds % 1000) * 1000000LL;
+
+    sqe = uringGetSqe(&loop->ring);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&loop->timeout;
+    sqe->len = 1;
+    sqe->user_data = URING_TIMEOUT;
+    loop->timeoutArmed = 1;
+}
+
+// Decides what happens next to a connection once its completions are handled
+static void progressUring(struct uringLoop *loop, struct connection *conn, struct daemonConfig *config) {
+    int sendInFlight = conn->uringOps > conn->receiving;
+
+    noteSent(conn);
+    accountConnection(conn);
+    if (!conn->closing && !conn->broken && !sendInFlight && pendingOutput(conn) > 0) {
+        startSend(loop, conn);
+        sendInFlight = 1;
+    }
+
+    // A connection is done once it has nothing left to say. It is freed when
+    // the kernel is done with it too
+    if (!conn->closing && (conn->broken || (isFinished(conn) && !sendInFlight))) {
+        conn->closing = 1;
+    }
+    if (conn->closing) {
+        cancelTimer(&loop->wheel, &conn->timer);
+        if (conn->queue != NULL) {
+            dequeueConnection(conn);
+        }
+        if (conn->receiving && !conn->stopReceiving) {
+            cancelReceive(loop, conn);
+        } else if (conn->uringOps == 0) {
+            freeConnection(conn);
+        }
+        return;
+    }
+
+    // Leave the rest in the socket until the client takes its results, or
+    // until the process is back under budget
+    if (isBackedUp(conn) || throttleConnection(&loop->throttled, conn, config)) {
+        if (conn->receiving && !conn->stopReceiving) {
+            cancelReceive(loop, conn);
+        }
+    } else if (!conn->receiving && !conn->peerClosed) {
+        armReceive(loop, conn);
+    }
+    scheduleDeadline(&loop->wheel, conn, config);
+}
+
+// Handles the completion of a receive
+static void receiveCompleted(struct uringLoop *loop, struct connection *conn, struct daemonConfig *config,
+                             int result, unsigned flags) {
+    unsigned bufferId;
+
+    if (result > 0) {
+        bufferId = flags >> IORING_CQE_BUFFER_SHIFT;
+
+        // Anything sent after the session is over is ignored
+        if (conn->state != STATE_CLOSE && reserveInput(conn)) {
+            memcpy(conn->in + conn->inLength, uringBuffer(&loop->buffers, bufferId), result);
+            conn->inLength += result;
+            handleInput(conn, config);
+        }
+        uringRecycleBuffer(&loop->buffers, bufferId);
+    } else if (result == 0 || (result != -ENOBUFS && result != -ECANCELED)) {
+        conn->peerClosed = 1;
+    }
+
+    // The receive has ended, because the client closed its side, we cancelled
+    // it or the buffers ran out. It is armed again if we still want data
+    if (!(flags & IORING_CQE_F_MORE)) {
+        conn->receiving = 0;
+        conn->stopReceiving = 0;
+        conn->uringOps--;
+    }
+}
+
+// Handles the completion of a send
+static void sendCompleted(struct connection *conn, int result) {
+    if (result < 0) {
+        conn->broken = 1;
+    } else {
+        conn->sendingSent += result;
+        conn->progress++;
+    }
+    conn->uringOps--;
+}
+
+// Serves connections from listenSocketFD forever using the uring engine. Falls
+// back on the epoll engine if the kernel cannot run it
+void runUringLoop(int listenSocketFD, struct daemonConfig *config) {
+    struct uringLoop loop;
+    struct io_uring_cqe *cqe;
+    struct connection *conn;
+    struct timer *timer;
+    uint64_t userData;
+    unsigned flags;
+    int result;
+
+    if (uringSetup(&loop.ring, URING_ENTRIES) < 0) {
+        fprintf(stderr, "%s: io_uring is not available, using epoll\n", config->name);
+        runEventLoop(listenSocketFD, config);
+    }
+    if (uringProvideBuffers(&loop.ring, &loop.buffers, URING_BUFFERS, READ_CHUNK, URING_BUFFER_GROUP) < 0) {
+        fprintf(stderr, "%s: io_uring buffer rings are not available, using epoll\n", config->name);
+        uringClose(&loop.ring);
+        runEventLoop(listenSocketFD, config);
+    }
+
+    // A client hanging up must not kill the whole daemon
+    signal(SIGPIPE, SIG_IGN);
+    loop.listenSocketFD = listenSocketFD;
+    initWheel(&loop.wheel);
+    loop.timeoutArmed = 0;
+    memset(&loop.waiting, 0, sizeof(loop.waiting));
+    memset(&loop.throttled, 0, sizeof(loop.throttled));
+    armAccept(&loop, URING_ACCEPT);
+    if (localSocketFD >= 0) {
+        armAccept(&loop, URING_LOCAL_ACCEPT);
+    }
+
+    while (1) {
+        // Everything queued while handling the last batch of completions goes
+        // out in the same call that waits for the next one
+        result = uringSubmit(&loop.ring, 1);
+        if (result < 0 && result != -EBUSY && result != -EAGAIN) {
+            fprintf(stderr, "%s: ERROR io_uring_enter failed\n", config->name);
+            exit(2);
+        }
+
+        while ((cqe = uringPeek(&loop.ring)) != NULL) {
+            userData = cqe->user_data;
+            result = cqe->res;
+            flags = cqe->flags;
+            uringSeen(&loop.ring);
+
+            conn = (struct connection*)(uintptr_t)(userData & ~(uint64_t)URING_REQUEST_MASK);
+            switch (userData & URING_REQUEST_MASK) {
+                case URING_ACCEPT:
+                case URING_LOCAL_ACCEPT:
+                    if (result >= 0 && (conn = newConnection(result)) == NULL) {
+                        close(result);
+                    } else if (result >= 0) {
+                        if ((userData & URING_REQUEST_MASK) == URING_LOCAL_ACCEPT) {
+                            offerRegion(conn);
+                        }
+                        if (mustWait(&loop.waiting, config)) {
+                            parkConnection(&loop.waiting, &loop.wheel, conn, config);
+                        } else {
+                            conn->admitted = 1;
+                            nSessions++;
+                            progressUring(&loop, conn, config);
+                        }
+                    } else if (result != -EINTR && result != -EAGAIN) {
+                        fprintf(stderr, "%s: ERROR on accept\n", config->name);
+                    }
+                    if (!(flags & IORING_CQE_F_MORE)) {
+                        armAccept(&loop, userData & URING_REQUEST_MASK);
+                    }
+                    break;
+
+                case URING_RECV:
+                    receiveCompleted(&loop, conn, config, result, flags);
+                    progressUring(&loop, conn, config);
+                    break;
+
+                case URING_SEND:
+                    sendCompleted(conn, result);
+                    progressUring(&loop, conn, config);
+                    break;
+
+                case URING_TIMEOUT:
+                    loop.timeoutArmed = 0;
+                    break;
+
+                default:
+                    // The cancelled receive reports on its own
+                    break;
+            }
+        }
+
+        // Close the connections whose deadline has passed, and shed the ones
+        // that waited too long for a session. Shutting the socket down ends
+        // its receive, and any send stuck on a client that does not read, so
+        // the connection can be freed
+        while ((timer = nextExpiredTimer(&loop.wheel)) != NULL) {
+            conn = timerConnection(timer);
+            if (conn->deadline == DEADLINE_QUEUE) {
+                shedWaiting(conn);
+                continue;
+            }
+            timedOut(conn);
+            shutdown(conn->fd, SHUT_RDWR);
+            conn->broken = 1;
+            progressUring(&loop, conn, config);
+        }
+
+        // Serve the waiting connections as sessions free up, and let the
+        // throttled ones read again once we are back under budget
+        while ((conn = nextAdmitted(&loop.waiting, &loop.wheel, config)) != NULL) {
+            progressUring(&loop, conn, config);
+        }
+        while (loop.throttled.head != NULL && !waitsForBudget(loop.throttled.head, config)) {
+            progressUring(&loop, loop.throttled.head, config);
+        }
+        armTimeout(&loop);
+    }
+}
+
+// Starts worker number index and returns its pid
+static pid_t startWorker(struct daemonConfig *config, int index) {
+    cpu_set_t cpus;
+    int listenSocketFD, nCpus, share, i;
+    pid_t spawnPid = fork();
+
+    if (spawnPid != 0) {
+        return spawnPid;
+    }
+
+    // Workers go away with their supervisor
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() == 1) {
+        exit(0);
+    }
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    useMetricsSlot(index);
+
+    // Keep each worker on its own share of the CPUs while there are enough of
+    // them, where its shard threads run too
+    nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nCpus > 1 && config->workers <= nCpus) {
+        share = defaultThreads(config);
+        CPU_ZERO(&cpus);
+        for (i = 0; i < share; i++) {
+            CPU_SET(index * share + i, &cpus);
+        }
+        sched_setaffinity(0, sizeof(cpus), &cpus);
+    }
+
+    listenSocketFD = openListenSocket(config, 1);
+    if (config->engine == ENGINE_URING) {
+        runUringLoop(listenSocketFD, config);
+    }
+    runEventLoop(listenSocketFD, config);
+    exit(0);
+}
+
+// Stops every worker and the supervisor
+static void stopWorkers(int signo) {
+    int i;
+    for (i = 0; i < nWorkers; i++) {
+        if (workerPid[i] > 0) {
+            kill(workerPid[i], SIGTERM);
+        }
+    }
+    _exit(signo == SIGTERM ? 0 : 1);
+}
+
+// Starts config->workers processes, each running its own event loop on its
+// own SO_REUSEPORT socket, and restarts the ones that die. Never returns
+void runWorkers(struct daemonConfig *config) {
+    time_t *startTime;
+    pid_t childPid;
+    int i, childExitMethod, checkSocketFD;
+    struct sockaddr_in serverAddress;
+
+    // Bind the port once here, without SO_REUSEPORT, so a port already in use
+    // is reported right away instead of being shared with its owner
+    memset((char*)&serverAddress, '\0', sizeof(serverAddress));
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(config->portNumber);
+    serverAddress.sin_addr.s_addr = INADDR_ANY;
+    checkSocketFD = socket(AF_INET, SOCK_STREAM, 0);
+    if (checkSocketFD < 0) {
+        fprintf(stderr, "%s: ERROR opening socket\n", config->name);
+        exit(1);
+    }
+    if (bind(checkSocketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) {
+        fprintf(stderr, "%s: ERROR on binding\n", config->name);
+        exit(2);
+    }
+    close(checkSocketFD);
+
+    nWorkers = config->workers;
+    workerPid = calloc(nWorkers, sizeof(pid_t));
+    startTime = calloc(nWorkers, sizeof(time_t));
+    signal(SIGTERM, stopWorkers);
+    signal(SIGINT, stopWorkers);
+
+    for (i = 0; i < nWorkers; i++) {
+        workerPid[i] = startWorker(config, i);
+        startTime[i] = time(NULL);
+    }
+
+    while (1) {
+        childPid = waitpid(-1, &childExitMethod, 0);
+        if (childPid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "%s: ERROR waiting for workers\n", config->name);
+            exit(2);
+        }
+
+        for (i = 0; i < nWorkers && workerPid[i] != childPid; i++);
+        if (i == nWorkers) {
+            continue;
+        }
+
+        if (WIFSIGNALED(childExitMethod)) {
+            fprintf(stderr, "%s: worker %d terminated by signal %d, restarting\n",
+                    config->name, i, WTERMSIG(childExitMethod));
+        } else {
+            fprintf(stderr, "%s: worker %d exited with status %d, restarting\n",
+                    config->name, i, WEXITSTATUS(childExitMethod));
+        }
+
+        // Don't spin if a worker dies as soon as it starts
+        if (time(NULL) - startTime[i] < 1) {
+            sleep(1);
+        }
+        workerPid[i] = startWorker(config, i);
+        startTime[i] = time(NULL);
+    }
+}
@@ -0,0 +1,90 @@
+/*********************************************************************************
+ * Filename: otp_daemon.h
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Shared server engine for otp_enc_d, otp_dec_d and otpd. Each daemon describes
+ * itself with a daemonConfig (its name and the roles it serves, each a client it
+ * accepts and the transform that client gets) and the engine takes care of the
+ * connections.
+ *********************************************************************************/
+
+#ifndef OTP_DAEMON_H
+#define OTP_DAEMON_H
+
+#include <stddef.h>
+
+#define SIZE 128000
+#define ROLES_MAX 2
+
+// Engines available to serve connections
+enum engineType {
+    ENGINE_FORK,    // One forked child per connection
+    ENGINE_EPOLL,   // Single process, non-blocking epoll event loop
+    ENGINE_URING    // Single process, io_uring completion loop
+};
+
+// Transform applied by a daemon to an input using a key. Returns the offset of
+// the first invalid character in input or key, or size if they are valid
+typedef size_t (*transformFunction)(const char input[], const char key[], char output[], size_t size);
+
+// A kind of client a daemon serves. The client names it in its hello, and
+// keeps it for the whole connection
+struct daemonRole {
+    const char *clientName;         // Authentication expected from the client
+    transformFunction transform;    // encrypt() or decrypt()
+    int consumesKey;                // Whether vault key ranges may only be used once
+};
+
+// Everything the engine needs to know about a daemon
+struct daemonConfig {
+    const char *name;               // Daemon name used in error messages
+    struct daemonRole roles[ROLES_MAX];
+    int nRoles;
+    enum engineType engine;         // Selected with --engine
+    int portNumber;                 // Port to listen on
+    int workers;                    // Number of worker processes, 0 for none
+    int threads;                    // Threads sharing each large job, 0 for the default
+    const char *vaultDirectory;     // Key vault given with --vault, NULL for none
+    int headerTimeout;              // Milliseconds a client has to say hello, 0 for no limit
+    int bodyTimeout;                // Milliseconds a message or result may stall, 0 for no limit
+    int idleTimeout;                // Milliseconds a client may sit between jobs, 0 for no limit
+    int backlog;                    // Connections waiting to be served, in the kernel and in our queue
+    int maxSessions;                // Connections each process serves at once, 0 for no limit
+    long long maxInflight;          // Bytes of messages and results each process holds, 0 for no limit
+    int queueWait;                  // Milliseconds a connection may wait to be served, 0 for no limit
+    const char *metricsPath;        // Unix socket given with --metrics, NULL for none
+    const char *localPath;          // Unix socket given with --local, NULL for none
+};
+
+// Parses the command line into config, exits on bad usage
+void parseArguments(int argc, char *argv[], struct daemonConfig *config);
+
+// Creates the socket listening on config->portNumber, exits on failure.
+// With reusePort set, several processes can listen on the same port
+int openListenSocket(struct daemonConfig *config, int reusePort);
+
+// Creates the Unix socket local clients connect to if --local was given, exits
+// on failure. Workers and forked children inherit it
+void openLocalSocket(struct daemonConfig *config);
+
+// Maps a metrics slot for every process that serves connections and starts
+// serving them if --metrics was given, exits if it cannot
+void setupMetrics(struct daemonConfig *config);
+
+// Starts config->workers processes, each running its own event loop on its
+// own SO_REUSEPORT socket, and restarts the ones that die. Never returns
+void runWorkers(struct daemonConfig *config);
+
+// Serves connections from listenSocketFD forever using the fork engine, each
+// in a child of its own
+void runForkLoop(int listenSocketFD, struct daemonConfig *config);
+
+// Serves connections from listenSocketFD forever using the epoll engine
+void runEventLoop(int listenSocketFD, struct daemonConfig *config);
+
+// Serves connections from listenSocketFD forever using the uring engine. Falls
+// back on the epoll engine if the kernel cannot run it
+void runUringLoop(int listenSocketFD, struct daemonConfig *config);
+
+#endif
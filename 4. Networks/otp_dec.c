@@ -6,9 +6,39 @@
  * This program connects to otp_dec_d, and asks it to perform a one-time pad style
  * decryption. It sends a ciphertext and a key to the otp_dec_d server and receives
  * back a plaintext. It then outputs the plaintext to stdout or to an output file
- * if specified. Can be run in the background or foreground.
+ * if specified. Can be run in the background or foreground. Files too large
+ * to read in whole, or any file with --stream, are streamed through the daemon
+ * in chunks.
+ *
+ * A key given as vault:ID[:OFFSET] is taken from the key vault of the daemon,
+ * starting OFFSET characters in, and is not sent at all. With --store the key
+ * file is uploaded into the vault as ID instead.
+ *
+ * With --connections N a file is split into N segments streamed over N
+ * connections at once, and each result is written into place in the output
+ * file. The port may be a list, port[,port...], to spread the connections
+ * between several daemons. Output to a pipe goes over one connection.
+ *
+ * With --packed the messages are sent packed, three characters to 15 bits, when
+ * the daemon supports it (see otp_pack.h).
+ *
+ * Any port may be given as the path of a socket the daemon listens on with
+ * otp_dec_d --local PATH instead. Streamed files then run through memory shared
+ * with the daemon rather than being sent (see otp_local.h).
+ *
+ * Everything said to the daemon goes through libotp (see libotp.h), like any
+ * program embedding the client would, by way of otp_client.h. This only reads
+ * the arguments and the files of a single job.
+ *
+ * With --batch it runs every job in a list, one "ciphertext key [output]" per line
+ * ("-" reads the list from stdin), over a single connection. Jobs are sent
+ * back to back without waiting for each result, and every result goes to its
+ * output file or, in order, to stdout.
  * 
- * USAGE: otp_dec [ciphertext] [key] [port] [> output_file] [&]
+ * USAGE: otp_dec [ciphertext] [key] [port[,port...]] [--protocol 1|2] [--stream] [--connections N]
+ *               [--packed] [> output_file] [&]
+ *        otp_dec keyfile vault:ID [port] --store
+ *        otp_dec --batch [joblist] [port] [--packed]
  *********************************************************************************/
 
 #include <stdio.h>
@@ -19,9 +49,12 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <sys/time.h>
-#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <fcntl.h>
-#include <netdb.h>
+
+#include "otp_client.h"
 
 #define SIZE 128000
 
@@ -31,103 +64,43 @@ void error(const char *msg, int exitStatus) {
     exit(exitStatus);
 }
 
-// This function reads the contents of a file and puts it
-// into readBuffer. It returns the number of characters read
-int readFile(char* filename, char readBuffer[], int size) {
+// This function maps a file into memory and points contents at
+// it, so it is checked and sent without being copied. Only the first
+// SIZE characters are mapped, which is all we ever send. It returns
+// the number of characters before the trailing newline
+off_t mapFile(char* filename, const char **contents) {
+    struct stat fileInfo;
+    void *mapped;
+    off_t size;
+    char last;
     int file_descriptor = open(filename, O_RDONLY);
-    if (file_descriptor < 0) {
+    if (file_descriptor < 0 || fstat(file_descriptor, &fileInfo) < 0) {
         error("otp_dec: ERROR cannot open file", 1);
     }
-    memset(readBuffer, '\0', size);
-    return read(file_descriptor, readBuffer, size);
-}
-
-// This function sends a message to the server
-int sendFile(int file_descriptor, char sendBuffer[], int size) {
-
-    // Add newline '\n' to our message which is going to be our
-    // identifier for EOF.
-    char message[size+2];
-    memset(message, '\0', sizeof(message));
-    sprintf(message, "%s\n", sendBuffer);
-
-    // Sends the message
-    int charsWritten;
-    charsWritten = write(file_descriptor, message, size+1);
-    if (charsWritten < 0) {
-        error("otp_dec: ERROR writing to socket", 2);
-    }
-
-    // Verify that the data has actually left the system
-    int checkSend = -5; // Bytes remaining in send buffer
-    do {
-        // Check the send buffer for this socket
-        ioctl(file_descriptor, TIOCOUTQ, &checkSend);
-    } while (checkSend > 0); // Loop forever until send buffer for this socket is empty
 
-    // Check if we actually stopped the loop because of an error
-    if (checkSend < 0) {
-        error("otp_dec: ERROR writing to socket", 2);
+    // Remove trailing newline
+    size = fileInfo.st_size;
+    if (size > 0 && pread(file_descriptor, &last, 1, size - 1) == 1 && last == '\n') {
+        size--;
     }
 
-    // Return the number of characters sent
-    // Subtract 1 for newline
-    return charsWritten-1;
-}
-
-
-// This function receives a message from the server.
-// We're going to use a while loop and adds the message
-// incrementally into the buffer, to enable us to accept
-// very large files.
-int receiveFile(int file_descriptor, char completeMessage[], int size) {
-    int charsRead;
-    char readBuffer[10];
-    memset(completeMessage, '\0', size);
-
-    // Continues the loop as long as we haven't found the terminal
-    while (strstr(completeMessage, "\n") == NULL) {
-
-        // Clear the buffer and get the next chunk of message
-        memset(readBuffer, '\0', sizeof(readBuffer));
-        charsRead = read(file_descriptor, readBuffer, sizeof(readBuffer)-1);
-
-        // Add that chunk to our complete message
-        strcat(completeMessage, readBuffer);
-
-        if (charsRead < 0) { // Error
-            error("otp_dec: ERROR fail to read file", 2);
-        } else if (charsRead == 0) { // No more message
-            break; // Exit loop
+    *contents = "";
+    if (size > 0) {
+        mapped = mmap(NULL, size < SIZE ? size : SIZE, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+                      file_descriptor, 0);
+        if (mapped == MAP_FAILED) {
+            error("otp_dec: ERROR cannot open file", 1);
         }
+        *contents = mapped;
     }
-
-    // Find the terminal location and remove the newline
-    int terminalLocation = strstr(completeMessage, "\n") - completeMessage;
-    completeMessage[terminalLocation] = '\0';
-
-    return strlen(completeMessage);
-}
-
-// This function sends an authentication message to the server
-void sendAuthentication(int file_descriptor) {
-    sendFile(file_descriptor, "otp_dec", 7);
-}
-
-// This function receives confirmation messages from the server
-void receiveConfirmation(int file_descriptor) {
-    // Message is '!' for OK and '?' for ERROR
-    char confirmation[10];
-    receiveFile(file_descriptor, confirmation, 10);
-    if (!strcmp(confirmation, "?")) {
-        exit(2);
-    }
+    close(file_descriptor);
+    return size;
 }
 
 // This function checks for bad input format
 // A good input is defined as having all
 // capital letters and spaces
-void checkBadInput(char input[], int size) {
+void checkBadInput(const char input[], int size) {
     int i;
     for (i = 0; i < size; i++) {
         if ((int)input[i] > 90 || ((int)input[i] < 65 && (int)input[i] != 32)) {
@@ -136,91 +109,122 @@ void checkBadInput(char input[], int size) {
     }
 }
 
+// Returns the size of a file, exits if it cannot be read
+off_t fileLength(char* filename) {
+    struct stat fileInfo;
+    if (stat(filename, &fileInfo) < 0) {
+        error("otp_dec: ERROR cannot open file", 1);
+    }
+    return fileInfo.st_size;
+}
+
 // Checks if the key size is larger than the file size
-void checkSameLength(int fileSize, int keySize) {
+void checkSameLength(off_t fileSize, off_t keySize) {
     if (fileSize > keySize) {
         error("otp_dec: ERROR key is too short", 1);
     }
 }
 
 int main(int argc, char *argv[]) {
-    int socketFD, portNumber, charsRead;
-    int fileSize, keySize;
-    char plaintext[SIZE];
-    char key[SIZE];
-    char ciphertext[SIZE];
-    struct sockaddr_in serverAddress;
-    struct hostent* serverHostInfo;
+    int charsRead, i;
+    off_t fileSize, keySize;
+    int protocol = 2;
+    int stream = 0;
+    int store = 0;
+    int batch = 0;
+    int connections = 1;
+    int packed = 0;
+    int failed;
+    FILE *jobList;
+    int vaultKey;
+    char *args[3];
+    int nArgs = 0;
+    const char *plaintext;
+    const char *key;
+    const char *ciphertext;
+    struct iovec output[2];
 
     // Check usage & args
-    if (argc < 4) {
-        fprintf(stderr, "USAGE: %s port\n", argv[0]);
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--protocol") && i + 1 < argc) {
+            protocol = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--stream")) {
+            stream = 1;
+        } else if (!strcmp(argv[i], "--store")) {
+            store = 1;
+        } else if (!strcmp(argv[i], "--connections") && i + 1 < argc) {
+            connections = atoi(argv[++i]);
+            if (connections < 1 || connections > FANOUT_MAX) {
+                error("otp_dec: ERROR bad number of connections", 1);
+            }
+        } else if (!strcmp(argv[i], "--packed")) {
+            packed = 1;
+        } else if (!strcmp(argv[i], "--batch")) {
+            batch = 1;
+        } else if (nArgs < 3) {
+            args[nArgs++] = argv[i];
+        }
+    }
+    if (nArgs < (batch ? 2 : 3)) {
+        fprintf(stderr, "USAGE: %s ciphertext key port[,port...] [--protocol 1|2] [--stream]\n"
+                        "           [--connections N] [--packed]\n"
+                        "       %s keyfile vault:ID port --store\n"
+                        "       %s --batch joblist port [--packed]\n", argv[0], argv[0], argv[0]);
         exit(1);
     }
 
-    // Get input files
-    fileSize = readFile(argv[1], ciphertext, SIZE);
-    keySize = readFile(argv[2], key, SIZE);
-
-    // Remove trailing newline
-    ciphertext[fileSize] = '\0';
-    fileSize--;
-    key[keySize] = '\0';
-    keySize--;
-
-    // Check bad input
-    checkBadInput(ciphertext, fileSize);
-    checkBadInput(key, keySize);
-    checkSameLength(fileSize, keySize);
-
-    // Set up the server address struct
-    memset((char*)&serverAddress, '\0', sizeof(serverAddress));
-    portNumber = atoi(argv[3]);
-    serverAddress.sin_family = AF_INET;
-    serverAddress.sin_port = htons(portNumber);
-    serverHostInfo = gethostbyname("localhost");
-    if (serverHostInfo == NULL) {
-        error("otp_dec: ERROR no such host", 1);
+    // Run a whole list of jobs over one connection
+    if (batch) {
+        jobList = strcmp(args[0], "-") ? fopen(args[0], "r") : stdin;
+        if (jobList == NULL) {
+            error("otp_dec: ERROR cannot open file", 1);
+        }
+        failed = runBatch("otp_dec", args[1], protocol, packed, jobList, STDOUT_FILENO);
+        return failed > 0 ? 1 : 0;
     }
-    memcpy((char*)&serverAddress.sin_addr.s_addr, (char*)serverHostInfo->h_addr, serverHostInfo->h_length);
 
-    // Set up the socket
-    socketFD = socket(AF_INET, SOCK_STREAM, 0);
-    if (socketFD < 0) {
-        error("otp_dec: ERROR opening socket", 1);
+    // Upload a key into the daemon's vault
+    if (store) {
+        storeFile("otp_dec", args[2], protocol, args[0], args[1]);
+        return 0;
     }
 
-    // Connect to server
-    if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) {
-        error("otp_dec: ERROR connecting", 2);
+    // Files too large for our buffers are streamed through the daemon instead,
+    // and so is a file split between several connections
+    if (connections > 1 || stream || fileLength(args[0]) >= SIZE) {
+        streamFiles("otp_dec", args[2], connections, protocol, packed, args[0], args[1], STDOUT_FILENO);
+        return 0;
     }
 
-    // Send authentication
-    sendAuthentication(socketFD);
-    receiveConfirmation(socketFD);
-
-    // Send ciphertext and key
-    sendFile(socketFD, ciphertext, fileSize);
-    receiveConfirmation(socketFD);
-    sendFile(socketFD, key, keySize);
-    receiveConfirmation(socketFD);
+    // Map input file and check bad input
+    fileSize = mapFile(args[0], &ciphertext);
+    checkBadInput(ciphertext, fileSize);
 
-    // Receive plaintext
-    charsRead = receiveFile(socketFD, plaintext, SIZE);
+    // Same for the part of the key file we use, unless the key is in the
+    // daemon's vault
+    vaultKey = isVaultKey(args[1]);
+    if (!vaultKey) {
+        keySize = mapFile(args[1], &key);
+        checkSameLength(fileSize, keySize);
+        checkBadInput(key, fileSize);
+    }
 
-    // Close socket
-    close(socketFD);
+    // Send ciphertext and key, receive plaintext
+    charsRead = runJob("otp_dec", args[2], protocol, packed, ciphertext, fileSize, vaultKey ? NULL : key,
+                       vaultKey ? args[1] : NULL, &plaintext);
 
     // Check plaintext for bad format
     checkBadInput(plaintext, charsRead);
-    checkSameLength(charsRead, keySize);
-
-    // Add newline
-    plaintext[charsRead] = '\n';
-    charsRead++;
+    if (!vaultKey) {
+        checkSameLength(charsRead, keySize);
+    }
 
-    // Output plaintext
-    write(STDOUT_FILENO, plaintext, charsRead);
+    // Output plaintext and a newline straight from the buffer it came back in
+    output[0].iov_base = (char*)plaintext;
+    output[0].iov_len = charsRead;
+    output[1].iov_base = "\n";
+    output[1].iov_len = 1;
+    writev(STDOUT_FILENO, output, 2);
 
     return 0;
 }
\ No newline at end of file
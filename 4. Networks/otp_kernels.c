@@ -0,0 +1,317 @@
+/*********************************************************************************
+ * Filename: otp_kernels.c
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Scalar, SSE4.1, AVX2 and AVX-512 versions of encrypt and decrypt (see
+ * otp_kernels.h). The vector kernels all use the same steps on every byte:
+ *
+ *     value  = max(c - 64, 0)          space (32) becomes 0, 'A' becomes 1
+ *     sum    = min(a + b, a + b - 27)  unsigned, so the min picks a + b - 27
+ *                                      only when it did not wrap around
+ *     diff   = min(a - b, a - b + 27)  likewise for decryption
+ *     c      = value + 64 - (value == 0 ? 32 : 0)
+ *
+ * Each one is compiled for its own instruction set with a target attribute, so
+ * the rest of the program still runs on any x86-64 CPU. Encryption and
+ * decryption share one body per instruction set, which takes the direction as
+ * a parameter and is always inlined with a constant for it, so each kernel is
+ * still its own loop with no test of the direction inside. Before transforming a
+ * block, a kernel builds a mask of its valid characters in the input and the
+ * key and returns the offset of the first clear bit if there is one.
+ *********************************************************************************/
+
+#include <immintrin.h>
+
+#include "otp_kernels.h"
+
+// Which way a kernel body transforms
+enum kernelDirection {
+    KERNEL_ENCRYPT,
+    KERNEL_DECRYPT
+};
+
+// Whether c can appear in a message
+static inline int isValid(char c) {
+    return c == ' ' || (c >= 'A' && c <= 'Z');
+}
+
+// Turns a character into its value, 0 for a space and 1 to 26 for 'A' to 'Z'
+static inline int toValue(char c) {
+    int value = c - 64;
+    return value < 0 ? 0 : value;
+}
+
+// Turns a value back into a character
+static inline char toChar(int value) {
+    return value == 0 ? ' ' : (char)(value + 64);
+}
+
+// Body of the scalar kernels. direction is always a constant, so with the
+// body inlined each kernel keeps only its own arithmetic
+static inline __attribute__((always_inline))
+size_t transformScalar(const char input[], const char key[], char output[], size_t size,
+                       enum kernelDirection direction) {
+    size_t i;
+    int value;
+    for (i = 0; i < size; i++) {
+        if (!isValid(input[i]) || !isValid(key[i])) {
+            return i;
+        }
+        if (direction == KERNEL_ENCRYPT) {
+            value = toValue(input[i]) + toValue(key[i]);
+            value -= value >= 27 ? 27 : 0;
+        } else {
+            value = toValue(input[i]) - toValue(key[i]);
+            value += value < 0 ? 27 : 0;
+        }
+        output[i] = toChar(value);
+    }
+    return size;
+}
+
+static size_t encryptScalar(const char input[], const char key[], char output[], size_t size) {
+    return transformScalar(input, key, output, size, KERNEL_ENCRYPT);
+}
+
+static size_t decryptScalar(const char input[], const char key[], char output[], size_t size) {
+    return transformScalar(input, key, output, size, KERNEL_DECRYPT);
+}
+
+// SSE4.1, 16 characters at a time
+
+// Sets the bytes of chars that are a capital letter or a space. c - 'A' taken
+// unsigned is at most 25 for capital letters only
+__attribute__((target("sse4.1")))
+static inline __m128i validSSE41(__m128i chars) {
+    __m128i letter = _mm_sub_epi8(chars, _mm_set1_epi8('A'));
+    letter = _mm_cmpeq_epi8(_mm_max_epu8(letter, _mm_set1_epi8(25)), _mm_set1_epi8(25));
+    return _mm_or_si128(letter, _mm_cmpeq_epi8(chars, _mm_set1_epi8(' ')));
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i valueSSE41(__m128i chars) {
+    return _mm_max_epi8(_mm_sub_epi8(chars, _mm_set1_epi8(64)), _mm_setzero_si128());
+}
+
+// Adds or subtracts the values of b from a mod 27
+__attribute__((target("sse4.1"), always_inline))
+static inline __m128i combineSSE41(__m128i a, __m128i b, enum kernelDirection direction) {
+    const __m128i modulus = _mm_set1_epi8(27);
+    __m128i value;
+    if (direction == KERNEL_ENCRYPT) {
+        value = _mm_add_epi8(a, b);
+        return _mm_min_epu8(value, _mm_sub_epi8(value, modulus));
+    }
+    value = _mm_sub_epi8(a, b);
+    return _mm_min_epu8(value, _mm_add_epi8(value, modulus));
+}
+
+__attribute__((target("sse4.1")))
+static inline void storeSSE41(char *c, __m128i value) {
+    __m128i isSpace = _mm_cmpeq_epi8(value, _mm_setzero_si128());
+    __m128i chars = _mm_add_epi8(value, _mm_set1_epi8(64));
+    chars = _mm_sub_epi8(chars, _mm_and_si128(isSpace, _mm_set1_epi8(32)));
+    _mm_storeu_si128((__m128i*)c, chars);
+}
+
+__attribute__((target("sse4.1"), always_inline))
+static inline size_t transformSSE41(const char input[], const char key[], char output[], size_t size,
+                                    enum kernelDirection direction) {
+    __m128i a, b;
+    unsigned valid;
+    size_t i;
+    for (i = 0; i + 16 <= size; i += 16) {
+        a = _mm_loadu_si128((const __m128i*)(input + i));
+        b = _mm_loadu_si128((const __m128i*)(key + i));
+        valid = _mm_movemask_epi8(_mm_and_si128(validSSE41(a), validSSE41(b)));
+        if (valid != 0xFFFF) {
+            return i + __builtin_ctz(~valid);
+        }
+        storeSSE41(output + i, combineSSE41(valueSSE41(a), valueSSE41(b), direction));
+    }
+    return i + transformScalar(input + i, key + i, output + i, size - i, direction);
+}
+
+__attribute__((target("sse4.1")))
+static size_t encryptSSE41(const char input[], const char key[], char output[], size_t size) {
+    return transformSSE41(input, key, output, size, KERNEL_ENCRYPT);
+}
+
+__attribute__((target("sse4.1")))
+static size_t decryptSSE41(const char input[], const char key[], char output[], size_t size) {
+    return transformSSE41(input, key, output, size, KERNEL_DECRYPT);
+}
+
+// AVX2, 32 characters at a time
+
+__attribute__((target("avx2")))
+static inline __m256i validAVX2(__m256i chars) {
+    __m256i letter = _mm256_sub_epi8(chars, _mm256_set1_epi8('A'));
+    letter = _mm256_cmpeq_epi8(_mm256_max_epu8(letter, _mm256_set1_epi8(25)), _mm256_set1_epi8(25));
+    return _mm256_or_si256(letter, _mm256_cmpeq_epi8(chars, _mm256_set1_epi8(' ')));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i valueAVX2(__m256i chars) {
+    return _mm256_max_epi8(_mm256_sub_epi8(chars, _mm256_set1_epi8(64)), _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline __m256i combineAVX2(__m256i a, __m256i b, enum kernelDirection direction) {
+    const __m256i modulus = _mm256_set1_epi8(27);
+    __m256i value;
+    if (direction == KERNEL_ENCRYPT) {
+        value = _mm256_add_epi8(a, b);
+        return _mm256_min_epu8(value, _mm256_sub_epi8(value, modulus));
+    }
+    value = _mm256_sub_epi8(a, b);
+    return _mm256_min_epu8(value, _mm256_add_epi8(value, modulus));
+}
+
+__attribute__((target("avx2")))
+static inline void storeAVX2(char *c, __m256i value) {
+    __m256i isSpace = _mm256_cmpeq_epi8(value, _mm256_setzero_si256());
+    __m256i chars = _mm256_add_epi8(value, _mm256_set1_epi8(64));
+    chars = _mm256_sub_epi8(chars, _mm256_and_si256(isSpace, _mm256_set1_epi8(32)));
+    _mm256_storeu_si256((__m256i*)c, chars);
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline size_t transformAVX2(const char input[], const char key[], char output[], size_t size,
+                                   enum kernelDirection direction) {
+    __m256i a, b;
+    unsigned valid;
+    size_t i;
+    for (i = 0; i + 32 <= size; i += 32) {
+        a = _mm256_loadu_si256((const __m256i*)(input + i));
+        b = _mm256_loadu_si256((const __m256i*)(key + i));
+        valid = _mm256_movemask_epi8(_mm256_and_si256(validAVX2(a), validAVX2(b)));
+        if (valid != 0xFFFFFFFF) {
+            return i + __builtin_ctz(~valid);
+        }
+        storeAVX2(output + i, combineAVX2(valueAVX2(a), valueAVX2(b), direction));
+    }
+    return i + transformScalar(input + i, key + i, output + i, size - i, direction);
+}
+
+__attribute__((target("avx2")))
+static size_t encryptAVX2(const char input[], const char key[], char output[], size_t size) {
+    return transformAVX2(input, key, output, size, KERNEL_ENCRYPT);
+}
+
+__attribute__((target("avx2")))
+static size_t decryptAVX2(const char input[], const char key[], char output[], size_t size) {
+    return transformAVX2(input, key, output, size, KERNEL_DECRYPT);
+}
+
+// AVX-512BW, 64 characters at a time. The last block is loaded and stored
+// through a mask instead of falling back to the scalar loop
+
+__attribute__((target("avx512bw")))
+static inline __mmask64 maskAVX512(size_t remaining) {
+    return remaining >= 64 ? ~(__mmask64)0 : ((__mmask64)1 << remaining) - 1;
+}
+
+__attribute__((target("avx512bw")))
+static inline __mmask64 validAVX512(__m512i chars) {
+    __m512i letter = _mm512_sub_epi8(chars, _mm512_set1_epi8('A'));
+    return _mm512_cmple_epu8_mask(letter, _mm512_set1_epi8(25)) |
+           _mm512_cmpeq_epi8_mask(chars, _mm512_set1_epi8(' '));
+}
+
+__attribute__((target("avx512bw")))
+static inline __m512i valueAVX512(__m512i chars) {
+    return _mm512_max_epi8(_mm512_sub_epi8(chars, _mm512_set1_epi8(64)), _mm512_setzero_si512());
+}
+
+__attribute__((target("avx512bw"), always_inline))
+static inline __m512i combineAVX512(__m512i a, __m512i b, enum kernelDirection direction) {
+    const __m512i modulus = _mm512_set1_epi8(27);
+    __m512i value;
+    if (direction == KERNEL_ENCRYPT) {
+        value = _mm512_add_epi8(a, b);
+        return _mm512_min_epu8(value, _mm512_sub_epi8(value, modulus));
+    }
+    value = _mm512_sub_epi8(a, b);
+    return _mm512_min_epu8(value, _mm512_add_epi8(value, modulus));
+}
+
+__attribute__((target("avx512bw")))
+static inline void storeAVX512(char *c, __mmask64 mask, __m512i value) {
+    __mmask64 isSpace = _mm512_cmpeq_epi8_mask(value, _mm512_setzero_si512());
+    __m512i chars = _mm512_add_epi8(value, _mm512_set1_epi8(64));
+    chars = _mm512_mask_sub_epi8(chars, isSpace, chars, _mm512_set1_epi8(32));
+    _mm512_mask_storeu_epi8(c, mask, chars);
+}
+
+__attribute__((target("avx512bw"), always_inline))
+static inline size_t transformAVX512(const char input[], const char key[], char output[], size_t size,
+                                     enum kernelDirection direction) {
+    __m512i a, b;
+    __mmask64 mask, invalid;
+    size_t i;
+    for (i = 0; i < size; i += 64) {
+        mask = maskAVX512(size - i);
+        a = _mm512_maskz_loadu_epi8(mask, input + i);
+        b = _mm512_maskz_loadu_epi8(mask, key + i);
+        invalid = ~(validAVX512(a) & validAVX512(b)) & mask;
+        if (invalid) {
+            return i + __builtin_ctzll(invalid);
+        }
+        storeAVX512(output + i, mask, combineAVX512(valueAVX512(a), valueAVX512(b), direction));
+    }
+    return size;
+}
+
+__attribute__((target("avx512bw")))
+static size_t encryptAVX512(const char input[], const char key[], char output[], size_t size) {
+    return transformAVX512(input, key, output, size, KERNEL_ENCRYPT);
+}
+
+__attribute__((target("avx512bw")))
+static size_t decryptAVX512(const char input[], const char key[], char output[], size_t size) {
+    return transformAVX512(input, key, output, size, KERNEL_DECRYPT);
+}
+
+// __builtin_cpu_supports() only takes string literals, hence one function each
+static int hasAVX512(void) {
+    return __builtin_cpu_supports("avx512bw");
+}
+
+static int hasAVX2(void) {
+    return __builtin_cpu_supports("avx2");
+}
+
+static int hasSSE41(void) {
+    return __builtin_cpu_supports("sse4.1");
+}
+
+const struct otpKernel otpKernels[] = {
+    {"avx512", hasAVX512, encryptAVX512, decryptAVX512},
+    {"avx2", hasAVX2, encryptAVX2, decryptAVX2},
+    {"sse4.1", hasSSE41, encryptSSE41, decryptSSE41},
+    {"scalar", NULL, encryptScalar, decryptScalar}
+};
+const int otpKernelCount = sizeof(otpKernels) / sizeof(otpKernels[0]);
+
+// Returns whether this CPU can run kernel
+int kernelSupported(const struct otpKernel *kernel) {
+    __builtin_cpu_init();
+    return kernel->isSupported == NULL || kernel->isSupported();
+}
+
+// Returns the fastest kernel this CPU supports. The choice is made on the first
+// call and kept from then on
+const struct otpKernel *selectKernel(void) {
+    static const struct otpKernel *selected = NULL;
+    int i;
+
+    if (selected == NULL) {
+        for (i = 0; !kernelSupported(&otpKernels[i]); i++) {
+            // The scalar kernel at the end is always supported
+        }
+        selected = &otpKernels[i];
+    }
+    return selected;
+}
@@ -0,0 +1,47 @@
+/*********************************************************************************
+ * Filename: otp_kernels.h
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Encryption and decryption kernels used by the daemons. Every kernel computes
+ * the same thing as the original one character at a time loop: a space counts
+ * as 0 and 'A' to 'Z' as 1 to 26, the key is added (or subtracted) mod 27, and
+ * 0 comes back out as a space. The vector kernels do the arithmetic without
+ * branches, 16, 32 or 64 characters at a time, and the best one the CPU supports
+ * is picked at run time.
+ *
+ * Validation is fused into the same pass: a kernel checks every character of
+ * the input and the key as it goes and stops at the first one that is not a
+ * capital letter or a space, so the data is only read once.
+ *********************************************************************************/
+
+#ifndef OTP_KERNELS_H
+#define OTP_KERNELS_H
+
+#include <stddef.h>
+
+// Transforms size characters of input using key into output. Returns the
+// offset of the first invalid character in input or key, or size if there is
+// none. When it returns early the output is only partly written
+typedef size_t (*kernelFunction)(const char input[], const char key[], char output[], size_t size);
+
+// One implementation of the transforms
+struct otpKernel {
+    const char *name;           // "avx512", "avx2", "sse4.1" or "scalar"
+    int (*isSupported)(void);   // Whether this CPU can run it, NULL for always
+    kernelFunction encrypt;
+    kernelFunction decrypt;
+};
+
+// Every kernel built in, fastest first. The last one is the scalar fallback
+extern const struct otpKernel otpKernels[];
+extern const int otpKernelCount;
+
+// Returns whether this CPU can run kernel
+int kernelSupported(const struct otpKernel *kernel);
+
+// Returns the fastest kernel this CPU supports. The choice is made on the first
+// call and kept from then on
+const struct otpKernel *selectKernel(void);
+
+#endif
@@ -0,0 +1,215 @@
+/*********************************************************************************
+ * Filename: otp_keypool.c
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * The pool file and its refill thread (see otp_keypool.h). The ring holds a
+ * whole number of chunks and the tail only ever moves a chunk at a time, so
+ * every chunk starts on a page of its own and is synced on its own.
+ *********************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "otp_keypool.h"
+#include "otp_random.h"
+
+// Rounds position up to a whole number of chunks
+static uint64_t roundChunk(uint64_t position) {
+    return (position + KEYPOOL_CHUNK - 1) / KEYPOOL_CHUNK * KEYPOOL_CHUNK;
+}
+
+// Writes the header page to disk
+static int syncHeader(struct keyPool *pool) {
+    return msync(pool->header, sysconf(_SC_PAGESIZE), MS_SYNC);
+}
+
+// Maps the pool file at path, creating it or starting it over if it does not
+// hold a ring of reserve characters, rounded up to whole chunks. Returns -1
+// on failure
+int openKeyPool(struct keyPool *pool, const char *path, uint64_t reserve) {
+    struct stat fileInfo;
+    size_t page = sysconf(_SC_PAGESIZE);
+    uint64_t capacity = roundChunk(reserve < 2 * KEYPOOL_CHUNK ? 2 * KEYPOOL_CHUNK : reserve);
+    uint64_t leaseEnd = 0, tail = 0;
+    void *mapped;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0 || fstat(fd, &fileInfo) < 0) {
+        return -1;
+    }
+
+    // Allocated in full, so filling the ring can never hit a full disk and
+    // fault. Not every file system can, and then we take our chances
+    if ((uint64_t)fileInfo.st_size != page + capacity &&
+            (ftruncate(fd, page + capacity) < 0 ||
+             (fallocate(fd, 0, 0, page + capacity) < 0 && errno != EOPNOTSUPP))) {
+        close(fd);
+        return -1;
+    }
+    mapped = mmap(NULL, page + capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return -1;
+    }
+    pool->header = mapped;
+    pool->data = (char*)mapped + page;
+    pool->capacity = capacity;
+
+    // Characters made before are only kept if the ring is the same size
+    if (pool->header->magic == KEYPOOL_MAGIC) {
+        leaseEnd = pool->header->leaseEnd;
+        if (pool->header->capacity == capacity) {
+            tail = pool->header->tail;
+        }
+    }
+    if (tail > leaseEnd) {
+        pool->head = leaseEnd;
+        pool->tail = tail;
+    } else {
+        pool->head = roundChunk(leaseEnd);
+        pool->tail = pool->head;
+    }
+    pool->released = pool->head;
+
+    pool->header->magic = KEYPOOL_MAGIC;
+    pool->header->capacity = capacity;
+    pool->header->tail = pool->tail;
+    pool->header->leaseEnd = pool->head;
+    if (syncHeader(pool) < 0) {
+        munmap(mapped, page + capacity);
+        return -1;
+    }
+
+    pool->notifyFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pool->failed = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    return pool->notifyFD < 0 ? -1 : 0;
+}
+
+// Stops the refill thread for good, and wakes the daemon to find out
+static void *refillFailed(struct keyPool *pool, const char *msg) {
+    uint64_t one = 1;
+
+    fprintf(stderr, "%s\n", msg);
+    __atomic_store_n(&pool->failed, 1, __ATOMIC_RELEASE);
+    if (write(pool->notifyFD, &one, sizeof(one)) < 0) {
+        // Only fails if the counter is full, and then it is readable already
+    }
+    return NULL;
+}
+
+// Body of the refill thread: makes a chunk whenever the ring has room for
+// one, syncs it and moves the tail past it
+static void *refillMain(void *argument) {
+    struct keyPool *pool = argument;
+    struct keyStream stream;
+    uint64_t tail = pool->tail, one = 1;
+    char *chunk;
+
+    if (seedKeyStream(&stream) < 0) {
+        return refillFailed(pool, "keypoold: ERROR no randomness available");
+    }
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (tail + KEYPOOL_CHUNK > pool->released + pool->capacity) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        chunk = pool->data + tail % pool->capacity;
+        fillKey(&stream, chunk, KEYPOOL_CHUNK);
+        if (msync(chunk, KEYPOOL_CHUNK, MS_SYNC) < 0) {
+            return refillFailed(pool, "keypoold: ERROR cannot sync the pool");
+        }
+        tail += KEYPOOL_CHUNK;
+        __atomic_store_n(&pool->header->tail, tail, __ATOMIC_RELAXED);
+        syncHeader(pool);
+
+        __atomic_store_n(&pool->tail, tail, __ATOMIC_RELEASE);
+        if (write(pool->notifyFD, &one, sizeof(one)) < 0) {
+            // Only fails if the counter is full, and then it is readable already
+        }
+    }
+    return NULL;
+}
+
+// Starts the refill thread. Returns -1 on failure
+int startRefill(struct keyPool *pool) {
+    sigset_t allSignals, oldSignals;
+    pthread_t thread;
+    int started;
+
+    // Signals are left to the thread running the daemon
+    sigfillset(&allSignals);
+    pthread_sigmask(SIG_SETMASK, &allSignals, &oldSignals);
+    started = pthread_create(&thread, NULL, refillMain, pool) == 0;
+    pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+    if (!started) {
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// Characters ready to be issued
+uint64_t availableKey(struct keyPool *pool) {
+    return __atomic_load_n(&pool->tail, __ATOMIC_ACQUIRE) - pool->head;
+}
+
+// Issues the next size characters, no more than availableKey(), and sets
+// *start to the position of the first. Returns -1 if the lease could not be
+// saved, in which case nothing is issued
+int issueKey(struct keyPool *pool, uint64_t size, uint64_t *start) {
+    uint64_t leaseEnd = pool->head + size + KEYPOOL_LEASE;
+
+    if (pool->head + size > pool->header->leaseEnd) {
+        __atomic_store_n(&pool->header->leaseEnd, leaseEnd, __ATOMIC_RELAXED);
+        if (syncHeader(pool) < 0) {
+            return -1;
+        }
+    }
+    *start = pool->head;
+    pool->head += size;
+    return 0;
+}
+
+// Points iov at the characters from position start up to end, which the ring
+// may split in two. Returns the number of iovecs used
+int keyVector(struct keyPool *pool, uint64_t start, uint64_t end, struct iovec iov[2]) {
+    uint64_t offset = start % pool->capacity;
+    uint64_t first = end - start < pool->capacity - offset ? end - start : pool->capacity - offset;
+
+    iov[0].iov_base = pool->data + offset;
+    iov[0].iov_len = first;
+    if (first == end - start) {
+        return 1;
+    }
+    iov[1].iov_base = pool->data;
+    iov[1].iov_len = end - start - first;
+    return 2;
+}
+
+// Lets the refill thread reuse the places of every character before position
+// released, which must all have been sent
+void releaseKey(struct keyPool *pool, uint64_t released) {
+    pthread_mutex_lock(&pool->lock);
+    if (released > pool->released) {
+        pool->released = released;
+        pthread_cond_signal(&pool->wake);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,86 @@
+/*********************************************************************************
+ * Filename: otp_keypool.h
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Pool of key characters made ahead of time, kept by keypoold. The pool is a
+ * file mapped in full: a header page followed by a ring of capacity
+ * characters. A refill thread keeps the ring full from a key stream (see
+ * otp_random.h) a chunk at a time, and the daemon hands out characters from
+ * the other end.
+ *
+ * Characters are counted from the creation of the pool and never reused: a
+ * position names one character for good, and its place in the ring is the
+ * position mod capacity. Three positions matter:
+ *
+ *     head      next character to hand out. Everything before it was issued
+ *     released  everything before it has been sent, so its place in the ring
+ *               may be filled again
+ *     tail      end of the characters made
+ *
+ * Each character is issued once, even across a crash. The header records the
+ * tail only once the chunk before it is on disk, and a lease: the position
+ * the daemon may issue up to. The lease is written and synced ahead of the
+ * head, KEYPOOL_LEASE characters at a time, so issuing rarely waits for the
+ * disk. A restarted daemon starts issuing at the old lease, skipping whatever
+ * the last one may have handed out, and keeps the characters made past it.
+ *********************************************************************************/
+
+#ifndef OTP_KEYPOOL_H
+#define OTP_KEYPOOL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#define KEYPOOL_MAGIC 0x4F54504B        // "OTPK"
+#define KEYPOOL_CHUNK (1 << 20)         // Characters made and synced at a time
+#define KEYPOOL_LEASE (16 << 20)        // Characters issued per sync of the header
+
+// Start of the pool file, alone on its page
+struct keyPoolHeader {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t capacity;                  // Characters in the ring
+    uint64_t tail;                      // End of the characters on disk
+    uint64_t leaseEnd;                  // Nothing at or past it was ever issued
+};
+
+struct keyPool {
+    struct keyPoolHeader *header;
+    char *data;                         // The ring
+    uint64_t capacity;
+    uint64_t head;                      // Daemon thread only
+    uint64_t tail;                      // Set by the refill thread, read with an acquire load
+    uint64_t released;                  // Guarded by lock
+    int notifyFD;                       // eventfd the refill thread bumps after every chunk
+    int failed;                         // Set if the refill thread gave up
+    pthread_mutex_t lock;
+    pthread_cond_t wake;                // Signalled when released moves
+};
+
+// Maps the pool file at path, creating it or starting it over if it does not
+// hold a ring of reserve characters, rounded up to whole chunks. Returns -1
+// on failure
+int openKeyPool(struct keyPool *pool, const char *path, uint64_t reserve);
+
+// Starts the refill thread. Returns -1 on failure
+int startRefill(struct keyPool *pool);
+
+// Characters ready to be issued
+uint64_t availableKey(struct keyPool *pool);
+
+// Issues the next size characters, no more than availableKey(), and sets
+// *start to the position of the first. Returns -1 if the lease could not be
+// saved, in which case nothing is issued
+int issueKey(struct keyPool *pool, uint64_t size, uint64_t *start);
+
+// Points iov at the characters from position start up to end, which the ring
+// may split in two. Returns the number of iovecs used
+int keyVector(struct keyPool *pool, uint64_t start, uint64_t end, struct iovec iov[2]);
+
+// Lets the refill thread reuse the places of every character before position
+// released, which must all have been sent
+void releaseKey(struct keyPool *pool, uint64_t released);
+
+#endif
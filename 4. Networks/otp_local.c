@@ -0,0 +1,219 @@
+/*********************************************************************************
+ * Filename: otp_local.c
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Shared regions of the local transport and their rings (see otp_local.h).
+ *********************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "otp_local.h"
+#include "otp_protocol.h"
+
+// Offset of the data area, past the rings and on a page of its own
+static size_t dataOffset(void) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (sizeof(struct localRegion) + page - 1) / page * page;
+}
+
+// Creates a sealed memfd holding an empty region and maps it at *region.
+// Returns the memfd, or -1 on failure
+int createRegion(struct localRegion **region) {
+    size_t size = dataOffset() + LOCAL_DATA_SIZE;
+    int memfd = memfd_create("otp_local", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    if (memfd < 0) {
+        return -1;
+    }
+
+    // Sealed at its size, so the client cannot shrink it under our mapping
+    if (ftruncate(memfd, size) < 0 ||
+            fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        close(memfd);
+        return -1;
+    }
+    *region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (*region == MAP_FAILED) {
+        close(memfd);
+        return -1;
+    }
+
+    (*region)->magic = LOCAL_MAGIC;
+    (*region)->entries = LOCAL_RING_ENTRIES;
+    (*region)->dataOffset = dataOffset();
+    (*region)->dataSize = LOCAL_DATA_SIZE;
+    return memfd;
+}
+
+// Sends the REGION frame on a new connection, carrying memfd unless it is -1.
+// Never blocks. Returns 0 if it could not be sent
+int sendRegion(int socketFD, int memfd) {
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct frameHeader header;
+    struct msghdr message;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char encoded[OTP_HEADER_SIZE];
+
+    makeHeader(&header, OP_REGION, 0, 0);
+    encodeHeader(encoded, &header);
+    iov.iov_base = encoded;
+    iov.iov_len = OTP_HEADER_SIZE;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    if (memfd >= 0) {
+        message.msg_control = control.buffer;
+        message.msg_controllen = sizeof(control.buffer);
+        cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+    }
+
+    // The socket was just accepted, so its buffer has room for the frame
+    return sendmsg(socketFD, &message, MSG_DONTWAIT | MSG_NOSIGNAL) == OTP_HEADER_SIZE;
+}
+
+// Maps the region held by memfd, checking it has the geometry we expect.
+// Returns NULL if it does not look like one
+static struct localRegion *mapRegion(int memfd) {
+    struct localRegion *region;
+    struct stat memfdInfo;
+
+    size_t size = dataOffset() + LOCAL_DATA_SIZE;
+
+    if (fstat(memfd, &memfdInfo) < 0 || (size_t)memfdInfo.st_size != size) {
+        return NULL;
+    }
+    region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (region == MAP_FAILED) {
+        return NULL;
+    }
+    if (region->magic != LOCAL_MAGIC || region->entries != LOCAL_RING_ENTRIES ||
+            region->dataOffset != dataOffset() || region->dataSize != LOCAL_DATA_SIZE) {
+        munmap(region, size);
+        return NULL;
+    }
+    return region;
+}
+
+// Receives the REGION frame a daemon starts a local connection with, and maps
+// the region it carries at *region, or sets it to NULL if it carries none.
+// Returns 0 if the daemon sent anything else
+int receiveRegion(int socketFD, struct localRegion **region) {
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct frameHeader header;
+    struct msghdr message;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char encoded[OTP_HEADER_SIZE];
+    int memfd = -1;
+
+    iov.iov_base = encoded;
+    iov.iov_len = OTP_HEADER_SIZE;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+    if (recvmsg(socketFD, &message, MSG_WAITALL | MSG_CMSG_CLOEXEC) != OTP_HEADER_SIZE ||
+            !decodeHeader(encoded, &header) || header.op != OP_REGION || header.length != 0) {
+        return 0;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    *region = NULL;
+    if (memfd >= 0) {
+        *region = mapRegion(memfd);
+        close(memfd);
+    }
+    return 1;
+}
+
+// Unmaps a region mapped by createRegion() or receiveRegion()
+void unmapRegion(struct localRegion *region) {
+    munmap(region, dataOffset() + LOCAL_DATA_SIZE);
+}
+
+// Start of the data area
+char *regionData(struct localRegion *region) {
+    return (char*)region + dataOffset();
+}
+
+// Adds a request, from the client. Returns 0 if the ring is full
+int submitRequest(struct localRegion *region, const struct localRequest *request) {
+    uint32_t tail = region->requestTail.value;
+
+    if (tail - __atomic_load_n(&region->requestHead.value, __ATOMIC_ACQUIRE) == LOCAL_RING_ENTRIES) {
+        return 0;
+    }
+    region->requests[tail & (LOCAL_RING_ENTRIES - 1)] = *request;
+    __atomic_store_n(&region->requestTail.value, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Takes the next completion, from the client. Returns 0 if there is none
+int takeCompletion(struct localRegion *region, struct localCompletion *completion) {
+    uint32_t head = region->completionHead.value;
+
+    if (head == __atomic_load_n(&region->completionTail.value, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    *completion = region->completions[head & (LOCAL_RING_ENTRIES - 1)];
+    __atomic_store_n(&region->completionHead.value, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Takes the request at *head, from the daemon, and moves *head past it.
+// Returns 0 if there is none, -1 if the client broke the ring
+int takeRequest(struct localRegion *region, uint32_t *head, struct localRequest *request) {
+    uint32_t tail = __atomic_load_n(&region->requestTail.value, __ATOMIC_ACQUIRE);
+
+    if (tail == *head) {
+        return 0;
+    }
+    if (tail - *head > LOCAL_RING_ENTRIES) {
+        return -1;
+    }
+
+    // Copied out once, so the client cannot change it while it is checked
+    memcpy(request, &region->requests[*head & (LOCAL_RING_ENTRIES - 1)], sizeof(struct localRequest));
+    (*head)++;
+    __atomic_store_n(&region->requestHead.value, *head, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Adds a completion at *tail, from the daemon, and moves *tail past it.
+// Returns 0 if the ring is full
+int postCompletion(struct localRegion *region, uint32_t *tail, const struct localCompletion *completion) {
+    uint32_t head = __atomic_load_n(&region->completionHead.value, __ATOMIC_ACQUIRE);
+
+    if (*tail - head >= LOCAL_RING_ENTRIES) {
+        return 0;
+    }
+    region->completions[*tail & (LOCAL_RING_ENTRIES - 1)] = *completion;
+    (*tail)++;
+    __atomic_store_n(&region->completionTail.value, *tail, __ATOMIC_RELEASE);
+    return 1;
+}
@@ -0,0 +1,118 @@
+/*********************************************************************************
+ * Filename: otp_local.h
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Shared memory transport for clients on the same host as the daemon. A daemon
+ * started with --local PATH also listens on a Unix socket there, and offers
+ * every connection on it a region of shared memory: a sealed memfd, passed with
+ * SCM_RIGHTS in a REGION frame before anything else is said (see
+ * otp_protocol.h). A client that maps it and sets FLAG_SHARED on its HELLO can
+ * then run jobs through the region instead of sending them.
+ *
+ * The region starts with two rings of LOCAL_RING_ENTRIES, followed by a data
+ * area the client lays out as it likes. The client writes the input and key of
+ * a job into the data area, adds a request giving their offsets to the request
+ * ring and sends a RING frame. The daemon transforms every request it finds
+ * straight into the data area, usually over the input itself, adds a
+ * completion for each to the completion ring and answers with a RING frame of
+ * its own. The socket only ever carries those 16 byte frames, so the
+ * characters are never copied through the kernel.
+ *
+ * Each ring has a single producer and a single consumer, and its indices run
+ * freely, wrapping at 2^32. A producer writes an entry before it publishes the
+ * new tail with a release store, and a consumer reads the tail with an acquire
+ * load before it reads the entry. A client keeps no more than
+ * LOCAL_RING_ENTRIES requests outstanding, from submitting them to taking their
+ * completions, so the daemon always has room to post them. The daemon keeps
+ * its own copy of its indices and checks every request, so a client can only
+ * ever hurt its own jobs.
+ *********************************************************************************/
+
+#ifndef OTP_LOCAL_H
+#define OTP_LOCAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOCAL_MAGIC 0x4F545052          // "OTPR"
+#define LOCAL_RING_ENTRIES 64           // A power of two
+#define LOCAL_DATA_SIZE (8 << 20)       // Bytes of the data area
+
+// Outcome of a request
+enum localStatus {
+    LOCAL_DONE,         // Transformed, valid is its size
+    LOCAL_BAD_INPUT,    // valid is the offset of the first bad character
+    LOCAL_BAD_REQUEST   // Its offsets or size do not fit in the data area
+};
+
+// A job, as offsets into the data area. output may be input itself
+struct localRequest {
+    uint32_t tag;
+    uint32_t size;      // Characters
+    uint64_t input;
+    uint64_t key;
+    uint64_t output;
+};
+
+// The outcome of the request with the same tag
+struct localCompletion {
+    uint32_t tag;
+    uint32_t status;    // See enum localStatus
+    uint64_t valid;
+};
+
+// A ring index, alone on its cache line so the two sides do not fight over it
+struct localIndex {
+    uint32_t value;
+} __attribute__((aligned(64)));
+
+// Start of the region. The geometry is fixed, the daemon fills it in for the
+// client to check and never reads it back
+struct localRegion {
+    uint32_t magic;
+    uint32_t entries;                   // LOCAL_RING_ENTRIES
+    uint64_t dataOffset;                // Where the data area starts in the region
+    uint64_t dataSize;
+    struct localIndex requestHead;      // Next request the daemon takes
+    struct localIndex requestTail;      // Next request the client adds
+    struct localIndex completionHead;   // Next completion the client takes
+    struct localIndex completionTail;   // Next completion the daemon adds
+    struct localRequest requests[LOCAL_RING_ENTRIES];
+    struct localCompletion completions[LOCAL_RING_ENTRIES];
+};
+
+// Creates a sealed memfd holding an empty region and maps it at *region.
+// Returns the memfd, or -1 on failure
+int createRegion(struct localRegion **region);
+
+// Sends the REGION frame on a new connection, carrying memfd unless it is -1.
+// Never blocks. Returns 0 if it could not be sent
+int sendRegion(int socketFD, int memfd);
+
+// Receives the REGION frame a daemon starts a local connection with, and maps
+// the region it carries at *region, or sets it to NULL if it carries none.
+// Returns 0 if the daemon sent anything else
+int receiveRegion(int socketFD, struct localRegion **region);
+
+// Unmaps a region mapped by createRegion() or receiveRegion()
+void unmapRegion(struct localRegion *region);
+
+// Start of the data area
+char *regionData(struct localRegion *region);
+
+// Adds a request, from the client. Returns 0 if the ring is full
+int submitRequest(struct localRegion *region, const struct localRequest *request);
+
+// Takes the next completion, from the client. Returns 0 if there is none
+int takeCompletion(struct localRegion *region, struct localCompletion *completion);
+
+// Takes the request at *head, from the daemon, and moves *head past it.
+// Returns 0 if there is none, -1 if the client broke the ring
+int takeRequest(struct localRegion *region, uint32_t *head, struct localRequest *request);
+
+// Adds a completion at *tail, from the daemon, and moves *tail past it.
+// Returns 0 if the ring is full
+int postCompletion(struct localRegion *region, uint32_t *tail, const struct localCompletion *completion);
+
+#endif
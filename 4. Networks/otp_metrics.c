@@ -0,0 +1,302 @@
+/*********************************************************************************
+ * Filename: otp_metrics.c
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Shared metric slots of the daemons and the endpoint serving them (see
+ * otp_metrics.h). The endpoint thread only reads the slots, so a scrape never
+ * holds up a connection.
+ *********************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "otp_metrics.h"
+
+// Text built for one scrape
+struct metricsText {
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+// What the endpoint thread serves
+struct metricsEndpoint {
+    int listenSocketFD;
+    const char *daemonName;
+};
+
+static struct metrics privateMetrics;
+struct metrics *processMetrics = &privateMetrics;
+static struct metrics *slots = &privateMetrics;
+static int nSlots = 1;
+
+static const char *errorNames[ERROR_KINDS] = {"auth", "protocol", "short_key", "bad_input", "vault"};
+static const char *phaseNames[PHASES] = {"handshake", "receive", "transform", "send"};
+static const char *timeoutNames[TIMEOUT_KINDS] = {"header", "body", "idle"};
+
+// Maps count shared slots and makes the calling process record into the
+// first. Must be called before forking the processes that use them
+void mapMetrics(int count) {
+    struct metrics *mapped = mmap(NULL, count * sizeof(struct metrics), PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    // Keep recording privately if the mapping fails, only the endpoint misses out
+    if (mapped == MAP_FAILED) {
+        return;
+    }
+    slots = mapped;
+    nSlots = count;
+    processMetrics = &slots[0];
+}
+
+// Makes the calling process record into slot index, starting its gauges over
+void useMetricsSlot(int index) {
+    if (index < nSlots) {
+        processMetrics = &slots[index];
+    }
+
+    // Connections and buffers of a process that died before this one are gone
+    __atomic_store_n(&processMetrics->active, 0, __ATOMIC_RELAXED);
+    memset(processMetrics->buffersInUse, 0, sizeof(processMetrics->buffersInUse));
+    memset(processMetrics->buffersFree, 0, sizeof(processMetrics->buffersFree));
+    __atomic_store_n(&processMetrics->connectionsFree, 0, __ATOMIC_RELAXED);
+}
+
+// Appends formatted text to a scrape
+static void appendText(struct metricsText *text, const char *format, ...) {
+    va_list arguments;
+    int length;
+
+    while (1) {
+        va_start(arguments, format);
+        length = vsnprintf(text->data + text->length, text->capacity - text->length, format, arguments);
+        va_end(arguments);
+        if (length < 0) {
+            return;
+        }
+        if (text->length + length < text->capacity) {
+            text->length += length;
+            return;
+        }
+        text->capacity = 2 * text->capacity + length + 1;
+        text->data = realloc(text->data, text->capacity);
+    }
+}
+
+// Appends the HELP and TYPE lines of a metric
+static void appendHeader(struct metricsText *text, const char *name, const char *type, const char *help) {
+    appendText(text, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Upper bound in nanoseconds of the values in bucket index
+static uint64_t bucketLimit(int index) {
+    int shift;
+
+    if (index < (1 << HISTOGRAM_SUB_BITS)) {
+        return index + 1;
+    }
+    shift = (index >> HISTOGRAM_SUB_BITS) - 1;
+    return ((uint64_t)((index & ((1 << HISTOGRAM_SUB_BITS) - 1)) | (1 << HISTOGRAM_SUB_BITS)) + 1) << shift;
+}
+
+// Appends a histogram of one slot. Only the buckets holding something are
+// listed, each with everything at or below it
+static void appendHistogram(struct metricsText *text, const char *labels, const char *phase,
+                            struct histogram *histogram) {
+    uint64_t count, cumulative = 0;
+    int i;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        count = __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+        if (count == 0) {
+            continue;
+        }
+        cumulative += count;
+        appendText(text, "otp_phase_seconds_bucket{%s,phase=\"%s\",le=\"%.9f\"} %llu\n", labels, phase,
+                   bucketLimit(i) / 1e9, (unsigned long long)cumulative);
+    }
+    appendText(text, "otp_phase_seconds_bucket{%s,phase=\"%s\",le=\"+Inf\"} %llu\n", labels, phase,
+               (unsigned long long)cumulative);
+    appendText(text, "otp_phase_seconds_sum{%s,phase=\"%s\"} %.9f\n", labels, phase,
+               __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED) / 1e9);
+    appendText(text, "otp_phase_seconds_count{%s,phase=\"%s\"} %llu\n", labels, phase,
+               (unsigned long long)cumulative);
+}
+
+// Appends the counter found at offset in every slot
+static void appendCounters(struct metricsText *text, const char *name, char (*labels)[64], size_t offset,
+                           const char *extra) {
+    uint64_t *counter;
+    int slot;
+
+    for (slot = 0; slot < nSlots; slot++) {
+        counter = (uint64_t*)((char*)&slots[slot] + offset);
+        appendText(text, "%s{%s%s} %llu\n", name, labels[slot], extra,
+                   (unsigned long long)__atomic_load_n(counter, __ATOMIC_RELAXED));
+    }
+}
+
+// Builds the text of a scrape
+static void buildText(struct metricsText *text, const char *daemonName) {
+    char (*labels)[64] = malloc(nSlots * sizeof(*labels));
+    char extra[48];
+    const char *name;
+    int slot, i;
+
+    for (slot = 0; slot < nSlots; slot++) {
+        snprintf(labels[slot], sizeof(labels[slot]), "daemon=\"%s\",worker=\"%d\"", daemonName, slot);
+    }
+
+    name = "otp_connections_total";
+    appendHeader(text, name, "counter", "Connections accepted.");
+    appendCounters(text, name, labels, offsetof(struct metrics, connections), "");
+
+    name = "otp_connections_active";
+    appendHeader(text, name, "gauge", "Connections accepted and not closed yet.");
+    for (slot = 0; slot < nSlots; slot++) {
+        appendText(text, "%s{%s} %lld\n", name, labels[slot],
+                   (long long)__atomic_load_n(&slots[slot].active, __ATOMIC_RELAXED));
+    }
+
+    name = "otp_connections_free";
+    appendHeader(text, name, "gauge", "Connections closed and kept to serve another client.");
+    for (slot = 0; slot < nSlots; slot++) {
+        appendText(text, "%s{%s} %lld\n", name, labels[slot],
+                   (long long)__atomic_load_n(&slots[slot].connectionsFree, __ATOMIC_RELAXED));
+    }
+
+    name = "otp_jobs_total";
+    appendHeader(text, name, "counter", "Jobs transformed without error.");
+    appendCounters(text, name, labels, offsetof(struct metrics, jobs), "");
+
+    name = "otp_characters_total";
+    appendHeader(text, name, "counter", "Characters encrypted or decrypted.");
+    appendCounters(text, name, labels, offsetof(struct metrics, characters), "");
+
+    name = "otp_errors_total";
+    appendHeader(text, name, "counter", "Jobs and connections rejected, by reason.");
+    for (i = 0; i < ERROR_KINDS; i++) {
+        snprintf(extra, sizeof(extra), ",type=\"%s\"", errorNames[i]);
+        appendCounters(text, name, labels, offsetof(struct metrics, errors[i]), extra);
+    }
+
+    name = "otp_timeouts_total";
+    appendHeader(text, name, "counter", "Connections closed for missing a deadline.");
+    for (i = 0; i < TIMEOUT_KINDS; i++) {
+        snprintf(extra, sizeof(extra), ",deadline=\"%s\"", timeoutNames[i]);
+        appendCounters(text, name, labels, offsetof(struct metrics, timeouts[i]), extra);
+    }
+
+    name = "otp_shed_total";
+    appendHeader(text, name, "counter", "Connections turned away by admission control.");
+    appendCounters(text, name, labels, offsetof(struct metrics, shed), "");
+
+    name = "otp_buffers";
+    appendHeader(text, name, "gauge", "Connection buffers held by the process, by size and state.");
+    for (slot = 0; slot < nSlots; slot++) {
+        for (i = 0; i < BUFFER_CLASSES; i++) {
+            appendText(text, "%s{%s,size=\"%d\",state=\"in_use\"} %lld\n", name, labels[slot],
+                       1 << (BUFFER_MIN_SHIFT + i),
+                       (long long)__atomic_load_n(&slots[slot].buffersInUse[i], __ATOMIC_RELAXED));
+            appendText(text, "%s{%s,size=\"%d\",state=\"free\"} %lld\n", name, labels[slot],
+                       1 << (BUFFER_MIN_SHIFT + i),
+                       (long long)__atomic_load_n(&slots[slot].buffersFree[i], __ATOMIC_RELAXED));
+        }
+        appendText(text, "%s{%s,size=\"large\",state=\"in_use\"} %lld\n", name, labels[slot],
+                   (long long)__atomic_load_n(&slots[slot].buffersInUse[BUFFER_CLASSES], __ATOMIC_RELAXED));
+    }
+
+    appendHeader(text, "otp_phase_seconds", "histogram", "Latency of each phase of a job.");
+    for (slot = 0; slot < nSlots; slot++) {
+        for (i = 0; i < PHASES; i++) {
+            appendHistogram(text, labels[slot], phaseNames[i], &slots[slot].phases[i]);
+        }
+    }
+    free(labels);
+}
+
+// Body of the endpoint thread: answers every connection with a scrape
+static void *metricsMain(void *argument) {
+    struct metricsEndpoint *endpoint = argument;
+    struct metricsText text = {NULL, 0, 0};
+    size_t sent;
+    ssize_t written;
+    int clientFD;
+
+    while (1) {
+        clientFD = accept(endpoint->listenSocketFD, NULL, NULL);
+        if (clientFD < 0) {
+            continue;
+        }
+        text.length = 0;
+        buildText(&text, endpoint->daemonName);
+        for (sent = 0; sent < text.length; sent += written) {
+            written = send(clientFD, text.data + sent, text.length - sent, MSG_NOSIGNAL);
+            if (written < 0 && errno != EINTR) {
+                break;
+            }
+            written = written < 0 ? 0 : written;
+        }
+        close(clientFD);
+    }
+    return NULL;
+}
+
+// Starts a thread answering every connection to the Unix socket at path with
+// the metrics of every slot, labelled with daemonName. Returns -1 if the
+// socket cannot be set up
+int serveMetrics(const char *path, const char *daemonName) {
+    struct metricsEndpoint *endpoint;
+    struct sockaddr_un address;
+    sigset_t allSignals, oldSignals;
+    pthread_t thread;
+    int listenSocketFD, started;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    // A socket left behind by an earlier run is replaced
+    listenSocketFD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenSocketFD < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(listenSocketFD, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(listenSocketFD, 16) < 0) {
+        close(listenSocketFD);
+        return -1;
+    }
+
+    endpoint = malloc(sizeof(struct metricsEndpoint));
+    endpoint->listenSocketFD = listenSocketFD;
+    endpoint->daemonName = daemonName;
+
+    // Signals are left to the thread running the daemon
+    sigfillset(&allSignals);
+    pthread_sigmask(SIG_SETMASK, &allSignals, &oldSignals);
+    started = pthread_create(&thread, NULL, metricsMain, endpoint) == 0;
+    pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+    if (!started) {
+        close(listenSocketFD);
+        free(endpoint);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,132 @@
+/*********************************************************************************
+ * Filename: otp_metrics.h
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Live metrics of the daemons. Every process serving connections counts into
+ * its own slot of a shared mapping set up before anything is forked: each
+ * worker has one, and the forked children of the fork engine share the first.
+ * Recording is a relaxed atomic add, so it never takes a lock or a system call,
+ * and the supervisor or the main process reads every slot to serve them on a
+ * Unix socket in the Prometheus text format.
+ *
+ * Latencies go into histograms in the style of HdrHistogram: 8 buckets to each
+ * power of two of nanoseconds, so a value is known to within 12.5% whatever its
+ * size, and finding its bucket takes a couple of instructions.
+ *********************************************************************************/
+
+#ifndef OTP_METRICS_H
+#define OTP_METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "otp_buffers.h"
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+// Reasons a job or a connection is rejected
+enum errorKind {
+    ERROR_AUTH,         // The client is not the one the daemon serves
+    ERROR_PROTOCOL,     // Malformed or unexpected message
+    ERROR_SHORT_KEY,    // The key is shorter than the input
+    ERROR_BAD_INPUT,    // A character that is not a capital letter or a space
+    ERROR_VAULT,        // A vault key that cannot be used or stored
+    ERROR_KINDS
+};
+
+// Steps of a job whose latency is recorded
+enum phase {
+    PHASE_HANDSHAKE,    // From accept to the hello answered
+    PHASE_RECEIVE,      // From the first byte of a job to its key
+    PHASE_TRANSFORM,    // Encrypting or decrypting it
+    PHASE_SEND,         // From its result queued to the last byte sent
+    PHASES
+};
+
+// Deadlines whose misses are counted, in the order of the daemon's own
+enum timeoutKind {
+    TIMEOUT_HEADER,
+    TIMEOUT_BODY,
+    TIMEOUT_IDLE,
+    TIMEOUT_KINDS
+};
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;                       // Nanoseconds
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+// Everything one process records. Slots start on their own cache line, so
+// workers do not slow each other down
+struct metrics {
+    uint64_t connections;               // Accepted
+    int64_t active;                     // Accepted and not closed yet
+    uint64_t jobs;                      // Transformed without error
+    uint64_t characters;                // Transformed, streamed chunks included
+    uint64_t errors[ERROR_KINDS];
+    uint64_t timeouts[TIMEOUT_KINDS];
+    uint64_t shed;                      // Turned away by admission control
+    int64_t buffersInUse[BUFFER_CLASSES + 1];   // By class, the last for those too large for any
+    int64_t buffersFree[BUFFER_CLASSES];
+    int64_t connectionsFree;            // Closed and kept to serve another client
+    struct histogram phases[PHASES];
+} __attribute__((aligned(64)));
+
+// Slot the calling process records into. Points at a private slot until
+// mapMetrics() is called, so recording always works
+extern struct metrics *processMetrics;
+
+// Maps count shared slots and makes the calling process record into the
+// first. Must be called before forking the processes that use them
+void mapMetrics(int count);
+
+// Makes the calling process record into slot index, starting its gauges over
+void useMetricsSlot(int index);
+
+// Starts a thread answering every connection to the Unix socket at path with
+// the metrics of every slot, labelled with daemonName. Returns -1 if the
+// socket cannot be set up
+int serveMetrics(const char *path, const char *daemonName);
+
+// Current time in nanoseconds, on a clock that never goes back
+static inline uint64_t metricsClock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Adds value to a counter
+static inline void countMetric(uint64_t *counter, uint64_t value) {
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+// Adds value to a gauge, which may go down
+static inline void moveGauge(int64_t *gauge, int64_t value) {
+    __atomic_fetch_add(gauge, value, __ATOMIC_RELAXED);
+}
+
+// Index of the bucket holding value: values below 8 have one each, and every
+// power of two above is split in 8 by the bits after its leading one
+static inline int histogramBucket(uint64_t value) {
+    int shift;
+
+    if (value < (1 << HISTOGRAM_SUB_BITS)) {
+        return (int)value;
+    }
+    shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return ((shift + 1) << HISTOGRAM_SUB_BITS) + (int)((value >> shift) & ((1 << HISTOGRAM_SUB_BITS) - 1));
+}
+
+// Records a latency of nanoseconds in a phase
+static inline void recordLatency(enum phase phase, uint64_t nanoseconds) {
+    struct histogram *histogram = &processMetrics->phases[phase];
+
+    __atomic_fetch_add(&histogram->buckets[histogramBucket(nanoseconds)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum, nanoseconds, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+}
+
+#endif
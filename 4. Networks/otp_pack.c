@@ -0,0 +1,297 @@
+/*********************************************************************************
+ * Filename: otp_pack.c
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Packing and unpacking of messages (see otp_pack.h). The SSE4.1 versions take
+ * a block of 24 characters at a time through these steps, and the unpacker
+ * goes through them backwards:
+ *
+ *     value  = max(c - 64, 0)              as in otp_kernels.c
+ *     group  = 729 * a + (27 * b + c)      a gathered into 16 bit lanes, b and c
+ *                                          into byte pairs for maddubs
+ *     pairs  = group0 | group1 << 15       8 x 15 bits become 4 x 30 in 32 bit
+ *     quads  = pair0 | pair1 << 30         lanes, then 2 x 60 in 64 bit lanes,
+ *     block  = quad0 | quad1 << 60         and the last step is done in scalar
+ *
+ * Division by 729 and 27 is a multiply by a rounded up reciprocal, which is
+ * exact for every value a group can have.
+ *********************************************************************************/
+
+#include <stdint.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "otp_pack.h"
+
+#define GROUP_BITS 15
+#define SHORT_TWO 19683             // First value of a group of two characters
+#define SHORT_ONE 20412             // First value of a group of one character
+#define GROUP_LIMIT 20439           // No group goes this high
+
+// Whether c can appear in a message
+static inline int isValid(char c) {
+    return c == ' ' || (c >= 'A' && c <= 'Z');
+}
+
+// Turns a character into its value, 0 for a space and 1 to 26 for 'A' to 'Z'
+static inline int toValue(char c) {
+    int value = c - 64;
+    return value < 0 ? 0 : value;
+}
+
+// Turns a value back into a character
+static inline char toChar(int value) {
+    return value == 0 ? ' ' : (char)(value + 64);
+}
+
+// Number of groups in length packed bytes, which must not be odd past the
+// last whole block
+static size_t groupCount(size_t length) {
+    return length / PACK_BLOCK_BYTES * 8 + length % PACK_BLOCK_BYTES / 2;
+}
+
+// Number of bytes size characters take once packed
+size_t packedSize(size_t size) {
+    size_t groups = (size + 2) / 3;
+    return groups / 8 * PACK_BLOCK_BYTES + (groups % 8 * GROUP_BITS + 7) / 8;
+}
+
+// Packs one group at a time, ending with a short group if size is not a
+// multiple of 3
+static size_t packScalar(const char text[], char packed[], size_t size) {
+    uint32_t bits = 0;
+    int nBits = 0, value;
+    size_t i, j;
+
+    for (i = 0; i < size; i += 3) {
+        for (j = i; j < i + 3 && j < size; j++) {
+            if (!isValid(text[j])) {
+                return j;
+            }
+        }
+        if (i + 3 <= size) {
+            value = toValue(text[i]) * 729 + toValue(text[i + 1]) * 27 + toValue(text[i + 2]);
+        } else if (i + 2 == size) {
+            value = SHORT_TWO + toValue(text[i]) * 27 + toValue(text[i + 1]);
+        } else {
+            value = SHORT_ONE + toValue(text[i]);
+        }
+
+        bits |= (uint32_t)value << nBits;
+        nBits += GROUP_BITS;
+        while (nBits >= 8) {
+            *packed++ = (char)bits;
+            bits >>= 8;
+            nBits -= 8;
+        }
+    }
+    if (nBits > 0) {
+        *packed = (char)bits;
+    }
+    return size;
+}
+
+// Unpacks one group at a time. Returns 0 on a value no group can have
+static int unpackScalar(const char packed[], size_t length, char text[]) {
+    size_t groups = groupCount(length), g;
+    uint32_t bits = 0;
+    int nBits = 0, value;
+
+    for (g = 0; g < groups; g++) {
+        while (nBits < GROUP_BITS) {
+            bits |= (uint32_t)(unsigned char)*packed++ << nBits;
+            nBits += 8;
+        }
+        value = bits & ((1 << GROUP_BITS) - 1);
+        bits >>= GROUP_BITS;
+        nBits -= GROUP_BITS;
+
+        if (value < SHORT_TWO) {
+            *text++ = toChar(value / 729);
+            *text++ = toChar(value / 27 % 27);
+            *text++ = toChar(value % 27);
+        } else if (value >= GROUP_LIMIT || g != groups - 1) {
+            return 0;
+        } else if (value < SHORT_ONE) {
+            *text++ = toChar((value - SHORT_TWO) / 27);
+            *text++ = toChar((value - SHORT_TWO) % 27);
+        } else {
+            *text++ = toChar(value - SHORT_ONE);
+        }
+    }
+    return 1;
+}
+
+// SSE4.1, a block of 24 characters at a time
+
+// Sets the bytes of chars that are a capital letter or a space
+__attribute__((target("sse4.1")))
+static inline __m128i validSSE41(__m128i chars) {
+    __m128i letter = _mm_sub_epi8(chars, _mm_set1_epi8('A'));
+    letter = _mm_cmpeq_epi8(_mm_max_epu8(letter, _mm_set1_epi8(25)), _mm_set1_epi8(25));
+    return _mm_or_si128(letter, _mm_cmpeq_epi8(chars, _mm_set1_epi8(' ')));
+}
+
+// Packs a block of 24 characters into 15 bytes. Returns 0, leaving packed
+// alone, if one of them is not valid
+__attribute__((target("sse4.1")))
+static int packBlockSSE41(const char text[], char packed[]) {
+    const __m128i firstLow = _mm_setr_epi8(0, -1, 3, -1, 6, -1, 9, -1, 12, -1, 15, -1, -1, -1, -1, -1);
+    const __m128i firstHigh = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, -1, 5, -1);
+    const __m128i restLow = _mm_setr_epi8(1, 2, 4, 5, 7, 8, 10, 11, 13, 14, -1, -1, -1, -1, -1, -1);
+    const __m128i restHigh = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 1, 3, 4, 6, 7);
+    __m128i low, high, first, rest, groups, pairs, quads;
+    uint64_t quad0, quad1, block[2];
+
+    low = _mm_loadu_si128((const __m128i*)text);
+    high = _mm_loadl_epi64((const __m128i*)(text + 16));
+    if (_mm_movemask_epi8(validSSE41(low)) != 0xFFFF || (_mm_movemask_epi8(validSSE41(high)) & 0xFF) != 0xFF) {
+        return 0;
+    }
+    low = _mm_max_epi8(_mm_sub_epi8(low, _mm_set1_epi8(64)), _mm_setzero_si128());
+    high = _mm_max_epi8(_mm_sub_epi8(high, _mm_set1_epi8(64)), _mm_setzero_si128());
+
+    first = _mm_or_si128(_mm_shuffle_epi8(low, firstLow), _mm_shuffle_epi8(high, firstHigh));
+    rest = _mm_or_si128(_mm_shuffle_epi8(low, restLow), _mm_shuffle_epi8(high, restHigh));
+    groups = _mm_add_epi16(_mm_mullo_epi16(first, _mm_set1_epi16(729)),
+                           _mm_maddubs_epi16(rest, _mm_set1_epi16(0x011B)));
+
+    pairs = _mm_or_si128(_mm_and_si128(groups, _mm_set1_epi32(0x7FFF)),
+                         _mm_and_si128(_mm_srli_epi32(groups, 1), _mm_set1_epi32(0x3FFF8000)));
+    quads = _mm_or_si128(_mm_and_si128(pairs, _mm_set1_epi64x(0x3FFFFFFF)),
+                         _mm_and_si128(_mm_srli_epi64(pairs, 2), _mm_set1_epi64x(0x0FFFFFFFC0000000)));
+
+    quad0 = (uint64_t)_mm_cvtsi128_si64(quads);
+    quad1 = (uint64_t)_mm_extract_epi64(quads, 1);
+    // Bytes 0 to 7, then 7 to 14, so nothing past the block is written
+    block[0] = quad0 | quad1 << 60;
+    block[1] = quad1 << 4 | block[0] >> 56;
+    memcpy(packed, &block[0], 8);
+    memcpy(packed + 7, &block[1], 8);
+    return 1;
+}
+
+// Unpacks 15 bytes into a block of 24 characters. Returns 0, leaving text
+// alone, if the block holds a short group or a value no group can have
+__attribute__((target("sse4.1")))
+static int unpackBlockSSE41(const char packed[], char text[]) {
+    const __m128i lowDigits = _mm_setr_epi8(0, 8, -1, 1, 9, -1, 2, 10, -1, 3, 11, -1, 4, 12, -1, 5);
+    const __m128i lowLast = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+    const __m128i highDigits = _mm_setr_epi8(13, -1, 6, 14, -1, 7, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i highLast = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+    __m128i quads, pairs, groups, first, rest, second, third, digits, last, low, high;
+    uint64_t block[2];
+
+    // Bytes 0 to 7, then 7 to 14, so nothing past the block is read
+    memcpy(&block[0], packed, 8);
+    memcpy(&block[1], packed + 7, 8);
+    block[1] >>= 8;
+    quads = _mm_set_epi64x((long long)((block[0] >> 60 | block[1] << 4) & 0x0FFFFFFFFFFFFFFF),
+                           (long long)(block[0] & 0x0FFFFFFFFFFFFFFF));
+    pairs = _mm_or_si128(_mm_and_si128(quads, _mm_set1_epi64x(0x3FFFFFFF)),
+                         _mm_and_si128(_mm_slli_epi64(quads, 2), _mm_set1_epi64x(0x3FFFFFFF00000000)));
+    groups = _mm_or_si128(_mm_and_si128(pairs, _mm_set1_epi32(0x7FFF)),
+                          _mm_and_si128(_mm_slli_epi32(pairs, 1), _mm_set1_epi32(0x7FFF0000)));
+    if (_mm_movemask_epi8(_mm_cmpgt_epi16(groups, _mm_set1_epi16(SHORT_TWO - 1))) != 0) {
+        return 0;
+    }
+
+    // group / 729 = group * 46029 >> 25, rest / 27 = rest * 38837 >> 20
+    first = _mm_srli_epi16(_mm_mulhi_epu16(groups, _mm_set1_epi16((short)46029)), 9);
+    rest = _mm_sub_epi16(groups, _mm_mullo_epi16(first, _mm_set1_epi16(729)));
+    second = _mm_srli_epi16(_mm_mulhi_epu16(rest, _mm_set1_epi16((short)38837)), 4);
+    third = _mm_sub_epi16(rest, _mm_mullo_epi16(second, _mm_set1_epi16(27)));
+
+    // Put the three digits of each group back next to each other
+    digits = _mm_packus_epi16(first, second);
+    last = _mm_packus_epi16(third, third);
+    low = _mm_or_si128(_mm_shuffle_epi8(digits, lowDigits), _mm_shuffle_epi8(last, lowLast));
+    high = _mm_or_si128(_mm_shuffle_epi8(digits, highDigits), _mm_shuffle_epi8(last, highLast));
+
+    low = _mm_sub_epi8(_mm_add_epi8(low, _mm_set1_epi8(64)),
+                       _mm_and_si128(_mm_cmpeq_epi8(low, _mm_setzero_si128()), _mm_set1_epi8(32)));
+    high = _mm_sub_epi8(_mm_add_epi8(high, _mm_set1_epi8(64)),
+                        _mm_and_si128(_mm_cmpeq_epi8(high, _mm_setzero_si128()), _mm_set1_epi8(32)));
+    _mm_storeu_si128((__m128i*)text, low);
+    _mm_storel_epi64((__m128i*)(text + 16), high);
+    return 1;
+}
+
+// Whether the SSE4.1 blocks can be used, decided on the first call
+static int hasSSE41(void) {
+    static int supported = -1;
+
+    if (supported < 0) {
+        __builtin_cpu_init();
+        supported = __builtin_cpu_supports("sse4.1") != 0;
+    }
+    return supported;
+}
+
+// Packs size characters of text into packed, which must have room for
+// packedSize(size) bytes. Returns the offset of the first character that is
+// not a capital letter or a space, or size if there is none. When it returns
+// early packed is only partly written
+size_t packText(const char text[], char packed[], size_t size) {
+    size_t i = 0;
+
+    // A block with a bad character is left to the scalar packer to find it
+    if (hasSSE41()) {
+        while (i + PACK_BLOCK_CHARS <= size &&
+               packBlockSSE41(text + i, packed + i / PACK_BLOCK_CHARS * PACK_BLOCK_BYTES)) {
+            i += PACK_BLOCK_CHARS;
+        }
+    }
+    return i + packScalar(text + i, packed + i / PACK_BLOCK_CHARS * PACK_BLOCK_BYTES, size - i);
+}
+
+// Returns the number of characters held by length packed bytes, or -1 if
+// length cannot be the size of a packed message
+long long unpackedSize(const char packed[], size_t length) {
+    size_t groups = groupCount(length);
+    uint32_t bits = 0;
+    size_t bit, i;
+    int value;
+
+    if (length % PACK_BLOCK_BYTES % 2 != 0) {
+        return -1;
+    }
+    if (groups == 0) {
+        return 0;
+    }
+
+    // Only the last group can be short
+    bit = (groups - 1) * GROUP_BITS;
+    for (i = 0; i < 3 && bit / 8 + i < length; i++) {
+        bits |= (uint32_t)(unsigned char)packed[bit / 8 + i] << (8 * i);
+    }
+    value = (bits >> bit % 8) & ((1 << GROUP_BITS) - 1);
+    if (value < SHORT_TWO) {
+        return 3 * groups;
+    } else if (value < SHORT_ONE) {
+        return 3 * groups - 1;
+    } else if (value < GROUP_LIMIT) {
+        return 3 * groups - 2;
+    }
+    return -1;
+}
+
+// Unpacks length bytes of packed into text, which must have room for
+// unpackedSize() characters. Returns 0 if packed holds a value no group can
+// have, or a short group anywhere but at the end
+int unpackText(const char packed[], size_t length, char text[]) {
+    size_t blocks = length / PACK_BLOCK_BYTES, i = 0;
+
+    if (length % PACK_BLOCK_BYTES % 2 != 0) {
+        return 0;
+    }
+
+    // The block holding a short group is left to the scalar unpacker
+    if (hasSSE41()) {
+        while (i < blocks && unpackBlockSSE41(packed + i * PACK_BLOCK_BYTES, text + i * PACK_BLOCK_CHARS)) {
+            i++;
+        }
+    }
+    return unpackScalar(packed + i * PACK_BLOCK_BYTES, length - i * PACK_BLOCK_BYTES, text + i * PACK_BLOCK_CHARS);
+}
@@ -0,0 +1,48 @@
+/*********************************************************************************
+ * Filename: otp_pack.h
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Packed encoding of messages, used on the wire when both sides of a version 2
+ * session agree to it (see otp_protocol.h). A message only has 27 different
+ * characters, so three of them (27^3 = 19683 values) fit in 15 bits, and eight
+ * such groups, 24 characters, fit in 15 bytes instead of 24.
+ *
+ * Groups are laid out one after the other as a little-endian bit stream, the
+ * first character of a group being its most significant digit in base 27. A
+ * message whose length is not a multiple of 3 ends with a short group, written
+ * as 19683 + 27 * a + b for two characters, or 20412 + a for one, so the length
+ * of the message can be told from the packed bytes alone. The last byte is
+ * padded with zero bits.
+ *
+ * The packer and unpacker work on whole blocks of 24 characters with SSE4.1
+ * when the CPU has it, and fall back to one group at a time otherwise.
+ *********************************************************************************/
+
+#ifndef OTP_PACK_H
+#define OTP_PACK_H
+
+#include <stddef.h>
+
+#define PACK_BLOCK_CHARS 24     // Characters in a block of 8 groups
+#define PACK_BLOCK_BYTES 15     // Bytes the block takes once packed
+
+// Number of bytes size characters take once packed
+size_t packedSize(size_t size);
+
+// Packs size characters of text into packed, which must have room for
+// packedSize(size) bytes. Returns the offset of the first character that is
+// not a capital letter or a space, or size if there is none. When it returns
+// early packed is only partly written
+size_t packText(const char text[], char packed[], size_t size);
+
+// Returns the number of characters held by length packed bytes, or -1 if
+// length cannot be the size of a packed message
+long long unpackedSize(const char packed[], size_t length);
+
+// Unpacks length bytes of packed into text, which must have room for
+// unpackedSize() characters. Returns 0 if packed holds a value no group can
+// have, or a short group anywhere but at the end
+int unpackText(const char packed[], size_t length, char text[]);
+
+#endif
@@ -0,0 +1,57 @@
+/*********************************************************************************
+ * Filename: otp_protocol.c
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Encoding and decoding of the version 2 frame header (see otp_protocol.h).
+ *********************************************************************************/
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "otp_protocol.h"
+
+// Writes header into buffer in wire format
+void encodeHeader(char buffer[OTP_HEADER_SIZE], const struct frameHeader *header) {
+    uint32_t magic = htonl(header->magic);
+    uint16_t flags = htons(header->flags);
+    uint32_t tag = htonl(header->tag);
+    uint32_t length = htonl(header->length);
+
+    memcpy(buffer, &magic, 4);
+    buffer[4] = (char)header->version;
+    buffer[5] = (char)header->op;
+    memcpy(buffer + 6, &flags, 2);
+    memcpy(buffer + 8, &tag, 4);
+    memcpy(buffer + 12, &length, 4);
+}
+
+// Reads a header from buffer. Returns 0 if it does not start with the magic
+int decodeHeader(const char buffer[OTP_HEADER_SIZE], struct frameHeader *header) {
+    uint32_t magic, tag, length;
+    uint16_t flags;
+
+    memcpy(&magic, buffer, 4);
+    memcpy(&flags, buffer + 6, 2);
+    memcpy(&tag, buffer + 8, 4);
+    memcpy(&length, buffer + 12, 4);
+
+    header->magic = ntohl(magic);
+    header->version = (uint8_t)buffer[4];
+    header->op = (uint8_t)buffer[5];
+    header->flags = ntohs(flags);
+    header->tag = ntohl(tag);
+    header->length = ntohl(length);
+
+    return header->magic == OTP_MAGIC;
+}
+
+// Fills a header for a frame we send
+void makeHeader(struct frameHeader *header, int op, uint32_t tag, uint32_t length) {
+    header->magic = OTP_MAGIC;
+    header->version = OTP_VERSION;
+    header->op = (uint8_t)op;
+    header->flags = 0;
+    header->tag = tag;
+    header->length = length;
+}
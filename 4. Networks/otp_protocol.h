@@ -0,0 +1,111 @@
+/*********************************************************************************
+ * Filename: otp_protocol.h
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Wire protocol shared by the OTP clients and daemons.
+ *
+ * Version 1 is the original text protocol: every message is terminated by a
+ * newline and answered with "!" (OK) or "?" (ERROR).
+ *
+ * Version 2 sends frames made of a fixed 16 byte header followed by the payload:
+ *
+ *     magic   4 bytes  "OTP2"
+ *     version 1 byte   protocol version of the sender
+ *     op      1 byte   what the frame carries (see enum frameOp)
+ *     flags   2 bytes  see FLAG_MORE and FLAG_PACKED, otherwise 0
+ *     tag     4 bytes  job number chosen by the client, echoed in the reply
+ *     length  4 bytes  payload length
+ *
+ * All integers are in network byte order. A session starts with a HELLO frame
+ * from the client carrying its name and a newline ("otp_enc\n" or "otp_dec\n").
+ * The daemon answers with a HELLO frame whose version is the one both sides will
+ * use. The client then sends an INPUT and a KEY frame per job and gets a RESULT or
+ * an ERROR frame back with the same tag. Jobs can be pipelined: the client may
+ * send any number of them without waiting, and the daemon answers them in the
+ * order they were sent. A daemon that only speaks version 1 takes
+ * the HELLO frame for a wrong authentication line and answers "?", and the client
+ * starts over with version 1.
+ *
+ * A job of any size can also be streamed as a series of CHUNK frames sharing one
+ * tag. Each carries up to OTP_CHUNK_SIZE bytes of input followed by the same
+ * number of bytes of key, and every one but the last has FLAG_MORE set. The daemon
+ * answers each chunk with a RESULT frame as soon as it arrives, copying FLAG_MORE,
+ * so neither side ever holds more than a few chunks. If a chunk has a bad
+ * character the daemon sends an ERROR frame instead and drops the rest of the job.
+ *
+ * A daemon started with a key vault (see otp_vault.h) also takes:
+ *
+ *     STORE   the key id, a newline and part of the key. Every frame of the upload
+ *             but the last has FLAG_MORE set, and the last is answered with an
+ *             empty RESULT
+ *     KEYREF  sent instead of KEY: an 8 byte offset followed by the key id, so
+ *             the key comes from the vault rather than over the wire
+ *
+ * A client may set FLAG_PACKED on its HELLO to ask for the packed encoding of
+ * otp_pack.h, and the daemon sets it on its answer if it agrees. From then on
+ * the input, key and result of every INPUT, KEY, CHUNK and RESULT frame are
+ * packed, cutting their size by 37.5%. The two halves of a CHUNK are packed
+ * separately and have the same size. STORE, KEYREF and ERROR frames stay as
+ * they are, and offsets in error messages count characters, not bytes.
+ *
+ * On the Unix socket of a daemon started with --local, the daemon speaks first
+ * with a REGION frame, which carries the memfd of a shared region with
+ * SCM_RIGHTS, or nothing if it could not make one (see otp_local.h). A client
+ * that mapped the region may set FLAG_SHARED on its HELLO, and the daemon sets
+ * it on its answer if it agrees, packing then being off. The client may still
+ * send any frame, and may also send a RING frame at any point between jobs:
+ * the daemon serves every request submitted to the region before it and
+ * answers with a RING frame, in order with its other answers.
+ *********************************************************************************/
+
+#ifndef OTP_PROTOCOL_H
+#define OTP_PROTOCOL_H
+
+#include <stdint.h>
+
+#define OTP_MAGIC 0x4F545032    // "OTP2"
+#define OTP_VERSION 2           // Highest version we speak
+#define OTP_HEADER_SIZE 16
+#define OTP_CHUNK_SIZE 32768    // Most input carried by a CHUNK frame
+#define OTP_KEY_ID_MAX 64       // Longest id of a key in a vault
+
+// What a frame carries
+enum frameOp {
+    OP_HELLO = 1,   // Client name, or the daemon's answer
+    OP_INPUT = 2,   // Plaintext or ciphertext
+    OP_KEY = 3,     // Key for the input with the same tag
+    OP_RESULT = 4,  // Transformed input
+    OP_ERROR = 5,   // Reason the job or the session failed
+    OP_CHUNK = 6,   // Part of a streamed input, followed by its part of the key
+    OP_STORE = 7,   // Part of a key to keep in the daemon's vault
+    OP_KEYREF = 8,  // Offset and id of a key in the daemon's vault
+    OP_REGION = 9,  // Shared region offered on a local connection
+    OP_RING = 10    // Requests submitted to the region, or all of them served
+};
+
+// Frame flags
+#define FLAG_MORE 0x0001    // More CHUNK, RESULT or STORE frames of this job follow
+#define FLAG_PACKED 0x0002  // On HELLO: messages are packed (see otp_pack.h)
+#define FLAG_SHARED 0x0004  // On HELLO: jobs may run through the shared region
+
+// Decoded frame header
+struct frameHeader {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t op;
+    uint16_t flags;
+    uint32_t tag;
+    uint32_t length;
+};
+
+// Writes header into buffer in wire format
+void encodeHeader(char buffer[OTP_HEADER_SIZE], const struct frameHeader *header);
+
+// Reads a header from buffer. Returns 0 if it does not start with the magic
+int decodeHeader(const char buffer[OTP_HEADER_SIZE], struct frameHeader *header);
+
+// Fills a header for a frame we send
+void makeHeader(struct frameHeader *header, int op, uint32_t tag, uint32_t length);
+
+#endif
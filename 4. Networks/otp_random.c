@@ -0,0 +1,335 @@
+/*********************************************************************************
+ * Filename: otp_random.c
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * ChaCha20 and rejection sampling behind the key streams (see otp_random.h).
+ *
+ * The vector ciphers keep word i of eight or sixteen consecutive blocks in one
+ * register and store the registers as they are, so their output is the same
+ * keystream as the scalar one in a different order. That makes no difference
+ * to how random it is, and saves transposing the blocks back.
+ *
+ * Sampling reduces a byte mod 27 without dividing: subtracting 216, 108, 54
+ * and 27 in turn, each only if the byte is at least that much, leaves any byte
+ * below 243 in 0 to 26. The vector version does each step with an unsigned
+ * min, as the encryption kernels do, and packs the bytes it keeps eight at a
+ * time with a shuffle looked up from their mask.
+ *********************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <sys/random.h>
+#include <immintrin.h>
+
+#include "otp_random.h"
+
+#define SAMPLE_LIMIT 243        // Largest multiple of 27 a byte can hold
+
+// Character of each byte, for the ones below SAMPLE_LIMIT
+static char symbols[256];
+
+// Shuffle packing the bytes of an 8 byte group whose bits are set in the index
+static uint64_t packShuffles[256];
+
+// Turns a value into its character, 0 for a space and 1 to 26 for 'A' to 'Z'
+static inline char toChar(int value) {
+    return value == 0 ? ' ' : (char)(value + 64);
+}
+
+// Fills in the lookup tables before main() runs, so streams seeded on
+// several threads at once never race on them
+__attribute__((constructor))
+static void buildTables(void) {
+    int i, bit, count;
+
+    for (i = 0; i < 256; i++) {
+        symbols[i] = toChar(i % 27);
+        packShuffles[i] = 0;
+        for (bit = 0, count = 0; bit < 8; bit++) {
+            if (i & (1 << bit)) {
+                packShuffles[i] |= (uint64_t)bit << (8 * count++);
+            }
+        }
+    }
+}
+
+#define ROTATE(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTER(a, b, c, d) \
+    a += b; d ^= a; d = ROTATE(d, 16); \
+    c += d; b ^= c; b = ROTATE(b, 12); \
+    a += b; d ^= a; d = ROTATE(d, 8); \
+    c += d; b ^= c; b = ROTATE(b, 7);
+
+// Makes one 64 byte block and moves the counter past it
+static void chachaBlock(uint32_t state[16], unsigned char output[64]) {
+    uint32_t x[16];
+    int i;
+
+    memcpy(x, state, sizeof(x));
+    for (i = 0; i < 10; i++) {
+        QUARTER(x[0], x[4], x[8], x[12]);
+        QUARTER(x[1], x[5], x[9], x[13]);
+        QUARTER(x[2], x[6], x[10], x[14]);
+        QUARTER(x[3], x[7], x[11], x[15]);
+        QUARTER(x[0], x[5], x[10], x[15]);
+        QUARTER(x[1], x[6], x[11], x[12]);
+        QUARTER(x[2], x[7], x[8], x[13]);
+        QUARTER(x[3], x[4], x[9], x[14]);
+    }
+    for (i = 0; i < 16; i++) {
+        x[i] += state[i];
+    }
+    memcpy(output, x, sizeof(x));
+
+    if (++state[12] == 0) {
+        state[13]++;
+    }
+}
+
+// Makes KEY_STREAM_BATCH bytes, one block at a time
+static void chachaScalar(uint32_t state[16], unsigned char output[KEY_STREAM_BATCH]) {
+    int i;
+
+    for (i = 0; i < KEY_STREAM_BATCH; i += 64) {
+        chachaBlock(state, output + i);
+    }
+}
+
+// Keeps the bytes below SAMPLE_LIMIT as characters, in order. Writes at most
+// count bytes to chars and returns the number kept
+static size_t sampleScalar(const unsigned char bytes[], size_t count, char chars[]) {
+    size_t i, kept = 0;
+
+    // Every byte is written and only the good ones move on, so no branches
+    for (i = 0; i < count; i++) {
+        chars[kept] = symbols[bytes[i]];
+        kept += bytes[i] < SAMPLE_LIMIT;
+    }
+    return kept;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i rotateAVX2(__m256i v, int n) {
+    return _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - n));
+}
+
+#define QUARTER_AVX2(a, b, c, d) \
+    a = _mm256_add_epi32(a, b); d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rotate16); \
+    c = _mm256_add_epi32(c, d); b = rotateAVX2(_mm256_xor_si256(b, c), 12); \
+    a = _mm256_add_epi32(a, b); d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rotate8); \
+    c = _mm256_add_epi32(c, d); b = rotateAVX2(_mm256_xor_si256(b, c), 7);
+
+// Makes eight blocks at once, word i of all of them in x[i], and moves the
+// counter past them
+__attribute__((target("avx2")))
+static void chachaAVX2(uint32_t state[16], unsigned char output[KEY_STREAM_BATCH / 2]) {
+    const __m256i rotate16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                              2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rotate8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+                                             3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+    uint64_t counter = (uint64_t)state[13] << 32 | state[12];
+    uint32_t low[8], high[8];
+    __m256i s[16], x[16];
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        s[i] = _mm256_set1_epi32(state[i]);
+    }
+    for (i = 0; i < 8; i++) {
+        low[i] = (uint32_t)(counter + i);
+        high[i] = (uint32_t)((counter + i) >> 32);
+    }
+    s[12] = _mm256_loadu_si256((__m256i*)low);
+    s[13] = _mm256_loadu_si256((__m256i*)high);
+
+    memcpy(x, s, sizeof(x));
+    for (i = 0; i < 10; i++) {
+        QUARTER_AVX2(x[0], x[4], x[8], x[12]);
+        QUARTER_AVX2(x[1], x[5], x[9], x[13]);
+        QUARTER_AVX2(x[2], x[6], x[10], x[14]);
+        QUARTER_AVX2(x[3], x[7], x[11], x[15]);
+        QUARTER_AVX2(x[0], x[5], x[10], x[15]);
+        QUARTER_AVX2(x[1], x[6], x[11], x[12]);
+        QUARTER_AVX2(x[2], x[7], x[8], x[13]);
+        QUARTER_AVX2(x[3], x[4], x[9], x[14]);
+    }
+    for (i = 0; i < 16; i++) {
+        _mm256_storeu_si256((__m256i*)(output + 32 * i), _mm256_add_epi32(x[i], s[i]));
+    }
+
+    counter += 8;
+    state[12] = (uint32_t)counter;
+    state[13] = (uint32_t)(counter >> 32);
+}
+
+#define QUARTER_AVX512(a, b, c, d) \
+    a = _mm512_add_epi32(a, b); d = _mm512_rol_epi32(_mm512_xor_si512(d, a), 16); \
+    c = _mm512_add_epi32(c, d); b = _mm512_rol_epi32(_mm512_xor_si512(b, c), 12); \
+    a = _mm512_add_epi32(a, b); d = _mm512_rol_epi32(_mm512_xor_si512(d, a), 8); \
+    c = _mm512_add_epi32(c, d); b = _mm512_rol_epi32(_mm512_xor_si512(b, c), 7);
+
+// Same as chachaAVX2() with sixteen blocks, which AVX-512 rotates natively
+__attribute__((target("avx512f")))
+static void chachaAVX512(uint32_t state[16], unsigned char output[KEY_STREAM_BATCH]) {
+    uint64_t counter = (uint64_t)state[13] << 32 | state[12];
+    uint32_t low[16], high[16];
+    __m512i s[16], x[16];
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        s[i] = _mm512_set1_epi32(state[i]);
+    }
+    for (i = 0; i < 16; i++) {
+        low[i] = (uint32_t)(counter + i);
+        high[i] = (uint32_t)((counter + i) >> 32);
+    }
+    s[12] = _mm512_loadu_si512(low);
+    s[13] = _mm512_loadu_si512(high);
+
+    memcpy(x, s, sizeof(x));
+    for (i = 0; i < 10; i++) {
+        QUARTER_AVX512(x[0], x[4], x[8], x[12]);
+        QUARTER_AVX512(x[1], x[5], x[9], x[13]);
+        QUARTER_AVX512(x[2], x[6], x[10], x[14]);
+        QUARTER_AVX512(x[3], x[7], x[11], x[15]);
+        QUARTER_AVX512(x[0], x[5], x[10], x[15]);
+        QUARTER_AVX512(x[1], x[6], x[11], x[12]);
+        QUARTER_AVX512(x[2], x[7], x[8], x[13]);
+        QUARTER_AVX512(x[3], x[4], x[9], x[14]);
+    }
+    for (i = 0; i < 16; i++) {
+        _mm512_storeu_si512(output + 64 * i, _mm512_add_epi32(x[i], s[i]));
+    }
+
+    counter += 16;
+    state[12] = (uint32_t)counter;
+    state[13] = (uint32_t)(counter >> 32);
+}
+
+// Packs the bytes of an 8 byte group whose bits are set in mask to the front
+// and stores all 8. Returns the number kept
+__attribute__((target("avx2")))
+static inline int packAVX2(__m128i group, int mask, char *chars) {
+    __m128i shuffle = _mm_loadl_epi64((__m128i*)&packShuffles[mask]);
+
+    _mm_storel_epi64((__m128i*)chars, _mm_shuffle_epi8(group, shuffle));
+    return __builtin_popcount(mask);
+}
+
+// Same as sampleScalar() 32 bytes at a time, count being a multiple of 32.
+// Writes at most count + 8 bytes to chars
+__attribute__((target("avx2")))
+static size_t sampleAVX2(const unsigned char bytes[], size_t count, char chars[]) {
+    const __m256i limit = _mm256_set1_epi8((char)(SAMPLE_LIMIT - 1));
+    const __m256i space = _mm256_set1_epi8(32);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i x, value, c;
+    __m128i half;
+    uint32_t mask;
+    size_t i, kept = 0;
+
+    for (i = 0; i < count; i += 32) {
+        x = _mm256_loadu_si256((__m256i*)(bytes + i));
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(x, limit), x));
+
+        value = _mm256_min_epu8(x, _mm256_sub_epi8(x, _mm256_set1_epi8((char)216)));
+        value = _mm256_min_epu8(value, _mm256_sub_epi8(value, _mm256_set1_epi8(108)));
+        value = _mm256_min_epu8(value, _mm256_sub_epi8(value, _mm256_set1_epi8(54)));
+        value = _mm256_min_epu8(value, _mm256_sub_epi8(value, _mm256_set1_epi8(27)));
+        c = _mm256_add_epi8(value, _mm256_set1_epi8(64));
+        c = _mm256_sub_epi8(c, _mm256_and_si256(_mm256_cmpeq_epi8(value, zero), space));
+
+        half = _mm256_castsi256_si128(c);
+        kept += packAVX2(half, mask & 0xff, chars + kept);
+        kept += packAVX2(_mm_srli_si128(half, 8), (mask >> 8) & 0xff, chars + kept);
+        half = _mm256_extracti128_si256(c, 1);
+        kept += packAVX2(half, (mask >> 16) & 0xff, chars + kept);
+        kept += packAVX2(_mm_srli_si128(half, 8), mask >> 24, chars + kept);
+    }
+    return kept;
+}
+
+// Makes a batch of cipher output and samples it into chars, which must have
+// room for KEY_STREAM_BATCH + 8 bytes. Returns the number of characters made
+static size_t makeBatch(struct keyStream *stream, char chars[]) {
+    unsigned char bytes[KEY_STREAM_BATCH] __attribute__((aligned(64)));
+
+    switch (stream->level) {
+    case RANDOM_AVX512:
+        chachaAVX512(stream->state, bytes);
+        return sampleAVX2(bytes, KEY_STREAM_BATCH, chars);
+    case RANDOM_AVX2:
+        chachaAVX2(stream->state, bytes);
+        chachaAVX2(stream->state, bytes + KEY_STREAM_BATCH / 2);
+        return sampleAVX2(bytes, KEY_STREAM_BATCH, chars);
+    default:
+        chachaScalar(stream->state, bytes);
+        return sampleScalar(bytes, KEY_STREAM_BATCH, chars);
+    }
+}
+
+// Seeds a key stream from getrandom(). Returns -1 if the kernel has no
+// randomness to give
+int seedKeyStream(struct keyStream *stream) {
+    unsigned char seed[40];
+    size_t got = 0;
+    ssize_t read;
+
+    while (got < sizeof(seed)) {
+        read = getrandom(seed + got, sizeof(seed) - got, 0);
+        if (read < 0 && errno == EINTR) {
+            continue;
+        } else if (read < 0) {
+            return -1;
+        }
+        got += read;
+    }
+
+    // "expand 32-byte k", the 32 byte key, the counter from 0 and the nonce
+    stream->state[0] = 0x61707865;
+    stream->state[1] = 0x3320646e;
+    stream->state[2] = 0x79622d32;
+    stream->state[3] = 0x6b206574;
+    memcpy(&stream->state[4], seed, 32);
+    stream->state[12] = 0;
+    stream->state[13] = 0;
+    memcpy(&stream->state[14], seed + 32, 8);
+    explicit_bzero(seed, sizeof(seed));
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        stream->level = RANDOM_AVX512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        stream->level = RANDOM_AVX2;
+    } else {
+        stream->level = RANDOM_SCALAR;
+    }
+    stream->charsStart = 0;
+    stream->charsEnd = 0;
+    return 0;
+}
+
+// Fills key with size characters, each a capital letter or a space
+void fillKey(struct keyStream *stream, char key[], size_t size) {
+    size_t filled = 0, taken;
+
+    while (filled < size) {
+        // Characters left over from the last call go first
+        if (stream->charsStart < stream->charsEnd) {
+            taken = stream->charsEnd - stream->charsStart;
+            taken = taken < size - filled ? taken : size - filled;
+            memcpy(key + filled, stream->chars + stream->charsStart, taken);
+            stream->charsStart += taken;
+            filled += taken;
+        } else if (size - filled >= KEY_STREAM_BATCH + 8) {
+            filled += makeBatch(stream, key + filled);
+        } else {
+            stream->charsStart = 0;
+            stream->charsEnd = makeBatch(stream, stream->chars);
+        }
+    }
+}
@@ -0,0 +1,49 @@
+/*********************************************************************************
+ * Filename: otp_random.h
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Key characters from a cryptographically secure generator. A key stream is
+ * ChaCha20 keyed with 32 bytes from getrandom(), run with a 64 bit block
+ * counter so one seed is good for far more than any pad we will ever need.
+ *
+ * Every byte of the cipher's output is turned into a character by rejection
+ * sampling: bytes from 243 up are thrown away and the rest taken mod 27, so
+ * each of the 27 characters is exactly as likely as any other. 95% of the
+ * bytes are kept. The vector versions run eight (AVX2) or sixteen (AVX-512)
+ * blocks of the cipher at once and sample 32 bytes at a time, and the best
+ * one the CPU has is picked at run time.
+ *********************************************************************************/
+
+#ifndef OTP_RANDOM_H
+#define OTP_RANDOM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define KEY_STREAM_BATCH 1024   // Bytes of cipher output made at once, sixteen blocks
+
+// Instruction sets the cipher and the sampling can use
+enum randomLevel {
+    RANDOM_SCALAR,
+    RANDOM_AVX2,        // Eight blocks at once, 32 bytes sampled at once
+    RANDOM_AVX512       // Sixteen blocks at once, sampled as with AVX2
+};
+
+// A source of key characters
+struct keyStream {
+    uint32_t state[16];         // Constants, key, counter and nonce of the next block
+    enum randomLevel level;     // Best the CPU supports
+    char chars[KEY_STREAM_BATCH + 8];   // Characters made and not handed out yet
+    int charsStart;
+    int charsEnd;
+};
+
+// Seeds a key stream from getrandom(). Returns -1 if the kernel has no
+// randomness to give
+int seedKeyStream(struct keyStream *stream);
+
+// Fills key with size characters, each a capital letter or a space
+void fillKey(struct keyStream *stream, char key[], size_t size);
+
+#endif
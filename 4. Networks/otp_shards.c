@@ -0,0 +1,209 @@
+/*********************************************************************************
+ * Filename: otp_shards.c
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Shard pool of the daemons (see otp_shards.h). The run of shards left to each
+ * thread is one 64 bit word, the first shard in the low half and the end in the
+ * high half, so both its owner and a thief take a shard with a single
+ * compare-and-swap. The job itself is written before the runs are published,
+ * so taking a shard also makes the job visible.
+ *********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "otp_shards.h"
+
+// A thread's run of shards, alone on its cache line so the threads taking
+// from different runs do not slow each other down
+struct shardRun {
+    uint64_t run;
+    char padding[56];
+} __attribute__((aligned(64)));
+
+// A helper thread of the pool
+struct shardWorker {
+    struct shardPool *pool;
+    int index;
+    pthread_t thread;
+};
+
+struct shardPool {
+    int nThreads;
+    struct shardWorker *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    unsigned generation;            // Counts the jobs handed to the workers
+
+    // The job being run
+    transformFunction transform;
+    const char *input;
+    const char *key;
+    char *output;
+    size_t size;
+    unsigned remaining;             // Shards not finished yet
+    size_t firstInvalid;            // Offset of the first invalid character seen
+    struct shardRun runs[SHARD_MAX_THREADS];
+};
+
+// Takes a shard from the run of thread owner: the first one for the owner
+// itself, the last one for a thief. Returns -1 if the run is empty
+static long takeShard(struct shardPool *pool, int owner, int steal) {
+    uint64_t run = __atomic_load_n(&pool->runs[owner].run, __ATOMIC_ACQUIRE), next;
+    uint32_t begin, end;
+
+    do {
+        begin = (uint32_t)run;
+        end = (uint32_t)(run >> 32);
+        if (begin >= end) {
+            return -1;
+        }
+        next = steal ? begin | (uint64_t)(end - 1) << 32 : (begin + 1) | (uint64_t)end << 32;
+    } while (!__atomic_compare_exchange_n(&pool->runs[owner].run, &run, next, 0,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return steal ? (long)end - 1 : (long)begin;
+}
+
+// Transforms one shard and records its first invalid character, if any
+static void runShard(struct shardPool *pool, long shard) {
+    size_t start = (size_t)shard * SHARD_SIZE;
+    size_t length = pool->size - start < SHARD_SIZE ? pool->size - start : SHARD_SIZE;
+    size_t valid, first;
+
+    valid = pool->transform(pool->input + start, pool->key + start, pool->output + start, length);
+    if (valid < length) {
+        first = __atomic_load_n(&pool->firstInvalid, __ATOMIC_RELAXED);
+        while (start + valid < first &&
+               !__atomic_compare_exchange_n(&pool->firstInvalid, &first, start + valid, 0,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+
+    // The caller reads the output once the count reaches 0
+    __atomic_sub_fetch(&pool->remaining, 1, __ATOMIC_RELEASE);
+}
+
+// Runs the shards of thread self, then steals from the others until none
+// are left
+static void runShards(struct shardPool *pool, int self) {
+    long shard;
+    int i;
+
+    while ((shard = takeShard(pool, self, 0)) >= 0) {
+        runShard(pool, shard);
+    }
+    for (i = 1; i < pool->nThreads; i++) {
+        while ((shard = takeShard(pool, (self + i) % pool->nThreads, 1)) >= 0) {
+            runShard(pool, shard);
+        }
+    }
+}
+
+// Body of a helper thread: sleeps until a job comes and joins in
+static void *shardWorkerMain(void *argument) {
+    struct shardWorker *worker = argument;
+    struct shardPool *pool = worker->pool;
+    unsigned seen = 0;
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->generation == seen) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        runShards(pool, worker->index);
+    }
+    return NULL;
+}
+
+// Starts a pool where nThreads threads, the caller's included, share each job.
+// Returns NULL if nThreads is below 2 or the threads cannot be started
+struct shardPool *startShardPool(int nThreads) {
+    struct shardPool *pool;
+    sigset_t allSignals, oldSignals;
+    int i;
+
+    if (nThreads > SHARD_MAX_THREADS) {
+        nThreads = SHARD_MAX_THREADS;
+    }
+    if (nThreads < 2 || posix_memalign((void**)&pool, 64, sizeof(struct shardPool)) != 0) {
+        return NULL;
+    }
+    memset(pool, 0, sizeof(struct shardPool));
+    pool->nThreads = nThreads;
+    pool->workers = calloc(nThreads, sizeof(struct shardWorker));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    // Signals are left to the thread running the daemon
+    sigfillset(&allSignals);
+    pthread_sigmask(SIG_SETMASK, &allSignals, &oldSignals);
+    for (i = 1; i < nThreads; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        if (pthread_create(&pool->workers[i].thread, NULL, shardWorkerMain, &pool->workers[i]) != 0) {
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+
+    // Go on with the threads that did start
+    pool->nThreads = i;
+    if (pool->nThreads < 2) {
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+// Runs transform over size characters like transform itself would, splitting
+// the work between the threads of the pool. Returns the offset of the first
+// invalid character, or size if there is none. Must only be called from one
+// thread at a time
+size_t shardTransform(struct shardPool *pool, transformFunction transform, const char input[],
+                      const char key[], char output[], size_t size) {
+    uint32_t nShards, perThread, extra, begin = 0, end;
+    int i;
+
+    if (size < SHARD_THRESHOLD) {
+        return transform(input, key, output, size);
+    }
+
+    pool->transform = transform;
+    pool->input = input;
+    pool->key = key;
+    pool->output = output;
+    pool->size = size;
+    pool->firstInvalid = size;
+    nShards = (size + SHARD_SIZE - 1) / SHARD_SIZE;
+    pool->remaining = nShards;
+
+    // Hand every thread an equal run of shards, which publishes the job
+    perThread = nShards / pool->nThreads;
+    extra = nShards % pool->nThreads;
+    for (i = 0; i < pool->nThreads; i++) {
+        end = begin + perThread + ((uint32_t)i < extra);
+        __atomic_store_n(&pool->runs[i].run, begin | (uint64_t)end << 32, __ATOMIC_RELEASE);
+        begin = end;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    // Work on our own run and steal the rest of the job if the helpers are
+    // slow to wake, then wait for the shards still running elsewhere
+    runShards(pool, 0);
+    while (__atomic_load_n(&pool->remaining, __ATOMIC_ACQUIRE) > 0) {
+        sched_yield();
+    }
+    return pool->firstInvalid;
+}
@@ -0,0 +1,39 @@
+/*********************************************************************************
+ * Filename: otp_shards.h
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Splits one large transform into shards that fit in the cache and runs them on
+ * a pool of threads, so a single big message is not held to one CPU. Every
+ * character is transformed on its own, so shards can run in any order and each
+ * writes its own part of the output in place.
+ *
+ * Each thread, the caller included, starts with a contiguous run of shards and
+ * takes them from the front. A thread that runs out steals from the back of
+ * another's run, so a thread that is descheduled part way does not hold the
+ * job up.
+ *********************************************************************************/
+
+#ifndef OTP_SHARDS_H
+#define OTP_SHARDS_H
+
+#include "otp_daemon.h"
+
+#define SHARD_SIZE 16384            // Characters per shard
+#define SHARD_THRESHOLD 65536       // Smallest job worth splitting
+#define SHARD_MAX_THREADS 64
+
+struct shardPool;
+
+// Starts a pool where nThreads threads, the caller's included, share each job.
+// Returns NULL if nThreads is below 2 or the threads cannot be started
+struct shardPool *startShardPool(int nThreads);
+
+// Runs transform over size characters like transform itself would, splitting
+// the work between the threads of the pool. Returns the offset of the first
+// invalid character, or size if there is none. Must only be called from one
+// thread at a time
+size_t shardTransform(struct shardPool *pool, transformFunction transform, const char input[],
+                      const char key[], char output[], size_t size);
+
+#endif
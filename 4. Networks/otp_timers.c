@@ -0,0 +1,113 @@
+/*********************************************************************************
+ * Filename: otp_timers.c
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Hashed timer wheel (see otp_timers.h). Every slot is a circular doubly linked
+ * list with the slot itself as its head, and a timer that is not armed points
+ * at nothing.
+ *********************************************************************************/
+
+#include <stddef.h>
+#include <time.h>
+
+#include "otp_timers.h"
+
+// Returns the current time in milliseconds, on a clock that never goes back
+long long monotonicMilliseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+// Sets up an empty wheel starting at the current time
+void initWheel(struct timerWheel *wheel) {
+    int i;
+
+    for (i = 0; i < WHEEL_SLOTS; i++) {
+        wheel->slots[i].next = &wheel->slots[i];
+        wheel->slots[i].prev = &wheel->slots[i];
+    }
+    wheel->tick = monotonicMilliseconds() / WHEEL_TICK_MS;
+    wheel->nArmed = 0;
+}
+
+// Whether timer is in the wheel
+int timerArmed(const struct timer *timer) {
+    return timer->next != NULL;
+}
+
+// Takes timer out of the wheel if it is armed
+void cancelTimer(struct timerWheel *wheel, struct timer *timer) {
+    if (!timerArmed(timer)) {
+        return;
+    }
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+    wheel->nArmed--;
+}
+
+// Arms timer to fire at when, given in monotonicMilliseconds() time, moving it
+// if it was armed
+void armTimer(struct timerWheel *wheel, struct timer *timer, long long when) {
+    struct timer *slot;
+
+    cancelTimer(wheel, timer);
+
+    // Round up, so a timer never fires early
+    timer->expires = (when + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    if (timer->expires <= wheel->tick) {
+        timer->expires = wheel->tick + 1;
+    }
+
+    slot = &wheel->slots[timer->expires & (WHEEL_SLOTS - 1)];
+    timer->next = slot;
+    timer->prev = slot->prev;
+    slot->prev->next = timer;
+    slot->prev = timer;
+    wheel->nArmed++;
+}
+
+// Returns how many milliseconds an event loop may sleep before the next tick
+// is due, or -1 if no timer is armed
+int wheelTimeout(const struct timerWheel *wheel) {
+    long long untilTick;
+
+    if (wheel->nArmed == 0) {
+        return -1;
+    }
+    untilTick = (wheel->tick + 1) * WHEEL_TICK_MS - monotonicMilliseconds();
+    return untilTick > 0 ? (int)untilTick : 0;
+}
+
+// Advances the wheel to the current time and returns the first timer that has
+// fired, taken out of the wheel, or NULL once there are none left. Call it
+// until it returns NULL
+struct timer *nextExpiredTimer(struct timerWheel *wheel) {
+    long long now = monotonicMilliseconds() / WHEEL_TICK_MS;
+    struct timer *slot, *timer;
+
+    // The current slot is looked at again on every call, as the timers it
+    // still holds may belong to later turns of the wheel
+    while (wheel->nArmed > 0) {
+        slot = &wheel->slots[wheel->tick & (WHEEL_SLOTS - 1)];
+        for (timer = slot->next; timer != slot; timer = timer->next) {
+            if (timer->expires <= wheel->tick) {
+                cancelTimer(wheel, timer);
+                return timer;
+            }
+        }
+        if (wheel->tick >= now) {
+            break;
+        }
+        wheel->tick++;
+    }
+
+    // Nothing is armed, so there is nothing to skip over
+    if (wheel->tick < now) {
+        wheel->tick = now;
+    }
+    return NULL;
+}
@@ -0,0 +1,60 @@
+/*********************************************************************************
+ * Filename: otp_timers.h
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Hashed timer wheel used by the event loops of the daemons to enforce the
+ * connection deadlines. Time is counted in ticks of WHEEL_TICK_MS, and a timer
+ * sits in the slot of the tick it fires on, modulo the number of slots, so
+ * arming, moving and cancelling a timer are all O(1). Each tick only looks at
+ * one slot, skipping the timers that are whole turns of the wheel away.
+ *
+ * Timers are embedded in what they time and linked into the wheel, so the
+ * wheel never allocates anything.
+ *********************************************************************************/
+
+#ifndef OTP_TIMERS_H
+#define OTP_TIMERS_H
+
+#define WHEEL_SLOTS 256         // A power of two
+#define WHEEL_TICK_MS 100
+
+// A timer, linked into the slot it fires from while it is armed
+struct timer {
+    struct timer *next;
+    struct timer *prev;
+    long long expires;          // Tick it fires on
+};
+
+struct timerWheel {
+    struct timer slots[WHEEL_SLOTS];    // Heads of the circular lists
+    long long tick;             // Last tick handled
+    int nArmed;
+};
+
+// Returns the current time in milliseconds, on a clock that never goes back
+long long monotonicMilliseconds(void);
+
+// Sets up an empty wheel starting at the current time
+void initWheel(struct timerWheel *wheel);
+
+// Whether timer is in the wheel
+int timerArmed(const struct timer *timer);
+
+// Arms timer to fire at when, given in monotonicMilliseconds() time, moving it
+// if it was armed
+void armTimer(struct timerWheel *wheel, struct timer *timer, long long when);
+
+// Takes timer out of the wheel if it is armed
+void cancelTimer(struct timerWheel *wheel, struct timer *timer);
+
+// Returns how many milliseconds an event loop may sleep before the next tick
+// is due, or -1 if no timer is armed
+int wheelTimeout(const struct timerWheel *wheel);
+
+// Advances the wheel to the current time and returns the first timer that has
+// fired, taken out of the wheel, or NULL once there are none left. Call it
+// until it returns NULL
+struct timer *nextExpiredTimer(struct timerWheel *wheel);
+
+#endif
@@ -0,0 +1,231 @@
+/*********************************************************************************
+ * Filename: otp_uring.c
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Minimal io_uring wrapper used by the uring engine of the daemons (see
+ * otp_uring.h). The rings are shared with the kernel, so indexes the kernel
+ * writes are loaded with acquire and indexes we publish are stored with release
+ * ordering.
+ *********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "otp_uring.h"
+
+// Opcodes the kernel must know before we use it. IORING_OP_SEND_ZC came in
+// with multishot receive (Linux 6.0), which cannot be probed for directly
+static const int requiredOps[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND,
+                                  IORING_OP_ASYNC_CANCEL, IORING_OP_TIMEOUT, IORING_OP_SEND_ZC};
+
+// Calls io_uring_enter(), which glibc has no wrapper for
+static int uringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+// Calls io_uring_register()
+static int uringRegister(int fd, unsigned opcode, void *arg, unsigned nArgs) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nArgs);
+}
+
+// Whether the kernel behind fd supports every opcode the engine uses
+static int hasRequiredOps(int fd) {
+    struct io_uring_probe *probe;
+    int i, supported = 1;
+    size_t probeSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+
+    probe = calloc(1, probeSize);
+    if (uringRegister(fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        free(probe);
+        return 0;
+    }
+    for (i = 0; i < (int)(sizeof(requiredOps) / sizeof(requiredOps[0])); i++) {
+        if (requiredOps[i] > probe->last_op || !(probe->ops[requiredOps[i]].flags & IO_URING_OP_SUPPORTED)) {
+            supported = 0;
+        }
+    }
+    free(probe);
+    return supported;
+}
+
+// Sets up a ring with room for entries submissions. Returns 0 on success, or
+// -1 if the kernel does not have io_uring or lacks something the engine
+// needs (multishot accept and receive and provided buffer rings)
+int uringSetup(struct uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    unsigned *sqArray, i;
+
+    memset(ring, 0, sizeof(*ring));
+
+    // Completions are only run when we ask for them, from the one thread that
+    // uses the ring. Older kernels do not know these flags
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (ring->fd < 0) {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !hasRequiredOps(ring->fd)) {
+        close(ring->fd);
+        return -1;
+    }
+
+    // Both queues live in one mapping, the submission entries in another
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring->cqRingSize > ring->sqRingSize) {
+        ring->sqRingSize = ring->cqRingSize;
+    }
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    ring->cqRing = ring->sqRing;
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->sqRing, ring->sqRingSize);
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sqHead = (unsigned*)((char*)ring->sqRing + params.sq_off.head);
+    ring->sqTail = (unsigned*)((char*)ring->sqRing + params.sq_off.tail);
+    ring->sqMask = *(unsigned*)((char*)ring->sqRing + params.sq_off.ring_mask);
+    ring->sqEntries = params.sq_entries;
+    ring->sqLocalTail = *ring->sqTail;
+    ring->cqHead = (unsigned*)((char*)ring->cqRing + params.cq_off.head);
+    ring->cqTail = (unsigned*)((char*)ring->cqRing + params.cq_off.tail);
+    ring->cqMask = *(unsigned*)((char*)ring->cqRing + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)((char*)ring->cqRing + params.cq_off.cqes);
+
+    // Slot i of the submission queue always holds entry i
+    sqArray = (unsigned*)((char*)ring->sqRing + params.sq_off.array);
+    for (i = 0; i < params.sq_entries; i++) {
+        sqArray[i] = i;
+    }
+    return 0;
+}
+
+// Tears a ring down
+void uringClose(struct uring *ring) {
+    munmap(ring->sqes, ring->sqesSize);
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+}
+
+// Returns a cleared submission entry to fill in. Submits what is queued first
+// if the ring is full
+struct io_uring_sqe *uringGetSqe(struct uring *ring) {
+    struct io_uring_sqe *sqe;
+
+    while (ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->sqEntries) {
+        uringSubmit(ring, 0);
+    }
+    sqe = &ring->sqes[ring->sqLocalTail & ring->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqLocalTail++;
+    return sqe;
+}
+
+// Submits every entry filled in since the last call and waits until at least
+// waitFor completions are ready. Returns 0, or -errno on failure
+int uringSubmit(struct uring *ring, unsigned waitFor) {
+    unsigned toSubmit;
+    int result;
+
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+    toSubmit = ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    do {
+        result = uringEnter(ring->fd, toSubmit, waitFor, IORING_ENTER_GETEVENTS);
+    } while (result < 0 && errno == EINTR);
+    return result < 0 ? -errno : 0;
+}
+
+// Returns the next completion, or NULL if there is none. It stays valid until
+// uringSeen is called
+struct io_uring_cqe *uringPeek(struct uring *ring) {
+    unsigned head = *ring->cqHead;
+
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cqMask];
+}
+
+// Marks the completion returned by uringPeek as handled
+void uringSeen(struct uring *ring) {
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+// Hands buffer bufferId to the kernel without publishing it yet
+static void addBuffer(struct uringBuffers *buffers, unsigned bufferId, unsigned offset) {
+    struct io_uring_buf *buffer;
+
+    buffer = &buffers->ring->bufs[(buffers->ring->tail + offset) & (buffers->count - 1)];
+    buffer->addr = (unsigned long)uringBuffer(buffers, bufferId);
+    buffer->len = buffers->size;
+    buffer->bid = bufferId;
+}
+
+// Registers count buffers of size bytes with the kernel as group groupId.
+// Returns 0 on success, -1 on failure
+int uringProvideBuffers(struct uring *ring, struct uringBuffers *buffers, unsigned count, unsigned size,
+                        int groupId) {
+    struct io_uring_buf_reg registration;
+    size_t ringSize = count * sizeof(struct io_uring_buf);
+    unsigned i;
+
+    buffers->count = count;
+    buffers->size = size;
+    buffers->groupId = groupId;
+    buffers->ring = mmap(NULL, ringSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers->ring == MAP_FAILED) {
+        return -1;
+    }
+    buffers->memory = mmap(NULL, (size_t)count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                           -1, 0);
+    if (buffers->memory == MAP_FAILED) {
+        munmap(buffers->ring, ringSize);
+        return -1;
+    }
+
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (unsigned long)buffers->ring;
+    registration.ring_entries = count;
+    registration.bgid = groupId;
+    if (uringRegister(ring->fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+        munmap(buffers->memory, (size_t)count * size);
+        munmap(buffers->ring, ringSize);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        addBuffer(buffers, i, i);
+    }
+    __atomic_store_n(&buffers->ring->tail, buffers->ring->tail + count, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Returns the buffer with id bufferId to the kernel once its data is used
+void uringRecycleBuffer(struct uringBuffers *buffers, unsigned bufferId) {
+    addBuffer(buffers, bufferId, 0);
+    __atomic_store_n(&buffers->ring->tail, buffers->ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+// Where the data of buffer bufferId is
+char *uringBuffer(struct uringBuffers *buffers, unsigned bufferId) {
+    return buffers->memory + (size_t)bufferId * buffers->size;
+}
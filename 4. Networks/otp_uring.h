@@ -0,0 +1,81 @@
+/*********************************************************************************
+ * Filename: otp_uring.h
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Minimal io_uring wrapper used by the uring engine of the daemons, talking to
+ * the kernel with the raw system calls so nothing beyond the kernel headers is
+ * needed. It covers what the engine uses: a submission and completion queue
+ * pair, and a ring of provided receive buffers the kernel picks from, so
+ * connections waiting for data do not each hold a buffer of their own.
+ *********************************************************************************/
+
+#ifndef OTP_URING_H
+#define OTP_URING_H
+
+#include <linux/io_uring.h>
+
+// A submission and completion queue pair
+struct uring {
+    int fd;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned sqEntries;
+    struct io_uring_sqe *sqes;
+    unsigned sqLocalTail;       // Entries handed out, published on submit
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    size_t sqesSize;
+};
+
+// Receive buffers provided to the kernel as buffer group groupId
+struct uringBuffers {
+    struct io_uring_buf_ring *ring;
+    char *memory;
+    unsigned count;             // Number of buffers, a power of two
+    unsigned size;              // Size of each buffer
+    int groupId;
+};
+
+// Sets up a ring with room for entries submissions. Returns 0 on success, or
+// -1 if the kernel does not have io_uring or lacks something the engine
+// needs (multishot accept and receive and provided buffer rings)
+int uringSetup(struct uring *ring, unsigned entries);
+
+// Tears a ring down
+void uringClose(struct uring *ring);
+
+// Returns a cleared submission entry to fill in. Submits what is queued first
+// if the ring is full
+struct io_uring_sqe *uringGetSqe(struct uring *ring);
+
+// Submits every entry filled in since the last call and waits until at least
+// waitFor completions are ready. Returns 0, or -errno on failure
+int uringSubmit(struct uring *ring, unsigned waitFor);
+
+// Returns the next completion, or NULL if there is none. It stays valid until
+// uringSeen is called
+struct io_uring_cqe *uringPeek(struct uring *ring);
+
+// Marks the completion returned by uringPeek as handled
+void uringSeen(struct uring *ring);
+
+// Registers count buffers of size bytes with the kernel as group groupId.
+// Returns 0 on success, -1 on failure
+int uringProvideBuffers(struct uring *ring, struct uringBuffers *buffers, unsigned count, unsigned size,
+                        int groupId);
+
+// Returns the buffer with id bufferId to the kernel once its data is used
+void uringRecycleBuffer(struct uringBuffers *buffers, unsigned bufferId);
+
+// Where the data of buffer bufferId is
+char *uringBuffer(struct uringBuffers *buffers, unsigned bufferId);
+
+#endif
@@ -0,0 +1,274 @@
+/*********************************************************************************
+ * Filename: otp_vault.c
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Key vault of the daemons (see otp_vault.h). Mapped keys are kept in a small
+ * table for the life of the process. A key file is looked up with stat() on
+ * every use, and mapped again if it is not the file we mapped before.
+ *********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#include "otp_vault.h"
+
+#define MAX_MAPPED_KEYS 32
+
+// A key file mapped into memory
+struct mappedKey {
+    char id[KEY_ID_MAX + 1];
+    const char *data;
+    off_t size;
+    dev_t device;
+    ino_t inode;
+};
+
+// A used range of a key, as stored in its ledger
+struct keyRange {
+    int64_t offset;
+    int64_t length;
+};
+
+static struct mappedKey mappedKeys[MAX_MAPPED_KEYS];
+static int nMapped = 0;
+
+// Copies a key id into id if it is one we accept: 1 to KEY_ID_MAX letters,
+// digits, '-' or '_', so it is always a plain file name in the vault.
+// Returns 0 if it is not
+static int copyKeyId(char id[KEY_ID_MAX + 1], const char *source, int length) {
+    int i;
+
+    if (length < 1 || length > KEY_ID_MAX) {
+        return 0;
+    }
+    for (i = 0; i < length; i++) {
+        if (!(source[i] >= 'a' && source[i] <= 'z') && !(source[i] >= 'A' && source[i] <= 'Z') &&
+                !(source[i] >= '0' && source[i] <= '9') && source[i] != '-' && source[i] != '_') {
+            return 0;
+        }
+    }
+    memcpy(id, source, length);
+    id[length] = '\0';
+    return 1;
+}
+
+// Returns the mapping of key id, mapping it first if needed. Returns NULL if
+// there is no such key
+static struct mappedKey *mapKey(const char *directory, const char *id) {
+    struct mappedKey *mapped = NULL;
+    struct stat keyInfo;
+    char path[4096];
+    void *data;
+    int i, fd;
+
+    snprintf(path, sizeof(path), "%s/%s", directory, id);
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &keyInfo) < 0 || keyInfo.st_size == 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    for (i = 0; i < nMapped; i++) {
+        if (!strcmp(mappedKeys[i].id, id)) {
+            mapped = &mappedKeys[i];
+            break;
+        }
+    }
+
+    // Still the file we mapped
+    if (mapped != NULL && mapped->device == keyInfo.st_dev && mapped->inode == keyInfo.st_ino &&
+            mapped->size == keyInfo.st_size) {
+        close(fd);
+        return mapped;
+    }
+
+    data = mmap(NULL, keyInfo.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+
+    // Replace the old mapping, or take a new slot (the oldest once full)
+    if (mapped != NULL) {
+        munmap((void*)mapped->data, mapped->size);
+    } else if (nMapped < MAX_MAPPED_KEYS) {
+        mapped = &mappedKeys[nMapped++];
+    } else {
+        mapped = &mappedKeys[0];
+        munmap((void*)mapped->data, mapped->size);
+        memmove(&mappedKeys[0], &mappedKeys[1], (MAX_MAPPED_KEYS - 1) * sizeof(struct mappedKey));
+        mapped = &mappedKeys[MAX_MAPPED_KEYS - 1];
+    }
+    strcpy(mapped->id, id);
+    mapped->data = data;
+    mapped->size = keyInfo.st_size;
+    mapped->device = keyInfo.st_dev;
+    mapped->inode = keyInfo.st_ino;
+    return mapped;
+}
+
+// Records [offset, offset + length) of key id as used.
+// Returns NULL on success or the reason it cannot be used
+static const char *consumeRange(const char *directory, const char *id, long long offset, int length) {
+    struct keyRange ranges[256], range;
+    const char *reason = NULL;
+    char path[4096];
+    int fd, i, nRanges;
+    ssize_t charsRead;
+
+    snprintf(path, sizeof(path), "%s/%s.used", directory, id);
+    fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (fd < 0) {
+        return "cannot open key ledger";
+    }
+
+    // Other workers and children may be checking the same key
+    while (flock(fd, LOCK_EX) < 0) {
+        if (errno != EINTR) {
+            close(fd);
+            return "cannot lock key ledger";
+        }
+    }
+
+    while (reason == NULL && (charsRead = read(fd, ranges, sizeof(ranges))) > 0) {
+        nRanges = charsRead / sizeof(struct keyRange);
+        for (i = 0; i < nRanges; i++) {
+            if (offset < ranges[i].offset + ranges[i].length && ranges[i].offset < offset + length) {
+                reason = "key range already used";
+                break;
+            }
+        }
+    }
+
+    if (reason == NULL) {
+        range.offset = offset;
+        range.length = length;
+        if (write(fd, &range, sizeof(range)) != sizeof(range)) {
+            reason = "cannot write key ledger";
+        }
+    }
+
+    // Closing releases the lock
+    close(fd);
+    return reason;
+}
+
+// Points *key at size bytes of key id in directory, starting at offset. With
+// consume set the range is also recorded as used and must not have been used
+// before. Returns NULL on success or the reason the key cannot be used
+const char *lookupKey(const char *directory, int consume, const char *id, int idLength,
+                      long long offset, int size, const char **key) {
+    struct mappedKey *mapped;
+    char keyId[KEY_ID_MAX + 1];
+    const char *reason;
+
+    if (directory == NULL) {
+        return "no key vault";
+    }
+    if (!copyKeyId(keyId, id, idLength)) {
+        return "bad key id";
+    }
+    mapped = mapKey(directory, keyId);
+    if (mapped == NULL) {
+        return "no such key";
+    }
+    // Checked without adding to the offset, which the client picks and could
+    // overflow the sum
+    if (size > mapped->size || offset < 0 || offset > mapped->size - size) {
+        return "key is too short";
+    }
+
+    if (consume && size > 0) {
+        reason = consumeRange(directory, keyId, offset, size);
+        if (reason != NULL) {
+            return reason;
+        }
+    }
+    *key = mapped->data + offset;
+    return NULL;
+}
+
+// Abandons an unfinished upload and removes its temporary file
+void abortUpload(struct keyUpload *upload) {
+    close(upload->fd);
+    unlink(upload->path);
+    free(upload);
+}
+
+// Adds size bytes of key id to the upload in *upload, starting a new one if
+// there is none. Once last is set the key is moved into the vault, and it is an
+// error for a key with the same id to be there already. Returns NULL on success
+// or the reason the upload failed, in which case it has been abandoned
+const char *storeKey(const char *directory, struct keyUpload **upload, const char *id, int idLength,
+                     const char *data, int size, int last) {
+    struct keyUpload *current = *upload;
+    char keyId[KEY_ID_MAX + 1];
+    char path[4096];
+    const char *reason = NULL;
+    ssize_t charsWritten;
+
+    if (directory == NULL) {
+        return "no key vault";
+    }
+    if (!copyKeyId(keyId, id, idLength)) {
+        reason = "bad key id";
+    } else if (current != NULL && strcmp(current->id, keyId)) {
+        reason = "key id changed during upload";
+    }
+
+    // Start a new upload in a temporary file of the vault
+    if (reason == NULL && current == NULL) {
+        current = calloc(1, sizeof(struct keyUpload));
+        strcpy(current->id, keyId);
+        snprintf(current->path, sizeof(current->path), "%s/.%s.XXXXXX", directory, keyId);
+        current->fd = mkstemp(current->path);
+        if (current->fd < 0) {
+            free(current);
+            current = NULL;
+            reason = "cannot create key";
+        }
+        *upload = current;
+    }
+
+    while (reason == NULL && size > 0) {
+        charsWritten = write(current->fd, data, size);
+        if (charsWritten < 0 && errno == EINTR) {
+            continue;
+        } else if (charsWritten < 0) {
+            reason = "cannot write key";
+            break;
+        }
+        data += charsWritten;
+        size -= charsWritten;
+    }
+
+    // link() never replaces a key that is already there, unlike rename()
+    if (reason == NULL && last) {
+        snprintf(path, sizeof(path), "%s/%s", directory, keyId);
+        if (fsync(current->fd) < 0) {
+            reason = "cannot write key";
+        } else if (link(current->path, path) < 0) {
+            reason = errno == EEXIST ? "key already exists" : "cannot create key";
+        }
+    }
+
+    if (reason != NULL || last) {
+        if (current != NULL) {
+            abortUpload(current);
+        }
+        *upload = NULL;
+    }
+    return reason;
+}
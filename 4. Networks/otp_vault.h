@@ -0,0 +1,48 @@
+/*********************************************************************************
+ * Filename: otp_vault.h
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * Key vault of the daemons, started with --vault DIR. Every key is a file in DIR
+ * named after its id, either put there beforehand or uploaded by a client, and a
+ * job can then name a key id and an offset instead of sending the key along.
+ * Keys are memory-mapped when first used.
+ *
+ * A one-time pad must never be used twice, so otp_enc_d records every range of a
+ * key it encrypts with in DIR/<id>.used and refuses ranges that overlap one used
+ * before. The ledger is locked with flock() while it is checked and extended, so
+ * workers and forked children sharing the directory never hand out the same
+ * range. otp_dec_d only reads keys.
+ *********************************************************************************/
+
+#ifndef OTP_VAULT_H
+#define OTP_VAULT_H
+
+#include "otp_protocol.h"
+
+#define KEY_ID_MAX OTP_KEY_ID_MAX
+
+// A key being uploaded into the vault
+struct keyUpload {
+    int fd;                     // Temporary file the key is written to
+    char id[KEY_ID_MAX + 1];
+    char path[4096];            // Name of the temporary file
+};
+
+// Points *key at size bytes of key id in directory, starting at offset. With
+// consume set the range is also recorded as used and must not have been used
+// before. Returns NULL on success or the reason the key cannot be used
+const char *lookupKey(const char *directory, int consume, const char *id, int idLength,
+                      long long offset, int size, const char **key);
+
+// Adds size bytes of key id to the upload in *upload, starting a new one if
+// there is none. Once last is set the key is moved into the vault, and it is an
+// error for a key with the same id to be there already. Returns NULL on success
+// or the reason the upload failed, in which case it has been abandoned
+const char *storeKey(const char *directory, struct keyUpload **upload, const char *id, int idLength,
+                     const char *data, int size, int last);
+
+// Abandons an unfinished upload and removes its temporary file
+void abortUpload(struct keyUpload *upload);
+
+#endif
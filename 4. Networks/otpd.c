@@ -0,0 +1,73 @@
+/*********************************************************************************
+ * Filename: otpd.c
+ * Author:   Ivan Timothy Halim
+ * Date:     10/18/2026
+ *
+ * This program runs in the background as a daemon, doing the work of otp_enc_d
+ * and otp_dec_d together on one port. Each client says in its hello whether it
+ * is otp_enc or otp_dec, and is served as the matching daemon would serve it:
+ * plaintexts are encrypted, ciphertexts decrypted, and only encryption uses up
+ * vault key ranges. Both kinds of client share the same processes, buffers and
+ * shard threads, and the same vault.
+ *
+ * USAGE: otpd [port] [--engine fork|epoll|uring] [--workers N] [--threads N] [--vault DIR]
+ *        [--header-timeout S] [--body-timeout S] [--idle-timeout S]
+ *        [--backlog N] [--max-sessions N] [--max-inflight MB] [--queue-wait S]
+ *        [--metrics PATH] [--local PATH] &
+ *********************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#include "otp_daemon.h"
+#include "otp_kernels.h"
+
+int main(int argc, char *argv[]) {
+    int listenSocketFD;
+    struct daemonConfig config;
+
+    // Pick the kernel once, before any worker or child is forked. Its two
+    // transforms serve the two roles directly, each its own loop
+    const struct otpKernel *kernel = selectKernel();
+
+    // Check usage & args
+    config.name = "otpd";
+    config.roles[0].clientName = "otp_enc";
+    config.roles[0].transform = kernel->encrypt;
+    config.roles[0].consumesKey = 1;    // Never encrypt twice with the same part of a key
+    config.roles[1].clientName = "otp_dec";
+    config.roles[1].transform = kernel->decrypt;
+    config.roles[1].consumesKey = 0;
+    config.nRoles = 2;
+    parseArguments(argc, argv, &config);
+
+    // Count from the start, in memory every worker and child shares
+    setupMetrics(&config);
+
+    // Listen for local clients too, on one socket every worker shares
+    openLocalSocket(&config);
+
+    // Hand the port over to a pool of workers if asked to
+    if (config.workers > 0) {
+        runWorkers(&config);
+    }
+
+    listenSocketFD = openListenSocket(&config, 0);
+
+    // Serve every connection from this process if asked to, or each in a
+    // child of its own
+    if (config.engine == ENGINE_EPOLL) {
+        runEventLoop(listenSocketFD, &config);
+    } else if (config.engine == ENGINE_URING) {
+        runUringLoop(listenSocketFD, &config);
+    } else {
+        runForkLoop(listenSocketFD, &config);
+    }
+}